@@ -0,0 +1,178 @@
+﻿//////////////////////////////////////////////////////////////////////////////
+// arena --- reusable aligned buffers of the sound player
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "arena.h"
+#include <cstdlib>
+#include <cassert>
+#include <new>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <malloc.h>
+#else
+    #include <sys/mman.h>
+#endif
+
+// ラージページの大きさ（バイト）。使えなければ0
+static size_t vsk_arena_huge_page_size(void)
+{
+#ifdef _WIN32
+    return GetLargePageMinimum();
+#elif defined(MADV_HUGEPAGE)
+    return 2 * 1024 * 1024;
+#else
+    return 0;
+#endif
+}
+
+VskBufferArena::VskBufferArena()
+{
+    const char *env = std::getenv("CMD_SING_HUGE_PAGES");
+    m_huge_pages = (env && env[0] == '1');
+}
+
+VskBufferArena::~VskBufferArena()
+{
+    assert(m_used.empty());
+    trim();
+}
+
+// システムから確保する
+VskBufferArena::Block VskBufferArena::allocate(size_t bytes)
+{
+    Block block = { nullptr, bytes, false };
+
+    // ラージページより小さければ普通のページで十分
+    size_t huge = (m_huge_pages ? vsk_arena_huge_page_size() : 0);
+    if (huge && bytes >= huge) {
+        size_t size = (bytes + huge - 1) / huge * huge;
+#ifdef _WIN32
+        // SeLockMemoryPrivilegeがなければ失敗する
+        block.m_ptr = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                   PAGE_READWRITE);
+#else
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr != MAP_FAILED) {
+            madvise(ptr, size, MADV_HUGEPAGE);
+            block.m_ptr = ptr;
+        }
+#endif
+        if (block.m_ptr) {
+            block.m_size = size;
+            block.m_huge = true;
+            ++m_stats.m_huge_allocs;
+        }
+    }
+
+    if (!block.m_ptr) {
+#ifdef _WIN32
+        block.m_ptr = _aligned_malloc(bytes, VSK_ARENA_ALIGNMENT);
+#else
+        if (posix_memalign(&block.m_ptr, VSK_ARENA_ALIGNMENT, bytes) != 0)
+            block.m_ptr = nullptr;
+#endif
+        if (!block.m_ptr)
+            throw std::bad_alloc();
+    }
+
+    ++m_stats.m_allocs;
+    m_stats.m_reserved_bytes += block.m_size;
+    if (m_stats.m_peak_reserved_bytes < m_stats.m_reserved_bytes)
+        m_stats.m_peak_reserved_bytes = m_stats.m_reserved_bytes;
+    return block;
+}
+
+// システムに返す
+void VskBufferArena::deallocate(const Block& block)
+{
+    m_stats.m_reserved_bytes -= block.m_size;
+    if (block.m_huge) {
+#ifdef _WIN32
+        VirtualFree(block.m_ptr, 0, MEM_RELEASE);
+#else
+        munmap(block.m_ptr, block.m_size);
+#endif
+        return;
+    }
+#ifdef _WIN32
+    _aligned_free(block.m_ptr);
+#else
+    std::free(block.m_ptr);
+#endif
+}
+
+void *VskBufferArena::acquire(size_t bytes)
+{
+    if (bytes == 0)
+        bytes = 1;
+    bytes = (bytes + VSK_ARENA_GRANULARITY - 1) / VSK_ARENA_GRANULARITY * VSK_ARENA_GRANULARITY;
+
+    m_lock.lock();
+    ++m_stats.m_acquires;
+
+    // 足りるうちで一番小さい空きを探す
+    size_t best = m_free.size();
+    for (size_t i = 0; i < m_free.size(); ++i) {
+        if (m_free[i].m_size >= bytes && (best == m_free.size() || m_free[i].m_size < m_free[best].m_size))
+            best = i;
+    }
+
+    Block block;
+    if (best < m_free.size()) {
+        block = m_free[best];
+        m_free[best] = m_free.back();
+        m_free.pop_back();
+    } else {
+        // 足りない空きがあれば一つ手放して、空きが増え続けないようにする
+        if (m_free.size()) {
+            deallocate(m_free.back());
+            m_free.pop_back();
+        }
+        try {
+            block = allocate(bytes);
+        } catch (...) {
+            m_lock.unlock();
+            throw;
+        }
+    }
+
+    m_used.push_back(block);
+    m_lock.unlock();
+    return block.m_ptr;
+}
+
+void VskBufferArena::release(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    m_lock.lock();
+    for (size_t i = 0; i < m_used.size(); ++i) {
+        if (m_used[i].m_ptr == ptr) {
+            m_free.push_back(m_used[i]);
+            m_used[i] = m_used.back();
+            m_used.pop_back();
+            break;
+        }
+    }
+    m_lock.unlock();
+}
+
+void VskBufferArena::trim()
+{
+    m_lock.lock();
+    for (auto& block : m_free)
+        deallocate(block);
+    m_free.clear();
+    m_lock.unlock();
+}
+
+VskArenaStats VskBufferArena::get_stats()
+{
+    m_lock.lock();
+    VskArenaStats stats = m_stats;
+    m_lock.unlock();
+    return stats;
+}
@@ -0,0 +1,144 @@
+//////////////////////////////////////////////////////////////////////////////
+// arena --- reusable aligned buffers of the sound player
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+    #define UNBOOST_USE_WIN32_THREAD
+    #include "unboost/mutex.hpp"
+#else
+    #define UNBOOST_USE_POSIX_THREAD
+    #include "unboost/mutex.hpp"
+#endif
+
+// バッファの先頭の境界（バイト）
+#define VSK_ARENA_ALIGNMENT 64
+
+// バッファの大きさの単位（バイト）。近い大きさの要求で同じバッファを使い回せるようにする
+#define VSK_ARENA_GRANULARITY (64 * 1024)
+
+//////////////////////////////////////////////////////////////////////////////
+// VskArenaStats - 割り当ての統計
+
+struct VskArenaStats {
+    uint64_t    m_acquires = 0;             // バッファを借りた回数
+    uint64_t    m_allocs = 0;               // システムから確保した回数
+    uint64_t    m_huge_allocs = 0;          // そのうちラージページで確保した回数
+    size_t      m_reserved_bytes = 0;       // 確保しているバイト数
+    size_t      m_peak_reserved_bytes = 0;  // 確保したバイト数の最大値
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// VskBufferArena - 使い回すバッファの置き場
+//
+// 返されたバッファは解放せずに取っておき、次に同じくらいの大きさが要求されたら
+// そのまま貸し出す。演奏のたびにページフォールトやゼロ埋めが起こらなくなる。
+// 複数のスレッドから使ってよい。
+// 環境変数 CMD_SING_HUGE_PAGES=1 か set_huge_pages(true) でラージページを試す。
+// 使えなければ普通のページで確保する。
+
+class VskBufferArena {
+public:
+    VskBufferArena();
+    ~VskBufferArena();
+
+    // bytesバイト以上のバッファを借りる。中身は不定
+    void *acquire(size_t bytes);
+    // 借りたバッファを返す
+    void release(void *ptr);
+    // 空いているバッファをすべてシステムに返す
+    void trim();
+
+    void set_huge_pages(bool enable) { m_huge_pages = enable; }
+    VskArenaStats get_stats();
+
+protected:
+    struct Block {
+        void   *m_ptr;
+        size_t  m_size;
+        bool    m_huge;
+    };
+    unboost::mutex      m_lock;
+    std::vector<Block>  m_free;         // 空いているバッファ
+    std::vector<Block>  m_used;         // 貸し出し中のバッファ
+    bool                m_huge_pages;   // ラージページを試すか？
+    VskArenaStats       m_stats;
+
+    Block allocate(size_t bytes);
+    void deallocate(const Block& block);
+
+    VskBufferArena(const VskBufferArena&) = delete;
+    VskBufferArena& operator=(const VskBufferArena&) = delete;
+}; // class VskBufferArena
+
+//////////////////////////////////////////////////////////////////////////////
+// VskArenaBuffer - 置き場から借りた型つきのバッファ
+//
+// 破棄するときに置き場に返す。ムーブだけできる。
+
+template <typename T_VALUE>
+class VskArenaBuffer {
+public:
+    VskArenaBuffer() { }
+    VskArenaBuffer(VskBufferArena& arena, size_t count)
+        : m_arena(&arena)
+        , m_data(static_cast<T_VALUE *>(arena.acquire(count * sizeof(T_VALUE))))
+        , m_count(count)
+    {
+    }
+    VskArenaBuffer(VskArenaBuffer&& other)
+        : m_arena(other.m_arena), m_data(other.m_data), m_count(other.m_count)
+    {
+        other.m_arena = nullptr;
+        other.m_data = nullptr;
+        other.m_count = 0;
+    }
+    VskArenaBuffer& operator=(VskArenaBuffer&& other) {
+        if (this != &other) {
+            reset();
+            m_arena = other.m_arena;
+            m_data = other.m_data;
+            m_count = other.m_count;
+            other.m_arena = nullptr;
+            other.m_data = nullptr;
+            other.m_count = 0;
+        }
+        return *this;
+    }
+    ~VskArenaBuffer() { reset(); }
+
+    void reset() {
+        if (m_data)
+            m_arena->release(m_data);
+        m_arena = nullptr;
+        m_data = nullptr;
+        m_count = 0;
+    }
+
+    // 値をゼロで埋める
+    void zero() {
+        if (m_count)
+            std::memset(m_data, 0, m_count * sizeof(T_VALUE));
+    }
+
+    T_VALUE *data() const { return m_data; }
+    size_t size() const { return m_count; }
+    T_VALUE& operator[](size_t index) const { return m_data[index]; }
+
+protected:
+    VskBufferArena *m_arena = nullptr;
+    T_VALUE        *m_data = nullptr;
+    size_t          m_count = 0;
+
+    VskArenaBuffer(const VskArenaBuffer&) = delete;
+    VskArenaBuffer& operator=(const VskArenaBuffer&) = delete;
+}; // class VskArenaBuffer
+
+//////////////////////////////////////////////////////////////////////////////
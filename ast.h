@@ -3,8 +3,6 @@
 #include <memory>
 #include <map>
 
-extern std::map<VskString, VskString> g_variables;
-
 struct VskAst
 {
     VskString m_str;
@@ -31,20 +29,20 @@ struct VskAst
 };
 typedef std::shared_ptr<VskAst> VskAstPtr;
 
-inline VskAstPtr vsk_eval_text(const VskString& str)
+inline VskAstPtr vsk_eval_text(const VskString& str, std::map<VskString, VskString>& variables)
 {
     if (str.size() && str[0] == '(' && str[str.size() - 1] == ')')
     {
         VskString var = str.substr(1, str.size() - 2);
-        return std::make_shared<VskAst>(g_variables[var]);
+        return std::make_shared<VskAst>(variables[var]);
     }
     return std::make_shared<VskAst>(str);
 }
 
-inline VskAstPtr vsk_eval_cmd_play_text(const VskString& str)
+inline VskAstPtr vsk_eval_cmd_play_text(const VskString& str, std::map<VskString, VskString>& variables)
 {
     if (str.size() && !vsk_isdigit(str[0])) {
-        return std::make_shared<VskAst>(g_variables[str]);
+        return std::make_shared<VskAst>(variables[str]);
     }
     return std::make_shared<VskAst>(str);
 }
@@ -0,0 +1,259 @@
+﻿//////////////////////////////////////////////////////////////////////////////
+// batch --- renders many CMD SING scores to many WAV files at once
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "batch.h"
+#include "engine.h"
+#include <cstdio>
+#include <deque>
+#include <chrono>
+#include <stdexcept>
+
+//////////////////////////////////////////////////////////////////////////////
+// マニフェスト
+
+// Shift_JIS文字列をワイド文字列に変換
+static std::wstring vsk_batch_wide_from_sjis(const VskString& str)
+{
+#ifdef _WIN32
+    int size = MultiByteToWideChar(932, 0, str.c_str(), -1, nullptr, 0);
+    if (size == 0)
+        return L"";
+    std::wstring wide;
+    wide.resize(size - 1);
+    MultiByteToWideChar(932, 0, str.c_str(), -1, &wide[0], size);
+    return wide;
+#else
+    return std::wstring(str.begin(), str.end()); // バイト列をそのまま渡す
+#endif
+}
+
+// マニフェストの一行を解析する
+static bool vsk_batch_parse_line(const VskString& line, VskBatchJob& job)
+{
+    // 文字列
+    size_t tab1 = line.find('\t');
+    if (tab1 == line.npos || tab1 == 0)
+        return false;
+    job.m_score = line.substr(0, tab1);
+
+    // 出力ファイル
+    size_t tab2 = line.find('\t', tab1 + 1);
+    VskString output = line.substr(tab1 + 1, (tab2 == line.npos) ? line.npos : tab2 - (tab1 + 1));
+    if (output.empty())
+        return false;
+    job.m_output = vsk_batch_wide_from_sjis(output);
+    if (tab2 == line.npos)
+        return true;
+
+    // オプション
+    const char *pch = line.c_str() + tab2 + 1;
+    for (;;) {
+        while (*pch == ' ' || *pch == '\t')
+            ++pch;
+        if (!*pch)
+            break;
+        VskString opt;
+        while (*pch && *pch != ' ' && *pch != '\t')
+            opt += *pch++;
+
+        if (opt == "-format") {
+            // 次の語が形式
+            while (*pch == ' ' || *pch == '\t')
+                ++pch;
+            VskString name;
+            while (*pch && *pch != ' ' && *pch != '\t')
+                name += *pch++;
+            if (!vsk_sample_format_from_name(name.c_str(), job.m_format))
+                return false;
+            continue;
+        }
+
+        if (opt == "-mono") {
+            job.m_stereo = false;
+        } else if (opt == "-stereo") {
+            job.m_stereo = true;
+        } else if (opt.size() > 2 && opt[0] == '-' && (opt[1] == 'D' || opt[1] == 'd')) {
+            auto ich = opt.find('=');
+            if (ich == opt.npos)
+                return false;
+            auto var = opt.substr(2, ich - 2);
+            auto value = opt.substr(ich + 1);
+            CharUpperA(&var[0]);
+            CharUpperA(&value[0]);
+            job.m_variables[var] = value;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// マニフェストを読み込む。不正な行があれば失敗する
+bool vsk_batch_load_manifest(const wchar_t *filename, bool stereo, VskSampleFormat format,
+                             std::vector<VskBatchJob>& jobs)
+{
+    jobs.clear();
+
+    FILE *fin = _wfopen(filename, L"rb");
+    if (!fin)
+        return false;
+
+    bool ok = true;
+    char buf[4096];
+    VskString line;
+    size_t iline = 0;
+    while (ok && std::fgets(buf, sizeof(buf), fin)) {
+        line += buf;
+        if (line.empty() || (line.back() != '\n' && !std::feof(fin)))
+            continue; // 行の続きを読む
+
+        ++iline;
+        while (line.size() && (line.back() == '\n' || line.back() == '\r'))
+            line.pop_back();
+
+        if (line.size() && line[0] != '#') {
+            VskBatchJob job;
+            job.m_line = iline;
+            job.m_stereo = stereo;
+            job.m_format = format;
+            if (vsk_batch_parse_line(line, job))
+                jobs.push_back(job);
+            else
+                ok = false;
+        }
+        line.clear();
+    }
+
+    std::fclose(fin);
+    return ok;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// ワークスティーリングによる並列描画
+
+// ワーカーごとの仕事の列。自分の列は前から取り、空になったら他の列の後ろから盗む
+struct VskBatchQueue
+{
+    unboost::mutex      m_lock;
+    std::deque<size_t>  m_jobs;
+};
+
+// 仕事を一つ取る
+static bool vsk_batch_take(std::vector<std::unique_ptr<VskBatchQueue>>& queues, size_t k, size_t& job)
+{
+    // 自分の列の前から
+    VskBatchQueue& mine = *queues[k];
+    mine.m_lock.lock();
+    bool found = !mine.m_jobs.empty();
+    if (found) {
+        job = mine.m_jobs.front();
+        mine.m_jobs.pop_front();
+    }
+    mine.m_lock.unlock();
+    if (found)
+        return true;
+
+    // 他の列の後ろから
+    for (size_t i = 1; i < queues.size(); ++i) {
+        VskBatchQueue& victim = *queues[(k + i) % queues.size()];
+        victim.m_lock.lock();
+        found = !victim.m_jobs.empty();
+        if (found) {
+            job = victim.m_jobs.back();
+            victim.m_jobs.pop_back();
+        }
+        victim.m_lock.unlock();
+        if (found)
+            return true;
+    }
+
+    return false;
+}
+
+// 一つの仕事を描画してWAVファイルに保存する
+static VSK_SOUND_ERR vsk_batch_render_one(VskEngine& engine, VskEngine& base, const VskBatchJob& job)
+{
+    // 新しいプロセスで実行したのと同じ状態から始める
+    engine.m_player->reset();
+    engine.m_player->m_sample_format = job.m_format;
+    engine.m_sing_setting = base.m_sing_setting;
+    engine.m_variables = base.m_variables;
+    for (auto& pair : job.m_variables)
+        engine.m_variables[pair.first] = pair.second;
+
+    try {
+        return vsk_sound_cmd_sing_save(engine, job.m_score.c_str(), job.m_output.c_str(), job.m_stereo);
+    } catch (const std::runtime_error&) {
+        return VSK_SOUND_ERR_ILLEGAL; // 変数の循環参照
+    }
+}
+
+// 仕事の集まりを並列に描画する。baseの設定と変数を各仕事の初期状態とする
+void vsk_batch_render(VskEngine& base, const char *rhythm_path, const std::vector<VskBatchJob>& jobs,
+                      size_t num_threads, VskBatchResult& result)
+{
+    result = VskBatchResult();
+
+    typedef std::chrono::steady_clock clock_type;
+    auto t0 = clock_type::now();
+
+    if (num_threads == 0)
+        num_threads = unboost::thread::hardware_concurrency();
+    if (num_threads > jobs.size())
+        num_threads = jobs.size();
+    if (num_threads == 0)
+        num_threads = 1;
+
+    // 仕事を連続した区間に分けて各ワーカーに配る
+    std::vector<std::unique_ptr<VskBatchQueue>> queues;
+    for (size_t k = 0; k < num_threads; ++k)
+        queues.emplace_back(new VskBatchQueue());
+    for (size_t i = 0; i < jobs.size(); ++i)
+        queues[i * num_threads / jobs.size()]->m_jobs.push_back(i);
+
+    std::vector<VSK_SOUND_ERR> errors(jobs.size(), VSK_SOUND_ERR_SUCCESS);
+    std::vector<uint64_t> num_samples(num_threads, 0);
+
+    // ワーカーごとにエンジンを作る。
+    // 仕事の中でさらにスレッドを増やさないようにする
+    auto worker = [&](size_t k) {
+        VskEngine engine;
+        vsk_engine_init(engine, rhythm_path);
+        engine.m_player->m_num_threads = 1;
+
+        size_t j;
+        while (vsk_batch_take(queues, k, j))
+            errors[j] = vsk_batch_render_one(engine, base, jobs[j]);
+
+        num_samples[k] = engine.m_player->m_num_samples_generated;
+    };
+
+    if (num_threads == 1) {
+        worker(0);
+    } else {
+        std::vector<std::unique_ptr<unboost::thread>> threads;
+        for (size_t k = 0; k < num_threads; ++k) {
+            threads.emplace_back(new unboost::thread([&, k](int dummy) {
+                worker(k);
+            }, 0));
+        }
+        for (auto& thread : threads)
+            thread->join();
+    }
+
+    // 集計する
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        if (errors[i] == VSK_SOUND_ERR_SUCCESS)
+            ++result.m_num_succeeded;
+        else
+            result.m_failures.push_back({ i, errors[i] });
+    }
+    uint64_t total = 0;
+    for (auto count : num_samples)
+        total += count;
+    result.m_audio_seconds = double(total) / 44100; // サンプルレートで割る
+    result.m_seconds = std::chrono::duration<double>(clock_type::now() - t0).count();
+}
@@ -0,0 +1,48 @@
+//////////////////////////////////////////////////////////////////////////////
+// batch --- renders many CMD SING scores to many WAV files at once
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "types.h"
+#include "sound.h"
+#include "soundplayer.h"
+#include <map>
+
+//////////////////////////////////////////////////////////////////////////////
+// マニフェストの書式（一行に一つの仕事。Shift_JIS）
+//
+//     文字列<TAB>出力.wav[<TAB>オプション...]
+//
+// オプションは空白区切りで、-mono, -stereo, -format 形式, -D変数名=値 が使える。
+// 空行と「#」で始まる行は無視する。
+
+struct VskBatchJob
+{
+    size_t                          m_line = 0;         // マニフェストの行番号
+    VskString                       m_score;            // CMD SINGの文字列
+    std::wstring                    m_output;           // 出力ファイル
+    bool                            m_stereo = true;    // ステレオか？
+    VskSampleFormat                 m_format = VSK_SAMPLE_FORMAT_S16; // サンプルの形式
+    std::map<VskString, VskString>  m_variables;        // この仕事だけの変数
+};
+
+struct VskBatchFailure
+{
+    size_t                          m_index;            // 仕事のインデックス
+    VSK_SOUND_ERR                   m_error;            // エラー
+};
+
+struct VskBatchResult
+{
+    size_t                          m_num_succeeded = 0;    // 成功した数
+    std::vector<VskBatchFailure>    m_failures;             // 失敗したもの（行番号順）
+    double                          m_seconds = 0;          // 掛かった時間（秒）
+    double                          m_audio_seconds = 0;    // 生成した音声の長さ（秒）
+};
+
+bool vsk_batch_load_manifest(const wchar_t *filename, bool stereo, VskSampleFormat format,
+                             std::vector<VskBatchJob>& jobs);
+void vsk_batch_render(VskEngine& base, const char *rhythm_path, const std::vector<VskBatchJob>& jobs,
+                      size_t num_threads, VskBatchResult& result);
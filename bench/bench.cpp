@@ -0,0 +1,662 @@
+﻿//////////////////////////////////////////////////////////////////////////////
+// bench.cpp --- synthesis benchmark of fmgon and the sound player
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "../types.h"
+#include "../sound.h"
+#include "../engine.h"
+#include "../rendercache.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+#define CLOCK       8000000
+#define SAMPLERATE  44100
+#define NREPEAT     5           // 各測定の繰り返し回数（最良値を採る）
+#define NSAMPLES    (SAMPLERATE * 2)
+
+//////////////////////////////////////////////////////////////////////////////
+// 測定結果
+
+struct VskBenchResult {
+    std::string m_name;     // 項目名
+    double      m_value;    // 値
+    const char *m_unit;     // 単位
+};
+
+static std::vector<VskBenchResult> s_results;
+
+static void add_result(const std::string& name, double value, const char *unit) {
+    s_results.push_back({ name, value, unit });
+    std::printf("%-28s %16.3f  %s\n", name.c_str(), value, unit);
+    std::fflush(stdout);
+}
+
+// 波形が一致するかの検査結果を記録する。一つでも違えばmainは1を返す
+static bool s_all_exact = true;
+
+static void check_exact(const std::string& name, bool exact) {
+    add_result(name, (exact ? 1 : 0), "exact");
+    if (!exact)
+        s_all_exact = false;
+}
+
+typedef std::chrono::steady_clock clock_type;
+
+// setupの後にfnを実行することをNREPEAT回繰り返して、fnの最短の時間（秒）を返す
+template <typename T_SETUP, typename T_FN>
+static double measure_best(T_SETUP setup, T_FN fn) {
+    double best = 1e30;
+    for (int i = 0; i < NREPEAT; ++i) {
+        setup();
+        auto t0 = clock_type::now();
+        fn();
+        double sec = std::chrono::duration<double>(clock_type::now() - t0).count();
+        best = std::min(best, sec);
+    }
+    return best;
+}
+
+template <typename T_FN>
+static double measure_best(T_FN fn) {
+    return measure_best([]() { }, fn);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// OPNA::Mix (FM)
+
+// lfo: 0ならLFOなし、1ならハードウェアのLFO、2なら音色のLFO（音源の中でかける）
+static void bench_fm_mix(int algorithm, int lfo) {
+    std::unique_ptr<YM2203> chip;
+
+    // 減衰しない音色にする（エンベロープが止まると合成が省かれるため）
+    YM2203_Timbre timbre(ym2203_tone_table[15]);
+    timbre.algorithm = algorithm;
+    for (int op = 0; op < OPERATOR_NUM; ++op) {
+        timbre.sr[op] = 0;
+        timbre.sl[op] = 0;
+    }
+    if (lfo != 2)
+        timbre.speed = 0;
+
+    std::vector<FM_SAMPLETYPE> buf(NSAMPLES * 2);
+    double sec = measure_best([&]() {
+        // 同じ音源を初期化し直すとプリスケーラが設定されないので、毎回作る
+        chip.reset(new YM2203());
+        YM2203& ym = *chip;
+        ym.init(CLOCK, SAMPLERATE, NULL);
+        for (int ch = 0; ch < FM_CH_NUM; ++ch) {
+            ym.fm_set_timbre(ch, &timbre);
+            ym.fm_set_volume(ch, 15);
+            ym.fm_set_pitch(ch, 4, KEY_C + ch * 4);
+            ym.fm_key_on(ch);
+        }
+        if (lfo == 1) {
+            ym.write_reg(ADDR_FM_LFO_ON_SPEED, 0x08 | 3);
+            for (int ch = 0; ch < FM_CH_NUM; ++ch)
+                ym.write_reg(ADDR_FM_LR_AMS_PMS + ch, 0xC0 | 0x30 | 0x07);
+        }
+        std::fill(buf.begin(), buf.end(), 0);
+    }, [&]() {
+        chip->mix(buf.data(), NSAMPLES);
+    });
+
+    char name[64];
+    static const char * const suffixes[] = { "", "_lfo", "_slfo" };
+    std::sprintf(name, "fm_mix_alg%d%s", algorithm, suffixes[lfo]);
+    add_result(name, NSAMPLES / sec, "samples/sec");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 音色を頻繁に切り替える (YM2203::fm_set_timbre)
+
+static void bench_fm_timbre_switch(void) {
+    std::unique_ptr<YM2203> chip;
+
+    // 同じ音色の選び直しと、別の音色への切り替えを混ぜる
+    static const int tones[] = { 0, 0, 5, 5, 7, 0, 12, 12, 5, 7 };
+    const int nloops = 2000;
+    const int nswitches = nloops * int(sizeof(tones) / sizeof(tones[0]));
+
+    std::vector<YM2203_Timbre> timbres;
+    for (auto tone : tones)
+        timbres.push_back(YM2203_Timbre(ym2203_tone_table[tone]));
+
+    std::vector<FM_SAMPLETYPE> buf(64 * 2);
+    uint32_t nwrites = 0;
+    double sec = measure_best([&]() {
+        // 同じ音源を初期化し直すとプリスケーラが設定されないので、毎回作る
+        chip.reset(new YM2203());
+        chip->init(CLOCK, SAMPLERATE, NULL);
+    }, [&]() {
+        YM2203& ym = *chip;
+        uint32_t nwrites0 = ym.get_num_reg_writes();
+        for (int i = 0; i < nloops; ++i) {
+            for (auto& timbre : timbres) {
+                ym.fm_set_timbre(0, &timbre);
+                ym.fm_set_volume(0, 12);
+                ym.fm_set_pitch(0, 4, KEY_C);
+                ym.fm_key_on(0);
+                ym.mix(buf.data(), 16);
+                ym.fm_key_off(0);
+            }
+        }
+        nwrites = ym.get_num_reg_writes() - nwrites0;
+    });
+
+    add_result("fm_timbre_switch", nswitches / sec, "notes/sec");
+    add_result("fm_timbre_switch_writes", double(nwrites) / nswitches, "writes/note");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// PSG
+
+static void bench_psg(const char *name, int mode, bool envelope) {
+    std::unique_ptr<YM2203> chip;
+
+    std::vector<FM_SAMPLETYPE> buf(NSAMPLES * 2);
+    double sec = measure_best([&]() {
+        // 同じ音源を初期化し直すとプリスケーラが設定されないので、毎回作る
+        chip.reset(new YM2203());
+        YM2203& ym = *chip;
+        ym.init(CLOCK, SAMPLERATE, NULL);
+        for (int ch = 0; ch < SSG_CH_NUM; ++ch) {
+            ym.ssg_set_tone_or_noise(ch, mode);
+            if (envelope)
+                ym.ssg_set_envelope(ch, 12, 300);
+            else
+                ym.ssg_set_volume(ch, 12);
+            ym.ssg_set_pitch(ch, 4, KEY_C + ch * 4);
+            ym.ssg_key_on(ch);
+        }
+        std::fill(buf.begin(), buf.end(), 0);
+    }, [&]() {
+        chip->mix(buf.data(), NSAMPLES);
+    });
+
+    add_result(name, NSAMPLES / sec, "samples/sec");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// VskSoundPlayer::generate_pcm_raw
+
+// num_channels音のブロックを作る。CMD PLAYと同じく、3音ずつFMとSSGを交互に使う
+static void make_block(VskScoreBlock& block, VskSoundSetting (&settings)[VSK_MAX_CHANNEL],
+                       int num_channels = 6, int num_notes = 64)
+{
+    static const char notes[] = "CDEFGABR";
+    block.clear();
+    for (int ich = 0; ich < num_channels; ++ich) {
+        bool fm = ((ich / 3) % 2 == 0);
+        settings[ich] = VskSoundSetting();
+        auto phrase = std::make_shared<VskPhrase>(settings[ich]);
+        phrase->m_setting.m_fm = fm;
+        phrase->m_setting.m_tempo = 150;
+        phrase->m_setting.m_length = 12;
+        phrase->m_setting.m_octave = 2 + ich % 3;
+        if (fm)
+            phrase->add_tone('@', 15);
+        for (int k = 0; k < num_notes; ++k)
+            phrase->add_note(notes[(k + ich) % 8]);
+        block.push_back(phrase);
+    }
+}
+
+static void bench_generate_pcm_raw(VskEngine& engine) {
+    std::vector<VSK_PCM16_VALUE> values;
+    VskSoundSetting settings[VSK_MAX_CHANNEL];
+    VskScoreBlock block;
+
+    double best = measure_best([&]() {
+        make_block(block, settings);
+        engine.m_player->reset();
+    }, [&]() {
+        engine.m_player->generate_pcm_raw(block, values, true);
+    });
+
+    add_result("generate_pcm_raw", (values.size() / 2) / best, "samples/sec");
+}
+
+// チャンネル数に対するスループット。3チャンネルごとに音源が一つ増える
+static void bench_channels(VskEngine& engine) {
+    std::vector<VSK_PCM16_VALUE> values;
+    VskSoundSetting settings[VSK_MAX_CHANNEL];
+    VskScoreBlock block;
+
+    for (int num_channels = 3; num_channels <= VSK_MAX_CHANNEL; num_channels += 3) {
+        double best = measure_best([&]() {
+            make_block(block, settings, num_channels);
+            engine.m_player->reset();
+        }, [&]() {
+            engine.m_player->generate_pcm_raw(block, values, true);
+        });
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "generate_pcm_raw_ch%d", num_channels);
+        add_result(name, (values.size() / 2) / best, "samples/sec");
+    }
+}
+
+// 最後のチャンネルの末尾に音符を一つ足して描画し直す時間。曲の長さによらないのが望ましい
+static void bench_incremental(VskEngine& engine) {
+    std::vector<VSK_PCM16_VALUE> values;
+    VskSoundSetting settings[VSK_MAX_CHANNEL];
+    VskScoreBlock block;
+
+    for (int num_notes = 64; num_notes <= 1024; num_notes *= 4) {
+        for (int incremental = 0; incremental <= 1; ++incremental) {
+            engine.m_player->m_incremental = !!incremental;
+            double best = measure_best([&]() {
+                make_block(block, settings, 6, num_notes);
+                engine.m_player->reset();
+                engine.m_player->generate_pcm_raw(block, values, true);
+                // 仕上げたフレーズは変えられないので、作り直してから足す
+                make_block(block, settings, 6, num_notes);
+                block.back()->add_note('C');
+                engine.m_player->reset();
+            }, [&]() {
+                engine.m_player->generate_pcm_raw(block, values, true);
+            });
+
+            char name[64];
+            std::snprintf(name, sizeof(name), "%s_notes%d",
+                          (incremental ? "rerender_incremental" : "rerender_full"), num_notes);
+            add_result(name, best * 1000, "ms");
+        }
+    }
+    engine.m_player->m_incremental = false;
+}
+
+// CMD PLAYの楽譜を直しながら描画し直したときに、差分描画が全体の描画と同じ波形になるか
+static void bench_incremental_exact(const char *rhythm_path) {
+    static const char * const score[] = {
+        "@3T150L8O4CDEFGABO5C" "O4CDEFGABO5C" "O4CDEFGABO5C" "O4CDEFGABO5C",
+        "@1T150L8O3EGBO4EGB",
+        "@3T150L4O4C.D8E.F8G2",
+        "T150L8O4CDEFGAB>C",
+        "T150L8O5CDEFGAB>C",
+        "T150L8O3CDEFGAB>C",
+    };
+
+    // 楽譜を順に直していく。strがnullptrならチャンネルを消し、ichが-1なら何も直さない
+    struct VskEdit {
+        int         ich;
+        const char *str;
+    };
+    static const VskEdit edits[] = {
+        { -1, nullptr },                                    // 直さない
+        { 5, "T150L8O3CDEFGAB>CD" },                        // 末尾に音符を足す
+        { 0, "@3T150L8O4CDEFGABO5C" "O4CDEFGABO5C" "O4CDEFGABO5C" "O4CDEFGAAO5C" }, // 後ろの音符を変える
+        { 3, "T150L8O4CCEFGAB>C" },                         // SSGの前の音符を変える
+        { 1, "@4T150L8O3EGBO4EGB" },                        // 音色を変える
+        { 2, "@3T150L4O4C.D8" },                            // 音符を消す
+        { 4, "T120L8O5CDEFGAB>C" },                         // テンポを変える
+        { 6, "@1T150L2O4CEG" },                             // 音源を一つ増やす
+        { -1, nullptr },
+        { 6, nullptr },                                     // 増やした音源を消す
+        { 5, nullptr },                                     // チャンネルを消す
+    };
+
+    VskEngine incremental, full;
+    vsk_engine_init(incremental, rhythm_path);
+    vsk_engine_init(full, rhythm_path);
+    vsk_sound_set_incremental(incremental, true);
+
+    // 差分描画は、前の描画で音源が進んでいても初期状態から描画し直す。
+    // 全体の描画は、そのたびに初期状態に戻した音源で描画する
+    std::vector<VskString> strs(std::begin(score), std::end(score));
+    std::vector<VSK_PCM16_VALUE> values[2];
+    std::shared_ptr<VskRenderCacheView> view;
+    bool exact = true;
+    for (auto& edit : edits) {
+        if (edit.ich >= 0 && !edit.str)
+            strs.resize(edit.ich);
+        else if (edit.ich >= int(strs.size()))
+            strs.push_back(edit.str);
+        else if (edit.ich >= 0)
+            strs[edit.ich] = edit.str;
+
+        VskEngine *engines[2] = { &incremental, &full };
+        for (int i = 0; i < 2; ++i) {
+            VskScoreBlock block;
+            vsk_cmd_play_reset_settings(*engines[i]);
+            if (engines[i] == &full)
+                full.m_player->reset();
+            if (vsk_cmd_play_compile(*engines[i], strs, VSK_PLAY_MODE_FM_AND_SSG, block) ||
+                !engines[i]->m_player->generate_pcm(block, values[i], view, true))
+            {
+                exact = false;
+            }
+        }
+        if (values[0] != values[1])
+            exact = false;
+    }
+    check_exact("rerender_incremental_exact", exact);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 構文解析
+
+static const char * const s_sing_scores[] = {
+    "T130O5L4CDEFEDC2R4EFGAGFE2R4C2C2C2C2L8CCDDEEFFL4EDC2",
+    "T150O4L8RP4[CDEFGAB>C<]RP2[RP2[CEG]>C<]",
+    "T120O4L4C.D8E.F8G2A4G4F4E4D2C2",
+};
+
+static const char * const s_play_scores[][6] = {
+    {
+        "@15T150L8O2CEGO3CEGO4CRRCO3GECO2GECR",
+        "@15T150L8O3EGBO4EGBO5ERRCO4BGEO3BGER",
+        "@1T150L4O4C.D8E.F8G2",
+        "T150L8O4CDEFGAB>C",
+        "T150L8O5CDEFGAB>C",
+        "T150L8O3CDEFGAB>C",
+    },
+};
+
+static void bench_parse(VskEngine& engine) {
+    const int nloops = 1000;
+
+    size_t nchars = 0;
+    for (auto score : s_sing_scores)
+        nchars += std::strlen(score);
+    double sec = measure_best([&]() {
+        for (int i = 0; i < nloops; ++i) {
+            for (auto score : s_sing_scores) {
+                vsk_cmd_sing_reset_settings(engine);
+                vsk_sound_cmd_sing(engine, score, true, true);
+            }
+        }
+    });
+    add_result("parse_cmd_sing", nchars * nloops / sec, "chars/sec");
+
+    nchars = 0;
+    std::vector<std::vector<VskString>> play_strs;
+    for (auto& scores : s_play_scores) {
+        std::vector<VskString> strs(std::begin(scores), std::end(scores));
+        for (auto& str : strs)
+            nchars += str.size();
+        play_strs.push_back(strs);
+    }
+    sec = measure_best([&]() {
+        for (int i = 0; i < nloops; ++i) {
+            for (auto& strs : play_strs) {
+                vsk_cmd_play_reset_settings(engine);
+                vsk_sound_cmd_play_fm_and_ssg(engine, strs, true, true);
+            }
+        }
+    });
+    add_result("parse_cmd_play", nchars * nloops / sec, "chars/sec");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 起動時間と実時間比
+
+static void bench_cold_start(const char *rhythm_path) {
+    double sec = measure_best([&]() {
+        VskEngine engine;
+        vsk_engine_init(engine, rhythm_path);
+    });
+    add_result("cold_start", sec * 1000, "ms");
+}
+
+static void bench_corpus(VskEngine& engine) {
+    static const wchar_t *filename = L"bench_tmp.wav";
+
+    engine.m_player->m_num_samples_generated = 0;
+    auto t0 = clock_type::now();
+    for (auto score : s_sing_scores) {
+        engine.m_player->reset();
+        vsk_cmd_sing_reset_settings(engine);
+        vsk_sound_cmd_sing_save(engine, score, filename, true);
+    }
+    for (auto& scores : s_play_scores) {
+        std::vector<VskString> strs(std::begin(scores), std::end(scores));
+        engine.m_player->reset();
+        vsk_cmd_play_reset_settings(engine);
+        vsk_sound_cmd_play_fm_and_ssg_save(engine, strs, filename, true);
+    }
+    double sec = std::chrono::duration<double>(clock_type::now() - t0).count();
+    std::remove("bench_tmp.wav");
+
+    double audio_sec = double(engine.m_player->m_num_samples_generated) / SAMPLERATE;
+    add_result("corpus_realtime_factor", audio_sec / sec, "x");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// レジスタ書き込みの直接再生（MMLの解析を含まない音源だけの速さ）
+
+// LFOのある音色はレジスタ書き込みのログに保存できないので、s_play_scoresの@15を@3に替える
+static const char * const s_replay_score[6] = {
+    "@3T150L8O2CEGO3CEGO4CRRCO3GECO2GECR",
+    "@3T150L8O3EGBO4EGBO5ERRCO4BGEO3BGER",
+    "@1T150L4O4C.D8E.F8G2",
+    "T150L8O4CDEFGAB>C",
+    "T150L8O5CDEFGAB>C",
+    "T150L8O3CDEFGAB>C",
+};
+
+static void bench_replay(VskEngine& engine) {
+    static const wchar_t *filename = L"bench_tmp.vgm";
+
+    std::vector<VskString> strs(std::begin(s_replay_score), std::end(s_replay_score));
+    engine.m_player->reset();
+    vsk_cmd_play_reset_settings(engine);
+    if (vsk_sound_cmd_play_fm_and_ssg_save(engine, strs, filename, true) != VSK_SOUND_ERR_SUCCESS) {
+        std::fprintf(stderr, "cannot save bench_tmp.vgm\n");
+        return;
+    }
+
+    std::vector<uint8_t> data;
+    FILE *fin = std::fopen("bench_tmp.vgm", "rb");
+    if (!fin)
+        return;
+    uint8_t buf[4096];
+    size_t size;
+    while ((size = std::fread(buf, 1, sizeof(buf), fin)) > 0)
+        data.insert(data.end(), buf, buf + size);
+    std::fclose(fin);
+    std::remove("bench_tmp.vgm");
+
+    uint64_t num_samples = 0;
+    double sec = measure_best([&]() {
+        VskPcmNullSink sink;
+        vsk_replay_vgm(data.data(), data.size(), sink, true, &num_samples);
+    });
+    add_result("replay_vgm", num_samples / sec, "samples/sec");
+    add_result("replay_realtime_factor", (double(num_samples) / SAMPLERATE) / sec, "x");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// シーク
+
+#define SEEK_MINUTES        10      // 曲の長さ（分）
+#define SEEK_POSITION       3       // シークする位置（分）
+#define SEEK_FRAMES         4096    // シークした位置から描画するフレーム数
+
+// SEEK_MINUTES分の長さのCMD PLAYの楽譜を作る
+static std::vector<VskString> make_long_play_score(void) {
+    static const char * const s_heads[6] = {
+        "@15T150L8O2", "@15T150L8O3", "@1T150L8O4", "T150L8O4", "T150L8O5", "T150L8O3",
+    };
+    // 8分音符はテンポ150で0.2秒なので、8音で1.6秒
+    const int num_bars = SEEK_MINUTES * 60 * 10 / 16;
+    std::vector<VskString> strs;
+    for (auto head : s_heads) {
+        VskString str = head;
+        for (int i = 0; i < num_bars; ++i)
+            str += "CEGBAGFD";
+        strs.push_back(str);
+    }
+    return strs;
+}
+
+// 長い曲の途中から描画する時間。全体を描画したときの同じ範囲と一致するかも調べる
+static void bench_seek(VskEngine& engine) {
+    std::vector<VSK_PCM16_VALUE> full, range;
+    VskScoreBlock block;
+
+    vsk_cmd_play_reset_settings(engine);
+    if (vsk_cmd_play_compile(engine, make_long_play_score(), VSK_PLAY_MODE_FM_AND_SSG, block) != VSK_SOUND_ERR_SUCCESS) {
+        std::printf("cannot compile the seek score\n");
+        check_exact("seek_render_range", false);
+        return;
+    }
+
+    // 全体を描画してキーフレームを記録する
+    engine.m_player->reset();
+    auto t0 = clock_type::now();
+    engine.m_player->generate_pcm_raw(block, full, true);
+    double sec = std::chrono::duration<double>(clock_type::now() - t0).count();
+    add_result("seek_full_render", sec * 1000, "ms");
+
+    const size_t start = size_t(SEEK_POSITION) * 60 * SAMPLERATE;
+    const size_t end = start + SEEK_FRAMES;
+    bool ok = true;
+    double best = measure_best([&]() {
+        ok = ok && engine.m_player->render_range(block, start, end, range, true);
+    });
+    add_result("seek_render_range", best * 1000, "ms");
+
+    bool exact = ok && (full.size() >= end * 2) &&
+                 std::equal(range.begin(), range.end(), full.begin() + start * 2) &&
+                 (range.size() == SEEK_FRAMES * 2);
+    check_exact("seek_render_range_exact", exact);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// サンプルの形式の変換 (vsk_convert_pcm32)
+
+static void bench_convert(void) {
+    // 16ビットを越える値を含む、フレーズを足し合わせたような値
+    std::vector<int32_t> src(NSAMPLES * 2);
+    for (size_t i = 0; i < src.size(); ++i)
+        src[i] = int32_t((i * 7919) % 98304) - 49152;
+    std::vector<uint8_t> dest(src.size() * 4);
+
+    static const VskSampleFormat formats[] = {
+        VSK_SAMPLE_FORMAT_S16, VSK_SAMPLE_FORMAT_S24, VSK_SAMPLE_FORMAT_F32
+    };
+    static const char * const names[] = { "convert_s16", "convert_s24", "convert_f32" };
+    for (int i = 0; i < 3; ++i) {
+        double sec = measure_best([&]() {
+            vsk_convert_pcm32(src.data(), src.size(), formats[i], dest.data());
+        });
+        add_result(names[i], src.size() / sec, "values/sec");
+    }
+
+    // s24は16ビットに収めてから下位8ビットを0にし、f32は飽和させない
+    std::vector<VSK_PCM16_VALUE> s16(src.size());
+    std::vector<uint8_t> s24(src.size() * 3);
+    std::vector<float> f32(src.size());
+    vsk_convert_pcm32(src.data(), src.size(), VSK_SAMPLE_FORMAT_S16, s16.data());
+    vsk_convert_pcm32(src.data(), src.size(), VSK_SAMPLE_FORMAT_S24, s24.data());
+    vsk_convert_pcm32(src.data(), src.size(), VSK_SAMPLE_FORMAT_F32, f32.data());
+    bool exact = true;
+    for (size_t i = 0; i < src.size(); ++i) {
+        int32_t clipped = std::max(-32768, std::min(32767, src[i]));
+        int32_t value24 = s24[3 * i] | (s24[3 * i + 1] << 8) | (int8_t(s24[3 * i + 2]) * 65536);
+        if (s16[i] != clipped || value24 != clipped * 256 || f32[i] != float(src[i]) / 32768.0f)
+            exact = false;
+    }
+    check_exact("convert_exact", exact);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// イベント（m_stopping_event などの待ち合わせ）
+
+// 待っていないイベントを調べる時間と、二つのスレッドで交互に起こし合う時間
+static void bench_event(void) {
+    const int npolls = 1000000;
+    const int nrounds = 20000;
+
+    PE_event poll_event(false, false);
+    double best = measure_best([&]() {
+        for (int i = 0; i < npolls; ++i)
+            poll_event.wait_for_event(0);
+    });
+    add_result("event_poll", best * 1e9 / npolls, "ns");
+
+    PE_event ping(false, false), pong(false, false);
+    best = measure_best([&]() {
+        unboost::thread partner([&](int dummy) {
+            for (int i = 0; i < nrounds; ++i) {
+                ping.wait_for_event();
+                pong.set();
+            }
+        }, 0);
+        for (int i = 0; i < nrounds; ++i) {
+            ping.set();
+            pong.wait_for_event();
+        }
+        partner.join();
+    });
+    add_result("event_round_trip", best * 1e6 / nrounds, "us");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static bool write_json(const char *filename) {
+    FILE *fout = std::fopen(filename, "w");
+    if (!fout)
+        return false;
+    std::fprintf(fout, "{\n");
+    for (size_t i = 0; i < s_results.size(); ++i) {
+        auto& result = s_results[i];
+        std::fprintf(fout, "    \"%s\": { \"value\": %.3f, \"unit\": \"%s\" }%s\n",
+                     result.m_name.c_str(), result.m_value, result.m_unit,
+                     (i + 1 < s_results.size()) ? "," : "");
+    }
+    std::fprintf(fout, "}\n");
+    std::fclose(fout);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *json_file = (argc > 1) ? argv[1] : "bench.json";
+
+    // 描画キャッシュは使わない
+    vsk_render_cache_enable(false);
+
+    char rhythm_path[260];
+    vsk_get_rhythm_path(rhythm_path, sizeof(rhythm_path));
+
+    std::printf("%-28s %16s  %s\n", "name", "value", "unit");
+    std::printf("%-28s %16s  %s\n", "----", "-----", "----");
+
+    for (int lfo = 0; lfo <= 2; ++lfo) {
+        for (int algorithm = ALGORITHM_0; algorithm <= ALGORITHM_7; ++algorithm)
+            bench_fm_mix(algorithm, lfo);
+    }
+    bench_fm_timbre_switch();
+
+    bench_psg("psg_tone", TONE_MODE, false);
+    bench_psg("psg_noise", NOISE_MODE, false);
+    bench_psg("psg_envelope", TONE_MODE, true);
+
+    VskEngine engine;
+    vsk_engine_init(engine, rhythm_path);
+
+    bench_generate_pcm_raw(engine);
+    bench_channels(engine);
+    bench_incremental(engine);
+    bench_incremental_exact(rhythm_path);
+    bench_parse(engine);
+    bench_cold_start(rhythm_path);
+    bench_corpus(engine);
+    bench_replay(engine);
+    bench_seek(engine);
+    bench_convert();
+    bench_event();
+
+    if (!write_json(json_file)) {
+        std::fprintf(stderr, "cannot write %s\n", json_file);
+        return 1;
+    }
+
+    return (s_all_exact ? 0 : 1);
+} // main
+
+//////////////////////////////////////////////////////////////////////////////
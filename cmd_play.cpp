@@ -8,25 +8,35 @@
 
 #include "soundplayer.h"                // サウンドプレーヤー
 #include "scanner.h"                    // VskScanner
-
-// サウンドプレーヤー
-extern std::shared_ptr<VskSoundPlayer> vsk_sound_player;
-
-#define VSK_MAX_CHANNEL 6
-
-// CMD PLAYの現在の設定
-VskSoundSetting vsk_fm_sound_settings[VSK_MAX_CHANNEL];
-VskSoundSetting vsk_ssg_sound_settings[VSK_MAX_CHANNEL];
+#include "engine.h"                     // VskEngine
+#include "task.h"                       // VskTask
 
 // 設定のリセット
-void vsk_cmd_play_reset_settings(void)
+void vsk_cmd_play_reset_settings(VskEngine& engine)
 {
-    for (auto& item : vsk_fm_sound_settings)
+    for (auto& item : engine.m_fm_settings)
         item = VskSoundSetting();
-    for (auto& item : vsk_ssg_sound_settings)
+    for (auto& item : engine.m_ssg_settings)
         item = VskSoundSetting();
 }
 
+// 設定のリセット
+void vsk_cmd_play_reset_settings(void)
+{
+    vsk_cmd_play_reset_settings(vsk_default_engine());
+}
+
+// 設定の番号から設定を取得する。
+// 0～5はFM、6～11はSSGの#0～#5で、以降も6つずつFMとSSGが交互に続く
+static VskSoundSetting *vsk_cmd_play_setting_from_ch(VskEngine& engine, int ch)
+{
+    if (ch < 0 || ch >= VSK_MAX_CHANNEL * 2)
+        return nullptr;
+    int bank = ch / 6;
+    int index = (bank / 2) * 6 + ch % 6;
+    return (bank % 2 == 0) ? &engine.m_fm_settings[index] : &engine.m_ssg_settings[index];
+}
+
 // 設定のサイズ
 size_t vsk_cmd_play_get_setting_size(void)
 {
@@ -34,24 +44,24 @@ size_t vsk_cmd_play_get_setting_size(void)
 }
 
 // 設定の取得
-bool vsk_cmd_play_get_setting(int ch, std::vector<uint8_t>& data)
+bool vsk_cmd_play_get_setting(VskEngine& engine, int ch, std::vector<uint8_t>& data)
 {
-    data.resize(sizeof(VskSoundSetting));
-    switch (ch)
-    {
-    case 0: case 1: case 2: case 3: case 4: case 5:
-        std::memcpy(data.data(), &vsk_fm_sound_settings[ch], sizeof(VskSoundSetting));
-        return true;
-    case 6: case 7: case 8: case 9: case 10: case 11:
-        std::memcpy(data.data(), &vsk_ssg_sound_settings[ch - 6], sizeof(VskSoundSetting));
-        return true;
-    default:
+    VskSoundSetting *setting = vsk_cmd_play_setting_from_ch(engine, ch);
+    if (!setting)
         return false;
-    }
+    data.resize(sizeof(VskSoundSetting));
+    std::memcpy(data.data(), setting, sizeof(VskSoundSetting));
+    return true;
+}
+
+// 設定の取得
+bool vsk_cmd_play_get_setting(int ch, std::vector<uint8_t>& data)
+{
+    return vsk_cmd_play_get_setting(vsk_default_engine(), ch, data);
 }
 
 // 音色を適用する
-bool vsk_cmd_play_voice(int ich, const void *data, size_t data_size)
+bool vsk_cmd_play_voice(VskEngine& engine, int ich, const void *data, size_t data_size)
 {
     if (ich < 0 || ich >= VSK_MAX_CHANNEL)
     {
@@ -67,31 +77,37 @@ bool vsk_cmd_play_voice(int ich, const void *data, size_t data_size)
     }
 
     std::memcpy(array, data, data_size);
-    vsk_fm_sound_settings[ich].m_timbre.set(array);
+    engine.m_fm_settings[ich].m_timbre.set(array);
     return true;
 }
 
+// 音色を適用する
+bool vsk_cmd_play_voice(int ich, const void *data, size_t data_size)
+{
+    return vsk_cmd_play_voice(vsk_default_engine(), ich, data, data_size);
+}
+
 // 設定の設定
-bool vsk_cmd_play_set_setting(int ch, const std::vector<uint8_t>& data)
+bool vsk_cmd_play_set_setting(VskEngine& engine, int ch, const std::vector<uint8_t>& data)
 {
     if (data.size() != sizeof(VskSoundSetting))
         return false;
-    switch (ch)
-    {
-    case 0: case 1: case 2: case 3: case 4: case 5:
-        std::memcpy(&vsk_fm_sound_settings[ch], data.data(), sizeof(VskSoundSetting));
-        return true;
-    case 6: case 7: case 8: case 9: case 10: case 11:
-        std::memcpy(&vsk_ssg_sound_settings[ch - 6], data.data(), sizeof(VskSoundSetting));
-        return true;
-    default:
+    VskSoundSetting *setting = vsk_cmd_play_setting_from_ch(engine, ch);
+    if (!setting)
         return false;
-    }
+    std::memcpy(setting, data.data(), sizeof(VskSoundSetting));
+    return true;
+}
+
+// 設定の設定
+bool vsk_cmd_play_set_setting(int ch, const std::vector<uint8_t>& data)
+{
+    return vsk_cmd_play_set_setting(vsk_default_engine(), ch, data);
 }
 
 // 再帰的に「[変数名]」を変数の値に置き換える関数
 std::string
-vsk_replace_play_placeholders(const std::string& str, std::unordered_set<std::string>& visited) {
+vsk_replace_play_placeholders(VskEngine& engine, const std::string& str, std::unordered_set<std::string>& visited) {
     std::string result = str;
     size_t start_pos = 0;
 
@@ -108,10 +124,10 @@ vsk_replace_play_placeholders(const std::string& str, std::unordered_set<std::st
         }
         visited.insert(key);
 
-        auto it = g_variables.find(key);
-        if (it != g_variables.end()) {
+        auto it = engine.m_variables.find(key);
+        if (it != engine.m_variables.end()) {
             // ここで再帰的に置き換えを行う
-            std::string value = vsk_replace_play_placeholders(it->second, visited);
+            std::string value = vsk_replace_play_placeholders(engine, it->second, visited);
             result.replace(start_pos, end_pos - start_pos + 1, value);
             start_pos += value.length(); // 置き換えた後の新しい開始位置に移動
         } else {
@@ -124,10 +140,17 @@ vsk_replace_play_placeholders(const std::string& str, std::unordered_set<std::st
 }
 
 // 再帰的に「[変数名]」を変数の値に置き換える関数
-std::string vsk_replace_play_placeholders(const std::string& str)
+std::string vsk_replace_play_placeholders(VskEngine& engine, const std::string& str)
 {
+    VskStageTimer timer(engine.m_stats, VSK_STAGE_EXPAND);
     std::unordered_set<std::string> visited;
-    return vsk_replace_play_placeholders(str, visited);
+    return vsk_replace_play_placeholders(engine, str, visited);
+}
+
+// 再帰的に「[変数名]」を変数の値に置き換える関数
+std::string vsk_replace_play_placeholders(const std::string& str)
+{
+    return vsk_replace_play_placeholders(vsk_default_engine(), str);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -214,9 +237,10 @@ bool vsk_scan_play_param(const char *& pch, VskPlayItem& item)
 } // vsk_scan_play_param
 
 // 演奏項目を評価する
-bool vsk_eval_cmd_play_items(std::vector<VskPlayItem>& items, const VskString& expr)
+bool vsk_eval_cmd_play_items(VskEngine& engine, std::vector<VskPlayItem>& items, const VskString& expr)
 {
-    VskString str = vsk_replace_play_placeholders(expr);
+    VskStageTimer timer(engine.m_stats, VSK_STAGE_PARSE);
+    VskString str = vsk_replace_play_placeholders(engine, expr);
     const char *pch = str.c_str();
     items.clear();
 
@@ -344,15 +368,16 @@ bool vsk_eval_cmd_play_items(std::vector<VskPlayItem>& items, const VskString& e
     return vsk_rescan_play_items(items);
 } // vsk_eval_cmd_play_items
 
-VskAstPtr vsk_get_play_param(const VskPlayItem& item)
+VskAstPtr vsk_get_play_param(VskEngine& engine, const VskPlayItem& item)
 {
     if (item.m_param.empty())
         return nullptr;
-    return vsk_eval_cmd_play_text(item.m_param);
+    return vsk_eval_cmd_play_text(item.m_param, engine.m_variables);
 } // vsk_get_play_param
 
-bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std::vector<VskPlayItem>& items)
+bool vsk_phrase_from_cmd_play_items(VskEngine& engine, std::shared_ptr<VskPhrase> phrase, const std::vector<VskPlayItem>& items)
 {
+    VskStageTimer timer(engine.m_stats, VSK_STAGE_PARSE);
     float length;
     int key = 0;
     for (auto& item : items) {
@@ -361,7 +386,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
         case ' ': case '\t': // blank
             continue;
         case 'M':
-            if (auto ast = vsk_get_play_param(item)) {
+            if (auto ast = vsk_get_play_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if (1 <= i0 && i0 <= 65535) {
                     phrase->add_envelop_interval(ch, i0);
@@ -373,7 +398,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
             }
             return false;
         case 'S':
-            if (auto ast = vsk_get_play_param(item)) {
+            if (auto ast = vsk_get_play_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if (0 <= i0 && i0 <= 15) {
                     phrase->add_envelop_type(ch, i0);
@@ -385,7 +410,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
             }
             return false;
         case 'V':
-            if (auto ast = vsk_get_play_param(item)) {
+            if (auto ast = vsk_get_play_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if ((0 <= i0) && (i0 <= 15)) {
                     phrase->m_setting.m_volume = (float)i0;
@@ -397,7 +422,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
             }
             continue;
         case 'L':
-            if (auto ast = vsk_get_play_param(item)) {
+            if (auto ast = vsk_get_play_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if ((1 <= i0) && (i0 <= 64)) {
                     phrase->m_setting.m_length = (24.0f * 4.0f) / i0;
@@ -409,7 +434,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
             }
             continue;
         case 'Q':
-            if (auto ast = vsk_get_play_param(item)) {
+            if (auto ast = vsk_get_play_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if ((0 <= i0) && (i0 <= 8)) {
                     phrase->m_setting.m_quantity = i0;
@@ -421,7 +446,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
             }
             continue;
         case 'O':
-            if (auto ast = vsk_get_play_param(item)) {
+            if (auto ast = vsk_get_play_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if ((1 <= i0) && (i0 <= 8)) {
                     phrase->m_setting.m_octave = i0 - 1;
@@ -446,7 +471,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
             return false;
         case 'N':
             length = phrase->m_setting.m_length;
-            if (auto ast = vsk_get_play_param(item)) {
+            if (auto ast = vsk_get_play_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if ((0 <= i0) && (i0 <= 96)) {
                     key = i0;
@@ -472,7 +497,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
             phrase->m_notes.back().m_and = item.m_and;
             continue;
         case 'T':
-            if (auto ast = vsk_get_play_param(item)) {
+            if (auto ast = vsk_get_play_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if ((32 <= i0) && (i0 <= 255)) {
                     phrase->m_setting.m_tempo = i0;
@@ -486,7 +511,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
         case 'C': case 'D': case 'E': case 'F': case 'G':
         case 'A': case 'B': case 'R':
             length = phrase->m_setting.m_length;
-            if (auto ast = vsk_get_play_param(item)) {
+            if (auto ast = vsk_get_play_param(engine, item)) {
                 auto L = ast->to_int();
                 // NOTE: 24 is the length of a quarter note
                 if ((1 <= L) && (L <= 64)) {
@@ -509,7 +534,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
             continue;
         case '@':
             if (item.m_subcommand == "@") {
-                if (auto ast = vsk_get_play_param(item)) {
+                if (auto ast = vsk_get_play_param(engine, item)) {
                     auto i0 = ast->to_int();
                     if ((0 <= i0) && (i0 <= 61)) {
                         phrase->add_tone(ch, i0);
@@ -518,7 +543,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
                     }
                 }
             } else if (item.m_subcommand == "@V") {
-                if (auto ast = vsk_get_play_param(item)) {
+                if (auto ast = vsk_get_play_param(engine, item)) {
                     auto i0 = ast->to_int();
                     if ((0 <= i0) && (i0 <= 127)) {
                         phrase->m_setting.m_volume =  i0 * (15.0f / 127.0f);
@@ -527,7 +552,7 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
                 }
             } else if (item.m_subcommand == "@W") { // 特殊な休符
                 length = phrase->m_setting.m_length;
-                if (auto ast = vsk_get_play_param(item)) {
+                if (auto ast = vsk_get_play_param(engine, item)) {
                     auto L = ast->to_int();
                     // NOTE: 24 is the length of a quarter note
                     if ((1 <= L) && (L <= 64)) {
@@ -562,17 +587,16 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
         case 'Y':
         case ',':
             {
-                static int r = 0;
                 if (ch == 'Y') {
-                    if (auto ast = vsk_get_play_param(item)) {
-                        r = ast->to_int();
+                    if (auto ast = vsk_get_play_param(engine, item)) {
+                        engine.m_reg_addr = ast->to_int();
                         continue;
                     }
                     return false;
                 } else {
-                    if (auto ast = vsk_get_play_param(item)) {
+                    if (auto ast = vsk_get_play_param(engine, item)) {
                         int d = ast->to_int();
-                        phrase->add_reg('Y', r, d);
+                        phrase->add_reg('Y', engine.m_reg_addr, d);
                         continue;
                     }
                     return false;
@@ -584,30 +608,40 @@ bool vsk_phrase_from_cmd_play_items(std::shared_ptr<VskPhrase> phrase, const std
             break;
         }
     }
+    phrase->finalize();
     return true;
 } // vsk_phrase_from_cmd_play_items
 
 //////////////////////////////////////////////////////////////////////////////
 
-// SSG音源で音楽再生
-VSK_SOUND_ERR vsk_sound_cmd_play_ssg(const std::vector<VskString>& strs, bool stereo, bool no_sound)
+// CMD PLAYの文字列群を解析して、チャンネルごとのフレーズをblockに追加する
+VSK_SOUND_ERR vsk_cmd_play_compile(VskEngine& engine, const std::vector<VskString>& strs, VskPlayMode mode,
+                                   VskScoreBlock& block)
 {
-    assert(strs.size() <= VSK_MAX_CHANNEL);
+    if (strs.size() > VSK_MAX_CHANNEL)
+        return VSK_SOUND_ERR_ILLEGAL;
     size_t iChannel = 0;
 
-    // add phrases to block
-    VskScoreBlock block;
     // for each channel strings
     for (auto& str : strs) {
         // get play items
         std::vector<VskPlayItem> items;
-        if (!vsk_eval_cmd_play_items(items, str))
+        if (!vsk_eval_cmd_play_items(engine, items, str))
             return VSK_SOUND_ERR_ILLEGAL;
 
         // create phrase
-        auto phrase = std::make_shared<VskPhrase>(vsk_ssg_sound_settings[iChannel]);
-        phrase->m_setting.m_fm = false;
-        if (!vsk_phrase_from_cmd_play_items(phrase, items))
+        // FM+SSGなら、音源ごとに3チャンネルずつ、FMとSSGを交互に使う
+        bool fm = (mode == VSK_PLAY_MODE_FM);
+        size_t iSetting = iChannel;
+        if (mode == VSK_PLAY_MODE_FM_AND_SSG) {
+            fm = ((iChannel / 3) % 2 == 0);
+            iSetting = (iChannel / 6) * 3 + iChannel % 3;
+        }
+        auto phrase = std::make_shared<VskPhrase>(
+            fm ? engine.m_fm_settings[iSetting] : engine.m_ssg_settings[iSetting]
+        );
+        phrase->m_setting.m_fm = fm;
+        if (!vsk_phrase_from_cmd_play_items(engine, phrase, items))
             return VSK_SOUND_ERR_ILLEGAL;
 
         // add phrase
@@ -616,120 +650,110 @@ VSK_SOUND_ERR vsk_sound_cmd_play_ssg(const std::vector<VskString>& strs, bool st
         ++iChannel;
     }
 
+    return VSK_SOUND_ERR_SUCCESS;
+}
+
+// SSG音源で音楽再生
+VSK_SOUND_ERR vsk_sound_cmd_play_ssg(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound)
+{
+    // add phrases to block
+    VskScoreBlock block;
+    if (auto err = vsk_cmd_play_compile(engine, strs, VSK_PLAY_MODE_SSG, block))
+        return err;
+
     if (!no_sound)
     {
         // play now
-        vsk_sound_player->play(block, stereo);
+        engine.m_player->play(block, stereo);
     }
 
     return VSK_SOUND_ERR_SUCCESS;
 }
 
-// FM+SSG音源で音楽再生
-VSK_SOUND_ERR vsk_sound_cmd_play_fm_and_ssg(const std::vector<VskString>& strs, bool stereo, bool no_sound)
+// SSG音源で音楽再生
+VSK_SOUND_ERR vsk_sound_cmd_play_ssg(const std::vector<VskString>& strs, bool stereo, bool no_sound)
 {
-    assert(strs.size() <= VSK_MAX_CHANNEL);
-    size_t iChannel = 0;
+    return vsk_sound_cmd_play_ssg(vsk_default_engine(), strs, stereo, no_sound);
+}
 
+// FM+SSG音源で音楽再生
+VSK_SOUND_ERR vsk_sound_cmd_play_fm_and_ssg(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound)
+{
     // add phrases to block
     VskScoreBlock block;
-    // for each channel strings
-    for (auto& str : strs) {
-        // get play items
-        std::vector<VskPlayItem> items;
-        if (!vsk_eval_cmd_play_items(items, str))
-            return VSK_SOUND_ERR_ILLEGAL;
-
-        // create phrase
-        auto phrase = std::make_shared<VskPhrase>(
-            (iChannel < 3) ? vsk_fm_sound_settings[iChannel] : vsk_ssg_sound_settings[iChannel - 3]
-        );
-        phrase->m_setting.m_fm = (iChannel < 3);
-        if (!vsk_phrase_from_cmd_play_items(phrase, items))
-            return VSK_SOUND_ERR_ILLEGAL;
-
-        // add phrase
-        block.push_back(phrase);
-        // next channel
-        ++iChannel;
-    }
+    if (auto err = vsk_cmd_play_compile(engine, strs, VSK_PLAY_MODE_FM_AND_SSG, block))
+        return err;
 
     if (!no_sound)
     {
         // play now
-        vsk_sound_player->play(block, stereo);
+        engine.m_player->play(block, stereo);
     }
 
     return VSK_SOUND_ERR_SUCCESS;
 }
 
-// FM音源で音楽再生
-VSK_SOUND_ERR vsk_sound_cmd_play_fm(const std::vector<VskString>& strs, bool stereo, bool no_sound)
+// FM+SSG音源で音楽再生
+VSK_SOUND_ERR vsk_sound_cmd_play_fm_and_ssg(const std::vector<VskString>& strs, bool stereo, bool no_sound)
 {
-    assert(strs.size() <= VSK_MAX_CHANNEL);
-    size_t iChannel = 0;
+    return vsk_sound_cmd_play_fm_and_ssg(vsk_default_engine(), strs, stereo, no_sound);
+}
 
+// FM音源で音楽再生
+VSK_SOUND_ERR vsk_sound_cmd_play_fm(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound)
+{
     // add phrases to block
     VskScoreBlock block;
-    // for each channel strings
-    for (auto& str : strs) {
-        // get play items
-        std::vector<VskPlayItem> items;
-        if (!vsk_eval_cmd_play_items(items, str))
-            return VSK_SOUND_ERR_ILLEGAL;
-
-        // create phrase
-        auto phrase = std::make_shared<VskPhrase>(vsk_fm_sound_settings[iChannel]);
-        phrase->m_setting.m_fm = true;
-        if (!vsk_phrase_from_cmd_play_items(phrase, items))
-            return VSK_SOUND_ERR_ILLEGAL;
-
-        // add phrase
-        block.push_back(phrase);
-        // next channel
-        ++iChannel;
-    }
+    if (auto err = vsk_cmd_play_compile(engine, strs, VSK_PLAY_MODE_FM, block))
+        return err;
 
     if (!no_sound)
     {
         // play now
-        vsk_sound_player->play(block, stereo);
+        engine.m_player->play(block, stereo);
     }
 
     return VSK_SOUND_ERR_SUCCESS;
 }
 
+// FM音源で音楽再生
+VSK_SOUND_ERR vsk_sound_cmd_play_fm(const std::vector<VskString>& strs, bool stereo, bool no_sound)
+{
+    return vsk_sound_cmd_play_fm(vsk_default_engine(), strs, stereo, no_sound);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 // SSG音源で音楽保存
-VSK_SOUND_ERR vsk_sound_cmd_play_ssg_save(const std::vector<VskString>& strs, const wchar_t *filename, bool stereo)
+VSK_SOUND_ERR vsk_sound_cmd_play_ssg_save(VskEngine& engine, const std::vector<VskString>& strs, const wchar_t *filename, bool stereo)
 {
-    assert(strs.size() <= VSK_MAX_CHANNEL);
-    size_t iChannel = 0;
-
     // add phrases to block
     VskScoreBlock block;
-    // for each channel strings
-    for (auto& str : strs) {
-        // get play items
-        std::vector<VskPlayItem> items;
-        if (!vsk_eval_cmd_play_items(items, str))
-            return VSK_SOUND_ERR_ILLEGAL;
+    if (auto err = vsk_cmd_play_compile(engine, strs, VSK_PLAY_MODE_SSG, block))
+        return err;
 
-        // create phrase
-        auto phrase = std::make_shared<VskPhrase>(vsk_ssg_sound_settings[iChannel]);
-        phrase->m_setting.m_fm = false;
-        if (!vsk_phrase_from_cmd_play_items(phrase, items))
-            return VSK_SOUND_ERR_ILLEGAL;
+    if (!engine.m_player->save_as_file(block, filename, stereo))
+        return VSK_SOUND_ERR_IO_ERROR;
 
-        // add phrase
-        block.push_back(phrase);
-        // next channel
-        ++iChannel;
-    }
+    return VSK_SOUND_ERR_SUCCESS;
+}
 
-    if (!vsk_sound_player->save_as_wav(block, filename, stereo))
-        return VSK_SOUND_ERR_IO_ERROR;
+// SSG音源で音楽保存
+VSK_SOUND_ERR vsk_sound_cmd_play_ssg_save(const std::vector<VskString>& strs, const wchar_t *filename, bool stereo)
+{
+    return vsk_sound_cmd_play_ssg_save(vsk_default_engine(), strs, filename, stereo);
+}
+
+// FM+SSG音源で音楽保存
+VSK_SOUND_ERR vsk_sound_cmd_play_fm_and_ssg_save(VskEngine& engine, const std::vector<VskString>& strs, const wchar_t *filename, bool stereo)
+{
+    // add phrases to block
+    VskScoreBlock block;
+    if (auto err = vsk_cmd_play_compile(engine, strs, VSK_PLAY_MODE_FM_AND_SSG, block))
+        return err;
+
+    if (!engine.m_player->save_as_file(block, filename, stereo))
+        return VSK_SOUND_ERR_IO_ERROR; // 失敗
 
     return VSK_SOUND_ERR_SUCCESS;
 }
@@ -737,33 +761,18 @@ VSK_SOUND_ERR vsk_sound_cmd_play_ssg_save(const std::vector<VskString>& strs, co
 // FM+SSG音源で音楽保存
 VSK_SOUND_ERR vsk_sound_cmd_play_fm_and_ssg_save(const std::vector<VskString>& strs, const wchar_t *filename, bool stereo)
 {
-    assert(strs.size() <= VSK_MAX_CHANNEL);
-    size_t iChannel = 0;
+    return vsk_sound_cmd_play_fm_and_ssg_save(vsk_default_engine(), strs, filename, stereo);
+}
 
+// FM音源で音楽保存
+VSK_SOUND_ERR vsk_sound_cmd_play_fm_save(VskEngine& engine, const std::vector<VskString>& strs, const wchar_t *filename, bool stereo)
+{
     // add phrases to block
     VskScoreBlock block;
-    // for each channel strings
-    for (auto& str : strs) {
-        // get play items
-        std::vector<VskPlayItem> items;
-        if (!vsk_eval_cmd_play_items(items, str))
-            return VSK_SOUND_ERR_ILLEGAL;
-
-        // create phrase
-        auto phrase = std::make_shared<VskPhrase>(
-            (iChannel < 3) ? vsk_fm_sound_settings[iChannel] : vsk_ssg_sound_settings[iChannel - 3]
-        );
-        phrase->m_setting.m_fm = (iChannel < 3);
-        if (!vsk_phrase_from_cmd_play_items(phrase, items))
-            return VSK_SOUND_ERR_ILLEGAL;
-
-        // add phrase
-        block.push_back(phrase);
-        // next channel
-        ++iChannel;
-    }
+    if (auto err = vsk_cmd_play_compile(engine, strs, VSK_PLAY_MODE_FM, block))
+        return err;
 
-    if (!vsk_sound_player->save_as_wav(block, filename, stereo))
+    if (!engine.m_player->save_as_file(block, filename, stereo))
         return VSK_SOUND_ERR_IO_ERROR; // 失敗
 
     return VSK_SOUND_ERR_SUCCESS;
@@ -772,32 +781,35 @@ VSK_SOUND_ERR vsk_sound_cmd_play_fm_and_ssg_save(const std::vector<VskString>& s
 // FM音源で音楽保存
 VSK_SOUND_ERR vsk_sound_cmd_play_fm_save(const std::vector<VskString>& strs, const wchar_t *filename, bool stereo)
 {
-    assert(strs.size() <= VSK_MAX_CHANNEL);
-    size_t iChannel = 0;
-
-    // add phrases to block
-    VskScoreBlock block;
-    // for each channel strings
-    for (auto& str : strs) {
-        // get play items
-        std::vector<VskPlayItem> items;
-        if (!vsk_eval_cmd_play_items(items, str))
-            return VSK_SOUND_ERR_ILLEGAL; // 失敗
+    return vsk_sound_cmd_play_fm_save(vsk_default_engine(), strs, filename, stereo);
+}
 
-        // create phrase
-        auto phrase = std::make_shared<VskPhrase>(vsk_fm_sound_settings[iChannel]);
-        phrase->m_setting.m_fm = true;
-        if (!vsk_phrase_from_cmd_play_items(phrase, items))
-            return VSK_SOUND_ERR_ILLEGAL; // 失敗
+//////////////////////////////////////////////////////////////////////////////
+// 非同期版のCMD PLAY
 
-        // add phrase
-        block.push_back(phrase);
-        // next channel
-        ++iChannel;
-    }
+std::shared_ptr<VskTask>
+vsk_sound_cmd_play_ssg_async(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound,
+                             VskTaskCallback callback, void *user)
+{
+    return vsk_task_start(engine, [strs, stereo, no_sound](VskEngine& engine) {
+        return vsk_sound_cmd_play_ssg(engine, strs, stereo, no_sound);
+    }, callback, user);
+}
 
-    if (!vsk_sound_player->save_as_wav(block, filename, stereo))
-        return VSK_SOUND_ERR_IO_ERROR; // 失敗
+std::shared_ptr<VskTask>
+vsk_sound_cmd_play_fm_and_ssg_async(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound,
+                                    VskTaskCallback callback, void *user)
+{
+    return vsk_task_start(engine, [strs, stereo, no_sound](VskEngine& engine) {
+        return vsk_sound_cmd_play_fm_and_ssg(engine, strs, stereo, no_sound);
+    }, callback, user);
+}
 
-    return VSK_SOUND_ERR_SUCCESS;
+std::shared_ptr<VskTask>
+vsk_sound_cmd_play_fm_async(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound,
+                            VskTaskCallback callback, void *user)
+{
+    return vsk_task_start(engine, [strs, stereo, no_sound](VskEngine& engine) {
+        return vsk_sound_cmd_play_fm(engine, strs, stereo, no_sound);
+    }, callback, user);
 }
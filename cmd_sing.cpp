@@ -8,16 +8,19 @@
 
 #include "soundplayer.h"                // サウンドプレーヤー
 #include "scanner.h"                    // VskScanner
+#include "engine.h"                     // VskEngine
+#include "task.h"                       // VskTask
 
-// サウンドプレーヤー
-extern std::shared_ptr<VskSoundPlayer> vsk_sound_player;
-// CMD SINGの現在の設定
-static VskSoundSetting vsk_cmd_sing_settings;
+// 設定をリセット
+void vsk_cmd_sing_reset_settings(VskEngine& engine)
+{
+    engine.m_sing_setting = VskSoundSetting();
+}
 
 // 設定をリセット
 void vsk_cmd_sing_reset_settings(void)
 {
-    vsk_cmd_sing_settings = VskSoundSetting();
+    vsk_cmd_sing_reset_settings(vsk_default_engine());
 }
 
 // 設定のサイズ
@@ -27,25 +30,37 @@ size_t vsk_cmd_sing_get_setting_size(void)
 }
 
 // 設定の取得
-bool vsk_cmd_sing_get_setting(std::vector<uint8_t>& data)
+bool vsk_cmd_sing_get_setting(VskEngine& engine, std::vector<uint8_t>& data)
 {
     data.resize(sizeof(VskSoundSetting));
-    std::memcpy(data.data(), &vsk_cmd_sing_settings, sizeof(VskSoundSetting));
+    std::memcpy(data.data(), &engine.m_sing_setting, sizeof(VskSoundSetting));
     return true;
 }
 
+// 設定の取得
+bool vsk_cmd_sing_get_setting(std::vector<uint8_t>& data)
+{
+    return vsk_cmd_sing_get_setting(vsk_default_engine(), data);
+}
+
 // 設定の設定
-bool vsk_cmd_sing_set_setting(const std::vector<uint8_t>& data)
+bool vsk_cmd_sing_set_setting(VskEngine& engine, const std::vector<uint8_t>& data)
 {
     if (data.size() != sizeof(VskSoundSetting))
         return false;
-    std::memcpy(&vsk_cmd_sing_settings, data.data(), sizeof(VskSoundSetting));
+    std::memcpy(&engine.m_sing_setting, data.data(), sizeof(VskSoundSetting));
     return true;
 }
 
+// 設定の設定
+bool vsk_cmd_sing_set_setting(const std::vector<uint8_t>& data)
+{
+    return vsk_cmd_sing_set_setting(vsk_default_engine(), data);
+}
+
 // 再帰的に「{変数名}」を変数の値に置き換える関数
 std::string
-vsk_replace_sing_placeholders(const std::string& str, std::unordered_set<std::string>& visited) {
+vsk_replace_sing_placeholders(VskEngine& engine, const std::string& str, std::unordered_set<std::string>& visited) {
     std::string result = str;
     size_t start_pos = 0;
 
@@ -62,10 +77,10 @@ vsk_replace_sing_placeholders(const std::string& str, std::unordered_set<std::st
         }
         visited.insert(key);
 
-        auto it = g_variables.find(key);
-        if (it != g_variables.end()) {
+        auto it = engine.m_variables.find(key);
+        if (it != engine.m_variables.end()) {
             // ここで再帰的に置き換えを行う
-            std::string value = vsk_replace_sing_placeholders(it->second, visited);
+            std::string value = vsk_replace_sing_placeholders(engine, it->second, visited);
             result.replace(start_pos, end_pos - start_pos + 1, value);
             start_pos += value.length(); // 置き換えた後の新しい開始位置に移動
         } else {
@@ -78,10 +93,17 @@ vsk_replace_sing_placeholders(const std::string& str, std::unordered_set<std::st
 }
 
 // 再帰的に「{変数名}」を変数の値に置き換える関数
-std::string vsk_replace_sing_placeholders(const std::string& str)
+std::string vsk_replace_sing_placeholders(VskEngine& engine, const std::string& str)
 {
+    VskStageTimer timer(engine.m_stats, VSK_STAGE_EXPAND);
     std::unordered_set<std::string> visited;
-    return vsk_replace_sing_placeholders(str, visited);
+    return vsk_replace_sing_placeholders(engine, str, visited);
+}
+
+// 再帰的に「{変数名}」を変数の値に置き換える関数
+std::string vsk_replace_sing_placeholders(const std::string& str)
+{
+    return vsk_replace_sing_placeholders(vsk_default_engine(), str);
 }
 
 // VskSingItem --- CMD SING 用の演奏項目
@@ -123,22 +145,23 @@ VskString vsk_string_from_sing_items(const std::vector<VskSingItem>& items)
 }
 
 // CMD SINGのパラメータを取得する
-VskAstPtr vsk_get_sing_param(const VskSingItem& item)
+VskAstPtr vsk_get_sing_param(VskEngine& engine, const VskSingItem& item)
 {
     if (item.m_param.empty())
         return nullptr;
-    return vsk_eval_text(item.m_param);
+    return vsk_eval_text(item.m_param, engine.m_variables);
 } // vsk_get_sing_param
 
 // CMD SINGの項目群からフレーズを作成する
-bool vsk_phrase_from_sing_items(std::shared_ptr<VskPhrase> phrase, const std::vector<VskSingItem>& items)
+bool vsk_phrase_from_sing_items(VskEngine& engine, std::shared_ptr<VskPhrase> phrase, const std::vector<VskSingItem>& items)
 {
+    VskStageTimer timer(engine.m_stats, VSK_STAGE_PARSE);
     float length;
     for (auto& item : items) {
         char ch = item.m_subcommand[0];
         switch (ch) {
         case 'T': // Tempo (テンポ)
-            if (auto ast = vsk_get_sing_param(item)) {
+            if (auto ast = vsk_get_sing_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if ((48 <= i0) && (i0 <= 255)) {
                     phrase->m_setting.m_tempo = i0;
@@ -147,7 +170,7 @@ bool vsk_phrase_from_sing_items(std::shared_ptr<VskPhrase> phrase, const std::ve
             }
             return false;
         case 'O': // Octave (オクターブ)
-            if (auto ast = vsk_get_sing_param(item)) {
+            if (auto ast = vsk_get_sing_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if ((3 <= i0) && (i0 <= 6)) {
                     phrase->m_setting.m_octave = i0 - 1;
@@ -156,7 +179,7 @@ bool vsk_phrase_from_sing_items(std::shared_ptr<VskPhrase> phrase, const std::ve
             }
             return false;
         case 'L': // Length (音符・休符の長さ)
-            if (auto ast = vsk_get_sing_param(item)) {
+            if (auto ast = vsk_get_sing_param(engine, item)) {
                 auto i0 = ast->to_int();
                 if ((1 <= i0) && (i0 <= 32)) {
                     phrase->m_setting.m_length = (24.0f * 4) / i0;
@@ -171,7 +194,7 @@ bool vsk_phrase_from_sing_items(std::shared_ptr<VskPhrase> phrase, const std::ve
             // ...FALL THROUGH...
         case 'C': case 'D': case 'E': case 'F': case 'G': case 'A': case 'B':
             // 音符(CDEFGAB)か休符(Rest)
-            if (auto ast = vsk_get_sing_param(item)) {
+            if (auto ast = vsk_get_sing_param(engine, item)) {
                 auto L = ast->to_int();
                 // NOTE: 24 is the length of a quarter note
                 if ((1 <= L) && (L <= 32)) {
@@ -186,7 +209,7 @@ bool vsk_phrase_from_sing_items(std::shared_ptr<VskPhrase> phrase, const std::ve
             continue;
         case 'X':
             // スペシャルアクション
-            if (auto ast = vsk_get_sing_param(item)) {
+            if (auto ast = vsk_get_sing_param(engine, item)) {
                 int action_no = ast->to_int();
                 phrase->add_action_node(ch, action_no);
                 continue;
@@ -194,65 +217,85 @@ bool vsk_phrase_from_sing_items(std::shared_ptr<VskPhrase> phrase, const std::ve
             return false;
         }
     }
+    phrase->finalize();
     return true;
 } // vsk_phrase_from_sing_items
 
 // CMD SINGの項目の繰り返し(RP)を展開する。
-bool vsk_expand_sing_items_repeat(std::vector<VskSingItem>& items)
+// 内側の繰り返しから一つずつ展開して最初からやり直すと、項目数の二乗に比例する
+// 時間がかかるので、繰り返しの本体をスタックに積みながら一回の走査で展開する。
+bool vsk_expand_sing_items_repeat(VskEngine& engine, std::vector<VskSingItem>& items)
 {
-retry:;
-    int level = 0, repeat = 0;
-    auto it_repeat = items.end();
+    VskStageTimer timer(engine.m_stats, VSK_STAGE_REPEAT);
+
+    // 展開中の繰り返し
+    struct VskSingRepeat {
+        std::vector<VskSingItem> m_head;    // 「RP」と「[」
+        std::vector<VskSingItem> m_body;    // 展開済みの本体
+        int m_repeat;                       // 繰り返しの回数
+    };
+    std::vector<VskSingRepeat> stack(1); // 一番下は繰り返しの外側
+
     for (auto it = items.begin(); it != items.end(); ++it) {
         if (it->m_subcommand == "RP") { // 繰り返し（repeat）
-            if (auto ast = vsk_get_sing_param(*it)) { // RPの引数
-                repeat = ast->to_int();
-                if (repeat < 0 || 255 < repeat) { // 繰り返しの回数が不正？
-                    assert(0);
-                    return false;
-                }
-                it_repeat = it; // RPのある位置を覚えておく
-                ++it;
-                if (it == items.end()) {
-                    assert(0);
-                    return false; // 文法エラー
-                }
-                if (it->m_subcommand == "[") { // 繰り返しの始まり
-                    ++level;
-                    if (level >= 8) { // 多重ループが限界を超えた？
-                        assert(0);
-                        return false; // 不正
-                    }
-                } else { // 繰り返しの始まりがなかった？
-                    assert(0);
-                    return false; // 文法エラー
-                }
-            } else { // 引数がなかった？
+            auto ast = vsk_get_sing_param(engine, *it); // RPの引数
+            if (!ast) { // 引数がなかった？
+                assert(0);
+                return false; // 文法エラー
+            }
+            int repeat = ast->to_int();
+            if (repeat < 0 || 255 < repeat) { // 繰り返しの回数が不正？
+                assert(0);
+                return false;
+            }
+            ++it;
+            if (it == items.end() || it->m_subcommand != "[") { // 繰り返しの始まりがなかった？
                 assert(0);
                 return false; // 文法エラー
             }
+            if (stack.size() >= 8) { // 多重ループが限界を超えた？
+                assert(0);
+                return false; // 不正
+            }
+            stack.emplace_back();
+            stack.back().m_head.assign(it - 1, it + 1);
+            stack.back().m_repeat = repeat;
             continue;
         }
         if (it->m_subcommand == "]") { // 繰り返しの終わり
-            --level;
-            if (it_repeat == items.end()) { // 繰り返しの始まりがなかった？
+            if (stack.size() <= 1) { // 繰り返しの始まりがなかった？
                 assert(0);
                 return false; // 文法エラー
             }
-            std::vector<VskSingItem> sub(it_repeat + 2, it);
-            auto insert_position = items.erase(it_repeat, it + 1);
-            for (int m = 0; m < repeat; ++m) {
-                insert_position = items.insert(insert_position, sub.begin(), sub.end());
+            VskSingRepeat top = std::move(stack.back());
+            stack.pop_back();
+            auto& body = stack.back().m_body;
+            for (int m = 0; m < top.m_repeat; ++m) {
+                body.insert(body.end(), top.m_body.begin(), top.m_body.end());
             }
-            goto retry; // 一回展開したら最初からやり直し
+            continue;
         }
+        stack.back().m_body.push_back(*it);
     }
+
+    // 閉じていない繰り返しは展開せずに残す
+    while (stack.size() > 1) {
+        VskSingRepeat top = std::move(stack.back());
+        stack.pop_back();
+        auto& body = stack.back().m_body;
+        body.insert(body.end(), top.m_head.begin(), top.m_head.end());
+        body.insert(body.end(), top.m_body.begin(), top.m_body.end());
+    }
+
+    items = std::move(stack.back().m_body);
     return true; // 成功
 } // vsk_expand_sing_items_repeat
 
 // 文字列からCMD SINGの項目を取得する
-bool vsk_sing_items_from_string(std::vector<VskSingItem>& items, const VskString& expr)
+bool vsk_sing_items_from_string(VskEngine& engine, std::vector<VskSingItem>& items, const VskString& expr)
 {
+    VskStageTimer timer(engine.m_stats, VSK_STAGE_PARSE);
+
     // 大文字にする
     auto str = expr;
     vsk_upper(str);
@@ -367,55 +410,128 @@ bool vsk_sing_items_from_string(std::vector<VskSingItem>& items, const VskString
     }
 
     // 繰り返しを展開する
-    return vsk_expand_sing_items_repeat(items);
+    return vsk_expand_sing_items_repeat(engine, items);
 } // vsk_sing_items_from_string
 
-// CMD SING文実装の本体
-VSK_SOUND_ERR vsk_sound_cmd_sing(const char *str, bool stereo, bool no_sound)
+// CMD SINGの文字列からフレーズを作成する。失敗したらnullを返す
+static std::shared_ptr<VskPhrase> vsk_sing_phrase_from_string(VskEngine& engine, const char *str)
 {
-    VskString s = vsk_replace_sing_placeholders(str); // {文字列変数名}を展開する
+    VskString s = vsk_replace_sing_placeholders(engine, str); // {文字列変数名}を展開する
 
     // 文字列からCMD SINGの項目を取得する
     std::vector<VskSingItem> items;
-    if (!vsk_sing_items_from_string(items, s))
-        return VSK_SOUND_ERR_ILLEGAL; // 失敗
+    if (!vsk_sing_items_from_string(engine, items, s))
+        return nullptr; // 失敗
 
     // フレーズを作成する
-    auto phrase = std::make_shared<VskPhrase>(vsk_cmd_sing_settings);
+    auto phrase = std::make_shared<VskPhrase>(engine.m_sing_setting);
     phrase->m_setting.m_fm = false;
-    if (!vsk_phrase_from_sing_items(phrase, items))
+    if (!vsk_phrase_from_sing_items(engine, phrase, items))
+        return nullptr; // 失敗
+
+    return phrase;
+}
+
+// CMD SINGの文字列を解析して、フレーズをblockに追加する
+VSK_SOUND_ERR vsk_cmd_sing_compile(VskEngine& engine, const char *str, VskScoreBlock& block)
+{
+    auto phrase = vsk_sing_phrase_from_string(engine, str);
+    if (!phrase)
+        return VSK_SOUND_ERR_ILLEGAL; // 失敗
+
+    block.push_back(phrase);
+    return VSK_SOUND_ERR_SUCCESS;
+}
+
+// CMD SING文実装の本体
+VSK_SOUND_ERR vsk_sound_cmd_sing(VskEngine& engine, const char *str, bool stereo, bool no_sound)
+{
+    // 文字列からフレーズを作成する
+    auto phrase = vsk_sing_phrase_from_string(engine, str);
+    if (!phrase)
         return VSK_SOUND_ERR_ILLEGAL; // 失敗
 
     if (!no_sound)
     {
         // フレーズを演奏する
         VskScoreBlock block = { phrase };
-        vsk_sound_player->play(block, stereo);
+        engine.m_player->play(block, stereo);
     }
 
     return VSK_SOUND_ERR_SUCCESS; // 成功
 }
 
-// CMD SING文の出力をWAVファイルに保存する
-VSK_SOUND_ERR vsk_sound_cmd_sing_save(const char *str, const wchar_t *filename, bool stereo)
+// CMD SING文実装の本体
+VSK_SOUND_ERR vsk_sound_cmd_sing(const char *str, bool stereo, bool no_sound)
 {
-    VskString s = vsk_replace_sing_placeholders(str); // {文字列変数名}を展開する
+    return vsk_sound_cmd_sing(vsk_default_engine(), str, stereo, no_sound);
+}
 
-    // 文字列からCMD SINGの項目を取得する
-    std::vector<VskSingItem> items;
-    if (!vsk_sing_items_from_string(items, s))
+// CMD SING文の出力をWAVファイルに保存する
+VSK_SOUND_ERR vsk_sound_cmd_sing_save(VskEngine& engine, const char *str, const wchar_t *filename, bool stereo)
+{
+    // 文字列からフレーズを作成する
+    auto phrase = vsk_sing_phrase_from_string(engine, str);
+    if (!phrase)
         return VSK_SOUND_ERR_ILLEGAL; // 失敗
 
-    // フレーズを作成する
-    auto phrase = std::make_shared<VskPhrase>(vsk_cmd_sing_settings);
-    phrase->m_setting.m_fm = false;
-    if (!vsk_phrase_from_sing_items(phrase, items))
+    // フレーズを演奏する
+    VskScoreBlock block = { phrase };
+    if (!engine.m_player->save_as_file(block, filename, stereo))
+        return VSK_SOUND_ERR_IO_ERROR; // 失敗
+
+    return VSK_SOUND_ERR_SUCCESS;
+}
+
+// CMD SING文の出力をWAVファイルに保存する
+VSK_SOUND_ERR vsk_sound_cmd_sing_save(const char *str, const wchar_t *filename, bool stereo)
+{
+    return vsk_sound_cmd_sing_save(vsk_default_engine(), str, filename, stereo);
+}
+
+// CMD SING文の出力を、前に流し出した波形の続きとしてsinkに書き込む。
+// 音源と設定は前の文字列から引き継ぐので、文字列の間に切れ目ができない
+VSK_SOUND_ERR vsk_sound_cmd_sing_stream(VskEngine& engine, const char *str, VskPcmSink& sink, bool stereo)
+{
+    // 文字列からフレーズを作成する
+    auto phrase = vsk_sing_phrase_from_string(engine, str);
+    if (!phrase)
         return VSK_SOUND_ERR_ILLEGAL; // 失敗
 
-    // フレーズを演奏する
+    // フレーズを描画して書き込む
     VskScoreBlock block = { phrase };
-    if (!vsk_sound_player->save_as_wav(block, filename, stereo))
+    if (!engine.m_player->render_stream(block, sink, stereo))
         return VSK_SOUND_ERR_IO_ERROR; // 失敗
 
     return VSK_SOUND_ERR_SUCCESS;
 }
+
+// CMD SING文の出力を、前に流し出した波形の続きとしてsinkに書き込む
+VSK_SOUND_ERR vsk_sound_cmd_sing_stream(const char *str, VskPcmSink& sink, bool stereo)
+{
+    return vsk_sound_cmd_sing_stream(vsk_default_engine(), str, sink, stereo);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 非同期版のCMD SING
+
+std::shared_ptr<VskTask>
+vsk_sound_cmd_sing_async(VskEngine& engine, const char *str, bool stereo, bool no_sound,
+                         VskTaskCallback callback, void *user)
+{
+    VskString copy = str;
+    return vsk_task_start(engine, [copy, stereo, no_sound](VskEngine& engine) {
+        return vsk_sound_cmd_sing(engine, copy.c_str(), stereo, no_sound);
+    }, callback, user);
+}
+
+std::shared_ptr<VskTask>
+vsk_sound_cmd_sing_save_async(VskEngine& engine, const char *str, const wchar_t *filename, bool stereo,
+                              VskTaskCallback callback, void *user)
+{
+    VskString copy = str;
+    std::wstring file = filename;
+    return vsk_task_start(engine, [copy, file, stereo](VskEngine& engine) {
+        return vsk_sound_cmd_sing_save(engine, copy.c_str(), file.c_str(), stereo);
+    }, callback, user);
+}
@@ -0,0 +1,172 @@
+﻿//////////////////////////////////////////////////////////////////////////////
+// cmd_sing_api --- C API of the CMD SING / CMD PLAY engine for embedding
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "cmd_sing_api.h"
+#include "engine.h"
+#include "encoding.h"
+#include <cstring>
+#include <new>
+
+// エンジンと、描画した楽譜と演奏位置
+struct cmd_sing_engine
+{
+    VskEngine       m_engine;
+    VskScoreBlock   m_block;            // 描画した楽譜。フレーズの波形はプレーヤーが持つ
+    bool            m_stereo = true;
+    size_t          m_position = 0;     // 次に書き込むフレーム
+    size_t          m_length = 0;       // 楽譜のフレーム数
+};
+
+// 楽譜を描画する。フレーズの波形は混合せずにプレーヤーに残す
+static int cmd_sing_compile_block(cmd_sing_engine *engine, VskScoreBlock& block)
+{
+    VskSoundPlayer& player = *engine->m_engine.m_player;
+    player.reset();
+    std::vector<VSK_PCM16_VALUE> unused;
+    if (!player.generate_pcm_raw(block, unused, engine->m_stereo, false))
+        return CMD_SING_ERR_ILLEGAL;
+
+    engine->m_block = std::move(block);
+    engine->m_position = 0;
+    engine->m_length = player.get_phrase_frames();
+    player.m_num_samples_generated += engine->m_length;
+    return CMD_SING_OK;
+}
+
+int cmd_sing_api_version(void)
+{
+    return CMD_SING_API_VERSION;
+}
+
+cmd_sing_engine *cmd_sing_create(const char *rhythm_path, int stereo)
+{
+    cmd_sing_engine *engine = new(std::nothrow) cmd_sing_engine();
+    if (!engine)
+        return nullptr;
+
+    try {
+        if (!vsk_engine_init(engine->m_engine, rhythm_path)) {
+            delete engine;
+            return nullptr;
+        }
+    } catch (...) {
+        delete engine;
+        return nullptr;
+    }
+
+    engine->m_stereo = !!stereo;
+    return engine;
+}
+
+void cmd_sing_destroy(cmd_sing_engine *engine)
+{
+    delete engine;
+}
+
+void cmd_sing_reset(cmd_sing_engine *engine)
+{
+    if (!engine)
+        return;
+    vsk_cmd_sing_reset_settings(engine->m_engine);
+    vsk_cmd_play_reset_settings(engine->m_engine);
+    engine->m_engine.m_variables.clear();
+}
+
+int cmd_sing_set_variable(cmd_sing_engine *engine, const char *name, const char *value)
+{
+    if (!engine || !name || !value)
+        return CMD_SING_ERR_INVALID_ARG;
+
+    try {
+        VskString var = name;
+        vsk_upper(var);
+        engine->m_engine.m_variables[var] = value;
+    } catch (const std::bad_alloc&) {
+        return CMD_SING_ERR_NO_MEMORY;
+    }
+    return CMD_SING_OK;
+}
+
+int cmd_sing_compile_sing(cmd_sing_engine *engine, const char *str)
+{
+    if (!engine || !str)
+        return CMD_SING_ERR_INVALID_ARG;
+
+    // 例外はCの呼び出し元に投げない（変数の循環参照など）
+    try {
+        VskScoreBlock block;
+        if (vsk_cmd_sing_compile(engine->m_engine, str, block))
+            return CMD_SING_ERR_ILLEGAL;
+        return cmd_sing_compile_block(engine, block);
+    } catch (const std::bad_alloc&) {
+        return CMD_SING_ERR_NO_MEMORY;
+    } catch (...) {
+        return CMD_SING_ERR_ILLEGAL;
+    }
+}
+
+int cmd_sing_compile_play(cmd_sing_engine *engine, int mode, const char * const *strs, size_t count)
+{
+    if (!engine || (!strs && count))
+        return CMD_SING_ERR_INVALID_ARG;
+    if (mode < CMD_SING_PLAY_SSG || mode > CMD_SING_PLAY_FM)
+        return CMD_SING_ERR_INVALID_ARG;
+
+    // 例外はCの呼び出し元に投げない（変数の循環参照など）
+    try {
+        std::vector<VskString> items;
+        for (size_t i = 0; i < count; ++i) {
+            if (!strs[i])
+                return CMD_SING_ERR_INVALID_ARG;
+            items.push_back(strs[i]);
+        }
+
+        VskScoreBlock block;
+        if (vsk_cmd_play_compile(engine->m_engine, items, VskPlayMode(mode), block))
+            return CMD_SING_ERR_ILLEGAL;
+        return cmd_sing_compile_block(engine, block);
+    } catch (const std::bad_alloc&) {
+        return CMD_SING_ERR_NO_MEMORY;
+    } catch (...) {
+        return CMD_SING_ERR_ILLEGAL;
+    }
+}
+
+size_t cmd_sing_render(cmd_sing_engine *engine, int16_t *out, size_t frames)
+{
+    if (!engine || !out)
+        return 0;
+
+    // プレーヤーに残したフレーズの波形から直接混合する
+    VskSoundPlayer& player = *engine->m_engine.m_player;
+    size_t written = 0;
+    if (engine->m_block.size())
+        written = player.mix_frames(engine->m_position, out, frames);
+    engine->m_position += written;
+
+    // 楽譜の終わりより後は無音
+    const size_t num_channels = (engine->m_stereo ? 2 : 1);
+    std::memset(out + written * num_channels, 0, (frames - written) * num_channels * sizeof(int16_t));
+    return written;
+}
+
+size_t cmd_sing_get_length(cmd_sing_engine *engine)
+{
+    return engine ? engine->m_length : 0;
+}
+
+size_t cmd_sing_get_position(cmd_sing_engine *engine)
+{
+    return engine ? engine->m_position : 0;
+}
+
+void cmd_sing_seek(cmd_sing_engine *engine, size_t frame)
+{
+    if (!engine)
+        return;
+    engine->m_position = (frame < engine->m_length) ? frame : engine->m_length;
+}
+
+//////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,86 @@
+//////////////////////////////////////////////////////////////////////////////
+// cmd_sing_api --- C API of the CMD SING / CMD PLAY engine for embedding
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+    #ifdef CMD_SING_API_BUILD
+        #define CMD_SING_API __declspec(dllexport)
+    #else
+        #define CMD_SING_API __declspec(dllimport)
+    #endif
+#else
+    #define CMD_SING_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// APIの版。互換性のない変更をしたら増やす
+#define CMD_SING_API_VERSION 1
+
+// 戻り値
+#define CMD_SING_OK                 0   // 成功
+#define CMD_SING_ERR_ILLEGAL        1   // 文字列が不正（Illegal function call）
+#define CMD_SING_ERR_NO_MEMORY      4   // メモリー不足
+#define CMD_SING_ERR_INVALID_ARG    5   // 引数が不正
+
+// cmd_sing_compile_playの音源の使い方
+#define CMD_SING_PLAY_SSG           0   // SSGだけ
+#define CMD_SING_PLAY_FM_AND_SSG    1   // FMとSSG
+#define CMD_SING_PLAY_FM            2   // FMだけ
+
+//////////////////////////////////////////////////////////////////////////////
+// cmd_sing_engine - 演奏エンジン
+//
+// cmd_sing_compile_* で楽譜を描画しておき、cmd_sing_render で呼び出し元の
+// バッファに少しずつ混合して取り出す。出力デバイスは使わない。
+// cmd_sing_render は確保もロックもしないので、ミキサーのコールバックから呼べる。
+// 一つのエンジンを複数のスレッドから同時に使わないこと。別々のエンジンは同時に使える。
+// 波形は44100Hzの16ビット符号付き整数で、ステレオなら左右の順に並ぶ。
+
+typedef struct cmd_sing_engine cmd_sing_engine;
+
+// APIの版を返す
+CMD_SING_API int cmd_sing_api_version(void);
+
+// エンジンを作成する。rhythm_pathはリズム音源のフォルダ（NULLならリズム音なし）。
+// 失敗したらNULLを返す
+CMD_SING_API cmd_sing_engine *cmd_sing_create(const char *rhythm_path, int stereo);
+// エンジンを破棄する
+CMD_SING_API void cmd_sing_destroy(cmd_sing_engine *engine);
+
+// 設定と変数を初期状態に戻す
+CMD_SING_API void cmd_sing_reset(cmd_sing_engine *engine);
+// 文字列変数を設定する。楽譜の中で {name} として展開される
+CMD_SING_API int cmd_sing_set_variable(cmd_sing_engine *engine, const char *name, const char *value);
+
+// CMD SINGの文字列を描画して、演奏位置を先頭に戻す。
+// 音源は毎回初期状態から始め、設定は前の楽譜から引き継ぐ
+CMD_SING_API int cmd_sing_compile_sing(cmd_sing_engine *engine, const char *str);
+// CMD PLAYのチャンネルごとの文字列を描画して、演奏位置を先頭に戻す
+CMD_SING_API int cmd_sing_compile_play(cmd_sing_engine *engine, int mode, const char * const *strs, size_t count);
+
+// 演奏位置からframesフレームをoutに書き込み、演奏位置を進める。
+// outには frames * チャンネル数 個の値が入ること。楽譜の終わりより後は無音で埋める。
+// 楽譜から書き込んだフレーム数を返す
+CMD_SING_API size_t cmd_sing_render(cmd_sing_engine *engine, int16_t *out, size_t frames);
+
+// 描画した楽譜のフレーム数
+CMD_SING_API size_t cmd_sing_get_length(cmd_sing_engine *engine);
+// 演奏位置（フレーム）
+CMD_SING_API size_t cmd_sing_get_position(cmd_sing_engine *engine);
+// 演奏位置を移す
+CMD_SING_API void cmd_sing_seek(cmd_sing_engine *engine, size_t frame);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,50 @@
+﻿//////////////////////////////////////////////////////////////////////////////
+// engine --- a re-entrant context of CMD SING / CMD PLAY
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "engine.h"
+#include "task.h"
+
+// 既定のエンジン
+VskEngine& vsk_default_engine(void)
+{
+    static VskEngine s_engine;
+    return s_engine;
+}
+
+// 変数 (既定のエンジンの変数)
+std::map<VskString, VskString>& g_variables = vsk_default_engine().m_variables;
+
+// 音源エミュレータの表は全プレーヤーで共有されるので、プレーヤーの作成は一つずつ行う
+static unboost::mutex s_engine_init_lock;
+
+// 動いているタスクを止めてから破棄する
+VskEngine::~VskEngine()
+{
+    vsk_task_cancel(*this);
+}
+
+// エンジンを初期化する
+bool vsk_engine_init(VskEngine& engine, const char *rhythm_path)
+{
+    s_engine_init_lock.lock();
+    engine.m_player = std::make_shared<VskSoundPlayer>(rhythm_path);
+    s_engine_init_lock.unlock();
+
+    engine.m_player->m_engine = &engine;
+    return true;
+}
+
+// 前の描画と変わった部分だけを描画し直すか
+void vsk_sound_set_incremental(VskEngine& engine, bool incremental)
+{
+    engine.m_player->m_incremental = incremental;
+    if (!incremental)
+        engine.m_player->m_history.clear();
+}
+
+void vsk_sound_set_incremental(bool incremental)
+{
+    vsk_sound_set_incremental(vsk_default_engine(), incremental);
+}
@@ -0,0 +1,63 @@
+//////////////////////////////////////////////////////////////////////////////
+// engine --- a re-entrant context of CMD SING / CMD PLAY
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "types.h"
+#include "sound.h"
+#include "soundplayer.h"
+#include "stats.h"
+#include <map>
+
+// CMD PLAYのチャンネル数の上限。3チャンネルごとに音源を一つ使う
+#define VSK_MAX_CHANNEL 12
+
+// WAVE出力の状態 (sound.cpp で定義)
+struct VskWaveOut;
+
+// 非同期のタスク (task.h)
+class VskTask;
+
+// CMD PLAYの音源の使い方
+enum VskPlayMode {
+    VSK_PLAY_MODE_SSG = 0,      // SSGだけ
+    VSK_PLAY_MODE_FM_AND_SSG,   // FMとSSG
+    VSK_PLAY_MODE_FM,           // FMだけ
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// VskEngine --- 演奏エンジンの文脈
+//
+// サウンドプレーヤー、設定、変数、出力先をひとまとめに所有する。
+// 別々のエンジンは状態を共有しないので、別々のスレッドで同時に演奏・保存できる。
+// 従来の vsk_* 関数は既定のエンジン vsk_default_engine() に対する薄いラッパーである。
+
+struct VskEngine
+{
+    std::shared_ptr<VskSoundPlayer>     m_player;                           // サウンドプレーヤー
+    VskSoundSetting                     m_sing_setting;                     // CMD SINGの現在の設定
+    VskSoundSetting                     m_fm_settings[VSK_MAX_CHANNEL];     // CMD PLAYの現在の設定 (FM)
+    VskSoundSetting                     m_ssg_settings[VSK_MAX_CHANNEL];    // CMD PLAYの現在の設定 (SSG)
+    std::map<VskString, VskString>      m_variables;                        // 変数
+    int                                 m_reg_addr = 0;                     // Y で指定されたOPNレジスタ番号
+    std::shared_ptr<VskWaveOut>         m_wave_out;                         // WAVE出力
+    VskStats*                           m_stats = nullptr;                  // 統計（nullなら集計しない）
+    std::shared_ptr<VskTask>            m_task;                             // 最後に始めた非同期のタスク
+    unboost::mutex                      m_task_lock;                        // m_taskを入れ替えるときの排他制御
+
+    VskEngine() { }
+    ~VskEngine();
+    VskEngine(const VskEngine&) = delete;
+    VskEngine& operator=(const VskEngine&) = delete;
+}; // struct VskEngine
+
+//////////////////////////////////////////////////////////////////////////////
+// 文字列を解析してブロックにする。演奏も保存もしない
+
+VSK_SOUND_ERR vsk_cmd_sing_compile(VskEngine& engine, const char *str, VskScoreBlock& block);
+VSK_SOUND_ERR vsk_cmd_play_compile(VskEngine& engine, const std::vector<VskString>& strs, VskPlayMode mode,
+                                   VskScoreBlock& block);
+
+//////////////////////////////////////////////////////////////////////////////
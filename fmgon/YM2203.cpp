@@ -24,20 +24,80 @@ YM2203::YM2203() {
         m_fm_volumes[ich] = 0;
         m_ssg_enveloped[ich] = false;
     }
+    m_ssg_key_on = 0x3F;
+    m_ssg_envelope_type = 0;
     m_ssg_tone_noise[0] = 0x01;
     m_ssg_tone_noise[1] = 0x02;
     m_ssg_tone_noise[2] = 0x04;
+    m_num_reg_writes = 0;
+    m_num_reg_skips = 0;
+    m_write_hook = NULL;
+    m_write_hook_user = NULL;
+    reset_shadow();
 }
 
 void YM2203::init(uint32_t clock, uint32_t rate, const char* rhythmpath) {
     m_opna.Init(clock, rate, false, rhythmpath);
     m_opna.Reset();
+    reset_shadow();
     m_ssg_key_on = 0x3F;
     uint32_t addr = ADDR_SSG_MIXING;
     uint32_t data = 0x3F;
     write_reg(addr, data);
 }
 
+// Sets the shadow registers to the values that OPNA::Reset writes.
+void YM2203::reset_shadow() {
+    for (int addr = 0; addr < 0x100; ++addr) {
+        if (addr < 0x10 || (0x20 <= addr && addr < 0x28) || (0x30 <= addr && addr < 0xC0))
+            m_shadow_regs[addr] = 0;
+        else
+            m_shadow_regs[addr] = YM2203_REG_UNKNOWN;
+    }
+    m_shadow_regs[ADDR_SSG_MIXING] = 0xFF;
+    m_shadow_regs[0x0E] = m_shadow_regs[0x0F] = 0xFF;
+    for (int ich = 0; ich < FM_CH_NUM; ++ich)
+        m_fm_fnums[ich] = 0;
+    m_fm_no_skip = false;
+    m_fm_timbre_cached = 0;
+}
+
+// Updates the shadow registers and returns true if writing data to addr
+// changes nothing in the emulation. A write is redundant only if it is
+// idempotent in OPNA: the SSG envelope type (restarts the envelope), the
+// timers, key on/off, the prescaler and FB/ALGORITHM (resets the feedback)
+// are always written. Operator writes are never dropped once SSG-EG or CSM
+// has been used, since a full Prepare() there has side effects.
+bool YM2203::is_redundant_write(uint32_t addr, uint32_t data) {
+    if (addr >= 0x100)
+        return false;
+    data &= 0xFF;
+    uint16_t old = m_shadow_regs[addr];
+    m_shadow_regs[addr] = uint16_t(data);
+
+    if (addr <= 0x0C || addr == 0x22 || (0xA4 <= addr && addr <= 0xA6))
+        return old == data;
+
+    if (0xA0 <= addr && addr <= 0xA2) {
+        int ich = addr - 0xA0;
+        uint16_t latch = m_shadow_regs[0xA4 + ich];
+        uint16_t fnum = (latch == YM2203_REG_UNKNOWN) ? YM2203_REG_UNKNOWN : uint16_t((latch << 8) | data);
+        bool same = (fnum != YM2203_REG_UNKNOWN && m_fm_fnums[ich] == fnum);
+        m_fm_fnums[ich] = fnum;
+        return same;
+    }
+
+    if (addr == 0x27 && (data & 0x80))
+        m_fm_no_skip = true;
+    if (0x90 <= addr && addr < 0xA0 && (data & 0x08))
+        m_fm_no_skip = true;
+
+    if ((0x30 <= addr && addr < 0xA0) || (0xB4 <= addr && addr <= 0xB6))
+        return !m_fm_no_skip && old == data;
+
+    return false;
+}
+
 void YM2203::fm_key_on(int fm_ich) {
     assert(0 <= fm_ich && fm_ich < FM_CH_NUM);
     if (m_fm_timbres[fm_ich] == NULL) {
@@ -201,11 +261,53 @@ void YM2203::ssg_set_tone_or_noise(int ssg_ich, int mode) {
     }
 }
 
+// Writes a register of a timbre unless the shadow register already holds
+// the value. Unlike write_reg, the write hook does not see a dropped write.
+void YM2203::fm_upload_reg(uint32_t addr, uint32_t data) {
+    if (!m_fm_no_skip && m_shadow_regs[addr] == data)
+        return;
+    write_reg(addr, data);
+}
+
+static bool fm_same_timbre(const YM2203_Timbre& t1, const YM2203_Timbre& t2) {
+    for (int op = OPERATOR_1; op <= OPERATOR_4; ++op) {
+        if (t1.ar[op] != t2.ar[op] || t1.dr[op] != t2.dr[op] ||
+            t1.sr[op] != t2.sr[op] || t1.rr[op] != t2.rr[op] ||
+            t1.sl[op] != t2.sl[op] || t1.tl[op] != t2.tl[op] ||
+            t1.keyScale[op] != t2.keyScale[op] ||
+            t1.multiple[op] != t2.multiple[op] ||
+            t1.detune[op] != t2.detune[op] || t1.ams[op] != t2.ams[op])
+        {
+            return false;
+        }
+    }
+    return t1.algorithm == t2.algorithm && t1.feedback == t2.feedback &&
+           t1.opMask == t2.opMask && t1.waveForm == t2.waveForm &&
+           t1.sync == t2.sync && t1.speed == t2.speed &&
+           t1.pmd == t2.pmd && t1.amd == t2.amd && t1.pms == t2.pms;
+}
+
+// Only the registers that differ from the chip are written. If the timbre
+// loaded on the channel is selected again, the carriers keep the TL that
+// fm_set_volume gave them, and neither the feedback nor the LFO phase is
+// reset, so nothing is written unless a register was changed directly.
 void YM2203::fm_set_timbre(int fm_ich, YM2203_Timbre *timbre) {
     assert(0 <= fm_ich && fm_ich < FM_CH_NUM);
 
     static const uint8_t OP_OFFSET[] = {0x00, 0x08, 0x04, 0x0C};
 
+    bool same = ((m_fm_timbre_cached & (1 << fm_ich)) &&
+                 fm_same_timbre(*timbre, m_fm_timbre_data[fm_ich]));
+
+    // carriers, as fm_set_volume chooses them
+    uint8_t carriers = (1 << OPERATOR_4);
+    if (timbre->algorithm >= ALGORITHM_4)
+        carriers |= (1 << OPERATOR_2);
+    if (timbre->algorithm >= ALGORITHM_5)
+        carriers |= (1 << OPERATOR_3);
+    if (timbre->algorithm == ALGORITHM_7)
+        carriers |= (1 << OPERATOR_1);
+
     uint32_t addr, data;
     for (int op = OPERATOR_1; op <= OPERATOR_4; ++op) {
         uint8_t tl = timbre->tl[op];
@@ -227,43 +329,109 @@ void YM2203::fm_set_timbre(int fm_ich, YM2203_Timbre *timbre) {
 
         addr = ADDR_FM_DETUNE_MULTI + offset;
         data = ((detune & 0x07) << 4) | (multiple & 0x0F);
-        write_reg(addr, data);
+        fm_upload_reg(addr, data);
 
-        addr = ADDR_FM_TL + offset;
-        data = (tl & 0x7F);
-        write_reg(addr, data);
+        if (!same || !(carriers & (1 << op))) {
+            addr = ADDR_FM_TL + offset;
+            data = (tl & 0x7F);
+            fm_upload_reg(addr, data);
+        }
 
         addr = ADDR_FM_AR_KEYSCALE + offset;
         data = (((keyScale & 0x03) << 6) | (ar & 0x1F));
-        write_reg(addr, data);
+        fm_upload_reg(addr, data);
 
         addr = ADDR_FM_DR + offset;
         data = (dr & 0x1F);
-        write_reg(addr,data);
+        fm_upload_reg(addr,data);
 
         addr = ADDR_FM_SR + offset;
         data = (sr & 0x1F);
-        write_reg(addr, data);
+        fm_upload_reg(addr, data);
 
         addr = ADDR_FM_SL_RR + offset;
         data = (((sl & 0x0F) << 4) | (rr & 0x0F));
-        write_reg(addr, data);
+        fm_upload_reg(addr, data);
     }
 
+    // A new timbre always writes FB/ALGORITHM, which resets the feedback.
     addr = ADDR_FM_FB_ALGORITHM + fm_ich;
     data = (((timbre->feedback & 0x07) << 3) | (timbre->algorithm & 0x07));
-    write_reg(addr, data);
+    if (same)
+        fm_upload_reg(addr, data);
+    else
+        write_reg(addr, data);
+
+    if (same)
+        return;
 
-    // TODO: LFO
-    //addr = ADDR_FM_LFO_ON_SPEED;
-    //data = ...
-    //write_reg(addr, data);
-    //
-    //addr = ADDR_FM_LR_AMS_PMS;
-    //data = ...;
-    //write_reg(addr, data);
+    // LFO: the YM2203 has no hardware LFO, so the chip applies the timbre's
+    // LFO to every sample by itself without register writes. One cycle takes
+    // 900/speed seconds. The pitch swings by pmd*pms/2 F-Number units and the
+    // carriers' TL by amd*ams/2.
+    int am[OPERATOR_NUM] = {0, 0, 0, 0};
+    for (int op = OPERATOR_1; op <= OPERATOR_4; ++op) {
+        if (carriers & (1 << op))
+            am[op] = timbre->amd * timbre->ams[op] * 128;
+    }
+    int pm = timbre->pmd * timbre->pms * 128;
+    uint32_t freq = (uint32_t(timbre->speed) << 16) / 900;
+    m_opna.SetSoftLFO(fm_ich, timbre->waveForm, !!timbre->sync, freq, pm, am);
 
-    m_fm_timbres[fm_ich] = timbre;
+    m_fm_timbre_data[fm_ich] = *timbre;
+    m_fm_timbres[fm_ich] = &m_fm_timbre_data[fm_ich];
+    m_fm_timbre_cached |= (1 << fm_ich);
 } // YM2203::fm_set_timbre
 
+void YM2203::snapshot(YM2203_Snapshot& snap) {
+    snap.version = YM2203_SNAPSHOT_VERSION;
+    snap.size = sizeof(YM2203_Snapshot);
+    m_opna.DataSave(&snap.opna);
+    snap.fm_timbre_mask = 0;
+    for (int ich = 0; ich < FM_CH_NUM; ++ich) {
+        if (m_fm_timbres[ich]) {
+            snap.fm_timbres[ich] = *m_fm_timbres[ich];
+            snap.fm_timbre_mask |= (1 << ich);
+        }
+        snap.fm_volumes[ich] = m_fm_volumes[ich];
+    }
+    for (int ich = 0; ich < SSG_CH_NUM; ++ich) {
+        snap.ssg_enveloped[ich] = m_ssg_enveloped[ich];
+        snap.ssg_tone_noise[ich] = m_ssg_tone_noise[ich];
+    }
+    snap.ssg_key_on = m_ssg_key_on;
+    snap.ssg_envelope_type = m_ssg_envelope_type;
+    memcpy(snap.shadow_regs, m_shadow_regs, sizeof(m_shadow_regs));
+    memcpy(snap.fm_fnums, m_fm_fnums, sizeof(m_fm_fnums));
+    snap.fm_no_skip = m_fm_no_skip;
+} // YM2203::snapshot
+
+bool YM2203::restore(const YM2203_Snapshot& snap) {
+    if (snap.version != YM2203_SNAPSHOT_VERSION || snap.size != sizeof(YM2203_Snapshot))
+        return false;
+    if (!m_opna.DataLoad(&snap.opna))
+        return false;
+
+    for (int ich = 0; ich < FM_CH_NUM; ++ich) {
+        if (snap.fm_timbre_mask & (1 << ich)) {
+            m_fm_timbre_data[ich] = snap.fm_timbres[ich];
+            m_fm_timbres[ich] = &m_fm_timbre_data[ich];
+        } else {
+            m_fm_timbres[ich] = NULL;
+        }
+        m_fm_volumes[ich] = snap.fm_volumes[ich];
+    }
+    for (int ich = 0; ich < SSG_CH_NUM; ++ich) {
+        m_ssg_enveloped[ich] = !!snap.ssg_enveloped[ich];
+        m_ssg_tone_noise[ich] = snap.ssg_tone_noise[ich];
+    }
+    m_ssg_key_on = snap.ssg_key_on;
+    m_ssg_envelope_type = snap.ssg_envelope_type;
+    memcpy(m_shadow_regs, snap.shadow_regs, sizeof(m_shadow_regs));
+    memcpy(m_fm_fnums, snap.fm_fnums, sizeof(m_fm_fnums));
+    m_fm_no_skip = !!snap.fm_no_skip;
+    m_fm_timbre_cached = snap.fm_timbre_mask;
+    return true;
+} // YM2203::restore
+
 //////////////////////////////////////////////////////////////////////////////
@@ -65,6 +65,33 @@
 #define ADDR_FM_FB_ALGORITHM    0xB0
 #define ADDR_FM_LR_AMS_PMS      0xB4
 
+//////////////////////////////////////////////////////////////////////////////
+// YM2203 snapshot
+//
+// A snapshot holds every bit of state needed to continue the emulation
+// bit-exactly. It is only valid for a YM2203 initialized with the same
+// clock and rate. The rhythm samples and the ADPCM RAM are not included.
+
+#define YM2203_SNAPSHOT_VERSION 4
+
+#define YM2203_REG_UNKNOWN      0xFFFF  // shadow register: value is unknown
+
+struct YM2203_Snapshot {
+    uint32_t        version;                    // YM2203_SNAPSHOT_VERSION
+    uint32_t        size;                       // sizeof(YM2203_Snapshot)
+    FM::OPNAData    opna;
+    YM2203_Timbre   fm_timbres[FM_CH_NUM];
+    uint8_t         fm_timbre_mask;             // bit ich: has timbre
+    uint8_t         fm_volumes[FM_CH_NUM];
+    uint8_t         ssg_enveloped[SSG_CH_NUM];
+    uint8_t         ssg_tone_noise[SSG_CH_NUM];
+    uint8_t         ssg_key_on;
+    uint8_t         ssg_envelope_type;
+    uint16_t        shadow_regs[0x100];
+    uint16_t        fm_fnums[FM_CH_NUM];
+    uint8_t         fm_no_skip;
+};
+
 //////////////////////////////////////////////////////////////////////////////
 // YM2203
 
@@ -83,6 +110,11 @@ struct YM2203 {
         fm_set_volume(fm_ich, volume, adj);
     }
     void fm_set_timbre(int fm_ich, YM2203_Timbre *timbre);
+    // Whether the chip applies a timbre LFO to the channel by itself.
+    // The LFO has no registers, so register logs cannot reproduce it.
+    bool fm_has_lfo(int fm_ich) {
+        return m_opna.HasSoftLFO(fm_ich);
+    }
 
     void ssg_key_on(int ssg_ich);
     void ssg_key_off(int ssg_ich);
@@ -91,12 +123,23 @@ struct YM2203 {
     void ssg_set_envelope(int ssg_ich, int type, uint16_t interval);
     void ssg_set_tone_or_noise(int ssg_ich, int mode);
 
+    // In mono mode, mix writes one value (the average of L and R) per sample.
+    void set_mono(bool mono) {
+        m_opna.SetMono(mono);
+    }
+    bool is_mono() {
+        return m_opna.IsMono();
+    }
+
     bool load_rhythm_data(const char *path) {
         return m_opna.LoadRhythmSample(path);
     }
     void mix(FM_SAMPLETYPE *dest, int nsamples) {
         m_opna.Mix(dest, nsamples);
     }
+    bool skip(int nsamples) {
+        return m_opna.Skip(nsamples);
+    }
     bool count(uint32_t microsec) {
         return m_opna.Count(microsec);
     }
@@ -105,20 +148,66 @@ struct YM2203 {
     }
     void reset() {
         m_opna.Reset();
+        reset_shadow();
     }
 
+    // Writes that change nothing are dropped (see is_redundant_write).
+    // The write hook still sees every write.
     void write_reg(uint32_t addr, uint32_t data) {
+        ++m_num_reg_writes;
+        if (m_write_hook)
+            (*m_write_hook)(m_write_hook_user, addr, data);
+        if (is_redundant_write(addr, data)) {
+            ++m_num_reg_skips;
+            return;
+        }
         m_opna.SetReg(addr, data);
     }
 
+    // register write hook (for recording)
+    typedef void (*WRITE_HOOK)(void *user, uint32_t addr, uint32_t data);
+    void set_write_hook(WRITE_HOOK hook, void *user) {
+        m_write_hook = hook;
+        m_write_hook_user = user;
+    }
+
+    // statistics
+    uint32_t get_num_reg_writes() const {
+        return m_num_reg_writes;
+    }
+    uint32_t get_num_reg_skips() const {
+        return m_num_reg_skips;
+    }
+    uint32_t get_num_prepares() {
+        return m_opna.GetNumPrepares();
+    }
+
+    void snapshot(YM2203_Snapshot& snap);
+    bool restore(const YM2203_Snapshot& snap);
+
 protected:
     FM::OPNA        m_opna;
     YM2203_Timbre * m_fm_timbres[FM_CH_NUM];
+    YM2203_Timbre   m_fm_timbre_data[FM_CH_NUM];
     uint8_t         m_fm_volumes[FM_CH_NUM];
     bool            m_ssg_enveloped[SSG_CH_NUM];
     uint8_t         m_ssg_tone_noise[SSG_CH_NUM];
     uint8_t         m_ssg_key_on;
     uint8_t         m_ssg_envelope_type;
+    uint32_t        m_num_reg_writes;
+    uint32_t        m_num_reg_skips;
+    WRITE_HOOK      m_write_hook;
+    void *          m_write_hook_user;
+
+    // shadow registers (port 0) to drop redundant writes
+    uint16_t        m_shadow_regs[0x100];       // YM2203_REG_UNKNOWN if unknown
+    uint16_t        m_fm_fnums[FM_CH_NUM];      // F-Number in effect (A4 latch + A0)
+    bool            m_fm_no_skip;               // SSG-EG or CSM has been used
+    uint8_t         m_fm_timbre_cached;         // bit ich: the chip holds m_fm_timbre_data[ich]
+
+    void reset_shadow();
+    bool is_redundant_write(uint32_t addr, uint32_t data);
+    void fm_upload_reg(uint32_t addr, uint32_t data);
 
     static const uint16_t FM_PITCH_TABLE[KEY_NUM];
     static const uint16_t SSG_PITCH_TABLE[KEY_NUM];
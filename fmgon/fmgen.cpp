@@ -274,9 +274,17 @@ FM::Operator::Operator() : chip_(0) {
     multiple_ = 0;
     detune_ = 0;
     detune2_ = 0;
+    block_ = 0;
+    pg_unit_ = 0;
 
     // LFO
     ms_ = 0;
+    slfo_pg_ = 0;
+    slfo_eg_ = 0;
+
+    param_dirty_ = 0;
+    ssg_changed_ = false;
+    num_prepares_ = 0;
 
 //  Reset();
 }
@@ -337,17 +345,47 @@ void Operator::MakeTable() {
 }
 
 inline void FM::Operator::SetDPBN(uint32_t dp, uint32_t bn) {
-    dp_ = dp, bn_ = bn; param_changed_ = true;
+    dp_ = dp, bn_ = bn, block_ = 0; param_dirty_ |= PARAM_PG;
     PARAMCHANGE(1);
 }
 
 //  準備
 void Operator::Prepare() {
+    //  TL や F-Number だけが変わったときは、EG のレートや SSG-EG を再計算しない.
+    //  SSG-EG を使っていると再計算で位相が戻るので、そのときはすべて再計算する
+    if (param_dirty_ && !param_changed_) {
+        if (ssg_type_ || ssg_changed_) {
+            param_changed_ = true;
+        } else {
+            if (param_dirty_ & PARAM_PG) {
+                pg_diff_ = (dp_ + dttable[detune_ + bn_]) * chip_->GetMulValue(detune2_, multiple_);
+                pg_diff_lfo_ = pg_diff_ >> 11;
+                pg_diff_ += slfo_pg_;
+                pg_unit_ = chip_->GetMulValue(detune2_, multiple_) << block_;
+                // キースケールが変わると EG のレートも変わる
+                if (key_scale_rate_ != (bn_ >> (3-ks_)))
+                    param_changed_ = true;
+            }
+            if (!param_changed_) {
+                param_dirty_ = 0;
+                tl_out_ = mute_ ? 0x3ff : tl_ * 8;
+                EGUpdate();
+                dbgopout_ = 0;
+                return;
+            }
+        }
+    }
+
     if (param_changed_) {
         param_changed_ = false;
+        param_dirty_ = 0;
+        ssg_changed_ = false;
+        num_prepares_++;
         //  PG Part
         pg_diff_ = (dp_ + dttable[detune_ + bn_]) * chip_->GetMulValue(detune2_, multiple_);
         pg_diff_lfo_ = pg_diff_ >> 11;
+        pg_diff_ += slfo_pg_;
+        pg_unit_ = chip_->GetMulValue(detune2_, multiple_) << block_;
 
         // EG Part
         key_scale_rate_ = bn_ >> (3-ks_);
@@ -466,9 +504,10 @@ void Operator::ShiftPhase(EGPhase nextphase) {
 
 //  Block/F-Num
 void Operator::SetFNum(uint32_t f) {
-    dp_ = (f & 2047) << ((f >> 11) & 7);
+    block_ = (f >> 11) & 7;
+    dp_ = (f & 2047) << block_;
     bn_ = notetable[(f >> 7) & 127];
-    param_changed_ = true;
+    param_dirty_ |= PARAM_PG;
     PARAMCHANGE(2);
 }
 
@@ -498,6 +537,8 @@ inline void Operator::EGUpdate() {
     {
         eg_out_ = Min(tl_out_ + eg_level_ * ssg_vector_ + ssg_offset_, 0x3ff) << (1 + 2);
     }
+    if (slfo_eg_)
+        eg_out_ = Limit(eg_out_ - slfo_eg_, 0x3ff << (1 + 2), 0);
 }
 
 inline void Operator::SetEGRate(uint32_t rate) {
@@ -656,6 +697,17 @@ inline FM::ISample FM::Operator::CalcFBL(uint32_t fb) {
     return out_;
 }
 
+//  ソフトウェア LFO の変調を設定する
+//  Phase 差分値と EG の出力に含めておくので、Calc はそのまま使える
+void FM::Operator::SetSoftLFO(int32_t pg, int32_t eg) {
+    pg_diff_ += pg - slfo_pg_;
+    slfo_pg_ = pg;
+    if (slfo_eg_ != eg) {
+        slfo_eg_ = eg;
+        EGUpdate();
+    }
+}
+
 #undef Sine
 
 // ---------------------------------------------------------------------------
@@ -673,6 +725,9 @@ Channel4::Channel4() {
 
     SetAlgorithm(0);
     pms = pmtable[0][0];
+
+    slfo_rand_ = 0x92d68ca2;
+    ResetSoftLFO();
 }
 
 void Channel4::MakeTable() {
@@ -688,6 +743,8 @@ void Channel4::Reset() {
     op[1].Reset();
     op[2].Reset();
     op[3].Reset();
+
+    ResetSoftLFO();
 }
 
 //  Calc の用意
@@ -737,12 +794,113 @@ void Channel4::SetKCKF(uint32_t kc, uint32_t kf) {
 
 //  キー制御
 void Channel4::KeyControl(uint32_t key) {
+    //  どの OP も鳴っていなければ、キーオンでソフトウェア LFO の位相を戻す
+    if (slfo_sync_ && (key & 0xf) &&
+        !(op[0].keyon_ || op[1].keyon_ || op[2].keyon_ || op[3].keyon_))
+        slfo_count_ = 0;
+
     if (key & 0x1) op[0].KeyOn(); else op[0].KeyOff();
     if (key & 0x2) op[1].KeyOn(); else op[1].KeyOff();
     if (key & 0x4) op[2].KeyOn(); else op[2].KeyOff();
     if (key & 0x8) op[3].KeyOn(); else op[3].KeyOff();
 }
 
+// ---------------------------------------------------------------------------
+//  ソフトウェア LFO
+//
+//  音色の LFO を、レジスタを書き換えずに PG と EG へかける. 変調は
+//  FM_SLFOBLOCK サンプルごとに、その区間の中央の位相で求める.
+//  波形は ±4096 を振幅とし、のこぎり波は前半で 0 から +4096 へ、後半で
+//  -4096 から 0 へ上がる. 矩形波は前半が +4096、後半が -4096.
+//  サンプル&ホールドは位相 0 と半周期で乱数から値を決める.
+
+//  止める
+void Channel4::ResetSoftLFO() {
+    slfo_count_ = 0;
+    slfo_dcount_ = 0;
+    slfo_wave_ = 0;
+    slfo_sync_ = false;
+    slfo_hold_ = 0;
+    slfo_pm_ = 0;
+    for (int i = 0; i < 4; i++) {
+        slfo_am_[i] = 0;
+        op[i].SetSoftLFO(0, 0);
+    }
+}
+
+//  サンプル&ホールドの次の値 (-4096～4095)
+int32_t Channel4::NextSoftLFOHold() {
+    slfo_rand_ ^= slfo_rand_ << 13;
+    slfo_rand_ ^= slfo_rand_ >> 17;
+    slfo_rand_ ^= slfo_rand_ << 5;
+    return int32_t(slfo_rand_ >> 19) - 4096;
+}
+
+//  設定して位相を戻す
+//  wave:   波形 (0-3)
+//  sync:   キーオンで位相を戻すか
+//  dcount: 1 サンプルあたりの位相の増分 (2^32 で 1 周期). 0 なら止める
+//  pm:     F-Number の変化幅 (1/256 単位)
+//  am:     各 OP の TL の変化幅 (1/256 単位). 正なら音量が上がる
+void Channel4::SetSoftLFO(uint32_t wave, bool sync, uint32_t dcount, int pm, const int am[4]) {
+    ResetSoftLFO();
+    if (!dcount)
+        return;
+
+    slfo_wave_ = wave & 3;
+    slfo_sync_ = sync;
+    slfo_pm_ = Limit(pm, (1 << 19) - 1, -((1 << 19) - 1));
+    bool any = (slfo_pm_ != 0);
+    for (int i = 0; i < 4; i++) {
+        // TL の 1 は eg_out_ の 64
+        slfo_am_[i] = Limit(am[i] >> 2, 0x3ff << (1 + 2), -(0x3ff << (1 + 2)));
+        any = any || (slfo_am_[i] != 0);
+    }
+    if (any)
+        slfo_dcount_ = dcount;
+}
+
+//  次の FM_SLFOBLOCK サンプルの変調を各 OP に設定し、位相を進める.
+//  apply が false なら (ハードウェアの LFO を使っているとき) 位相だけ進める
+void Channel4::SoftLFO(bool apply) {
+    uint32_t c = slfo_count_;
+    uint32_t d = slfo_dcount_;
+    uint32_t m = c + d * (FM_SLFOBLOCK / 2);
+    int32_t w;
+
+    switch (slfo_wave_) {
+    case 0:     // のこぎり波
+        w = int32_t(m) >> 19;
+        break;
+    case 1:     // 矩形波
+        w = 4096 - int32_t((m >> 31) << 13);
+        break;
+    case 2:     // 三角波
+        {
+            int32_t x = int32_t(m - 0x40000000);
+            int32_t s = x >> 31;
+            w = int32_t(0x40000000 - (uint32_t(x ^ s) - uint32_t(s))) >> 18;
+        }
+        break;
+    default:    // サンプル&ホールド (区間に位相 0 か半周期を含めば値を変える)
+        if (((c - d) ^ (c + d * (FM_SLFOBLOCK - 1))) & 0x80000000)
+            slfo_hold_ = NextSoftLFOHold();
+        w = slfo_hold_;
+        break;
+    }
+    slfo_count_ = c + d * FM_SLFOBLOCK;
+    if (!apply)
+        w = 0;
+
+    //  PM は F-Number の変化を Phase 差分値に直す. 桁が大きいので float で掛ける.
+    //  AM は減衰量から引く. 変化幅が 0 のものは SetSoftLFO で 0 にしてある
+    for (int j = 0; j < 4; j++) {
+        Operator& o = op[j];
+        int32_t pg = int32_t(float(w) * float(o.pg_unit_) * float(slfo_pm_) * (1.f / (4096 * 256)));
+        o.SetSoftLFO(pg, (slfo_am_[j] * w) >> 12);
+    }
+}
+
 //  アルゴリズムを設定
 void Channel4::SetAlgorithm(uint32_t algo) {
     static const uint8_t table1[8][6] = {
@@ -908,4 +1066,165 @@ ISample Channel4::CalcLN(uint32_t noise) {
     return *out[2] + o;
 }
 
+// ---------------------------------------------------------------------------
+//  状態の保存と復元
+//
+void Operator::DataSave(OperatorData* data) {
+    data->out = out_;
+    data->out2 = out2_;
+    data->in2 = in2_;
+    data->dp = dp_;
+    data->detune = detune_;
+    data->detune2 = detune2_;
+    data->multiple = multiple_;
+    data->pg_count = pg_count_;
+    data->pg_diff = pg_diff_;
+    data->pg_diff_lfo = pg_diff_lfo_;
+    data->bn = bn_;
+    data->eg_level = eg_level_;
+    data->eg_level_on_next_phase = eg_level_on_next_phase_;
+    data->eg_count = eg_count_;
+    data->eg_count_diff = eg_count_diff_;
+    data->eg_out = eg_out_;
+    data->tl_out = tl_out_;
+    data->eg_rate = eg_rate_;
+    data->eg_curve_count = eg_curve_count_;
+    data->ssg_offset = ssg_offset_;
+    data->ssg_vector = ssg_vector_;
+    data->ssg_phase = ssg_phase_;
+    data->key_scale_rate = key_scale_rate_;
+    data->ms = ms_;
+    data->tl = tl_;
+    data->tl_latch = tl_latch_;
+    data->ar = ar_;
+    data->dr = dr_;
+    data->sr = sr_;
+    data->sl = sl_;
+    data->rr = rr_;
+    data->ks = ks_;
+    data->ssg_type = ssg_type_;
+    data->ams = uint16_t((ams_ - amtable[0][0]) / FM_LFOENTS);
+    data->type = uint8_t(type_);
+    data->eg_phase = uint8_t(eg_phase_);
+    data->keyon = keyon_;
+    data->amon = amon_;
+    data->param_changed = uint8_t((param_changed_ ? 1 : 0) | (param_dirty_ << 1) | (ssg_changed_ ? 8 : 0));
+    data->mute = mute_;
+    data->block = uint8_t(block_);
+    data->pg_unit = pg_unit_;
+    data->slfo_pg = slfo_pg_;
+    data->slfo_eg = slfo_eg_;
+}
+
+void Operator::DataLoad(const OperatorData* data) {
+    out_ = data->out;
+    out2_ = data->out2;
+    in2_ = data->in2;
+    dp_ = data->dp;
+    detune_ = data->detune;
+    detune2_ = data->detune2;
+    multiple_ = data->multiple;
+    pg_count_ = data->pg_count;
+    pg_diff_ = data->pg_diff;
+    pg_diff_lfo_ = data->pg_diff_lfo;
+    bn_ = data->bn;
+    eg_level_ = data->eg_level;
+    eg_level_on_next_phase_ = data->eg_level_on_next_phase;
+    eg_count_ = data->eg_count;
+    eg_count_diff_ = data->eg_count_diff;
+    eg_out_ = data->eg_out;
+    tl_out_ = data->tl_out;
+    eg_rate_ = data->eg_rate;
+    eg_curve_count_ = data->eg_curve_count;
+    ssg_offset_ = data->ssg_offset;
+    ssg_vector_ = data->ssg_vector;
+    ssg_phase_ = data->ssg_phase;
+    key_scale_rate_ = data->key_scale_rate;
+    ms_ = data->ms;
+    tl_ = data->tl;
+    tl_latch_ = data->tl_latch;
+    ar_ = data->ar;
+    dr_ = data->dr;
+    sr_ = data->sr;
+    sl_ = data->sl;
+    rr_ = data->rr;
+    ks_ = data->ks;
+    ssg_type_ = data->ssg_type;
+    ams_ = amtable[0][0] + data->ams * FM_LFOENTS;
+    type_ = OpType(data->type);
+    eg_phase_ = EGPhase(data->eg_phase);
+    keyon_ = !!data->keyon;
+    amon_ = !!data->amon;
+    param_changed_ = !!(data->param_changed & 1);
+    param_dirty_ = uint8_t((data->param_changed >> 1) & (PARAM_TL | PARAM_PG));
+    ssg_changed_ = !!(data->param_changed & 8);
+    mute_ = !!data->mute;
+    block_ = data->block & 7;
+    pg_unit_ = data->pg_unit;
+    slfo_pg_ = data->slfo_pg;
+    slfo_eg_ = data->slfo_eg;
+}
+
+void Channel4::DataSave(Channel4Data* data) {
+    data->fb = fb;
+    for (int i = 0; i < 4; i++)
+        data->buf[i] = buf[i];
+    for (int i = 0; i < 3; i++) {
+        data->in[i] = uint8_t(in[i] - buf);
+        data->out[i] = uint8_t(out[i] - buf);
+    }
+    data->pms = uint16_t((pms - pmtable[0][0]) / FM_LFOENTS);
+    data->algo = algo_;
+    data->slfo_count = slfo_count_;
+    data->slfo_dcount = slfo_dcount_;
+    data->slfo_hold = slfo_hold_;
+    data->slfo_pm = slfo_pm_;
+    for (int i = 0; i < 4; i++)
+        data->slfo_am[i] = slfo_am_[i];
+    data->slfo_rand = slfo_rand_;
+    data->slfo_wave = uint8_t(slfo_wave_);
+    data->slfo_sync = slfo_sync_;
+    for (int i = 0; i < 4; i++)
+        op[i].DataSave(&data->op[i]);
+}
+
+void Channel4::DataLoad(const Channel4Data* data) {
+    fb = data->fb;
+    for (int i = 0; i < 4; i++)
+        buf[i] = data->buf[i];
+    for (int i = 0; i < 3; i++) {
+        in[i] = &buf[data->in[i] & 3];
+        out[i] = &buf[data->out[i] & 3];
+    }
+    pms = pmtable[0][0] + data->pms * FM_LFOENTS;
+    algo_ = data->algo;
+    slfo_count_ = data->slfo_count;
+    slfo_dcount_ = data->slfo_dcount;
+    slfo_hold_ = data->slfo_hold;
+    slfo_pm_ = data->slfo_pm;
+    for (int i = 0; i < 4; i++)
+        slfo_am_[i] = data->slfo_am[i];
+    slfo_rand_ = data->slfo_rand;
+    slfo_wave_ = data->slfo_wave & 3;
+    slfo_sync_ = !!data->slfo_sync;
+    for (int i = 0; i < 4; i++)
+        op[i].DataLoad(&data->op[i]);
+}
+
+void Chip::DataSave(ChipData* data) {
+    data->ratio = ratio_;
+    data->aml = aml_;
+    data->pml = pml_;
+    data->pmv = pmv_;
+    data->optype = uint8_t(optype_);
+}
+
+void Chip::DataLoad(const ChipData* data) {
+    SetRatio(data->ratio);
+    aml_ = data->aml;
+    pml_ = data->pml;
+    pmv_ = data->pmv;
+    optype_ = OpType(data->optype);
+}
+
 } // namespace FM
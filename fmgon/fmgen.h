@@ -11,8 +11,13 @@
 
 // ---------------------------------------------------------------------------
 //  出力サンプルの型
+//  FMGON_INT32_SAMPLE を定義すると 32 bit で出力し、飽和は呼び出し側で行う
 //
-#define FM_SAMPLETYPE   int16_t             // int16_t or int32_t
+#ifdef FMGON_INT32_SAMPLE
+    #define FM_SAMPLETYPE   int32_t
+#else
+    #define FM_SAMPLETYPE   int16_t         // int16_t or int32_t
+#endif
 
 // ---------------------------------------------------------------------------
 //  定数その１
@@ -30,6 +35,9 @@
 //  サイン波の精度は 2^(1/256)
 #define FM_CLENTS       (0x1000 * 2)    // sin + TL + LFO
 
+//  ソフトウェア LFO の変調を更新する間隔 (サンプル数, 2 のべき乗)
+#define FM_SLFOBLOCK    32
+
 // ---------------------------------------------------------------------------
 
 namespace FM {
@@ -43,6 +51,52 @@ namespace FM {
 
     class Chip;
 
+    //  状態保存用のデータ ---------------------------------------------------
+    //  ポインタはテーブル内の位置として保存する
+    struct OperatorData {
+        ISample     out, out2, in2;
+        uint32_t    dp, detune, detune2, multiple;
+        uint32_t    pg_count, pg_diff;
+        int32_t     pg_diff_lfo;
+        uint32_t    bn;
+        int32_t     eg_level, eg_level_on_next_phase;
+        int32_t     eg_count, eg_count_diff;
+        int32_t     eg_out, tl_out, eg_rate, eg_curve_count;
+        int32_t     ssg_offset, ssg_vector, ssg_phase;
+        uint32_t    key_scale_rate;
+        uint32_t    ms;
+        uint32_t    tl, tl_latch, ar, dr, sr, sl, rr, ks, ssg_type;
+        uint16_t    ams;            // amtable 内の位置
+        uint8_t     type;
+        uint8_t     eg_phase;
+        uint8_t     keyon, amon, param_changed, mute;  // param_changed: PARAM_* のビット
+        uint8_t     block;
+        uint32_t    pg_unit;
+        int32_t     slfo_pg, slfo_eg;
+    };
+
+    struct Channel4Data {
+        uint32_t    fb;
+        int32_t     buf[4];
+        uint8_t     in[3];          // buf 内の位置
+        uint8_t     out[3];         // buf 内の位置
+        uint16_t    pms;            // pmtable 内の位置
+        int32_t     algo;
+        uint32_t    slfo_count, slfo_dcount;
+        int32_t     slfo_hold, slfo_pm, slfo_am[4];
+        uint32_t    slfo_rand;
+        uint8_t     slfo_wave, slfo_sync;
+        OperatorData op[4];
+    };
+
+    struct ChipData {
+        uint32_t    ratio;
+        uint32_t    aml;
+        uint32_t    pml;
+        int32_t     pmv;
+        uint8_t     optype;
+    };
+
     //  Operator -------------------------------------------------------------
     class Operator
     {
@@ -82,10 +136,14 @@ namespace FM {
         void    SetMS(uint32_t ms);
         void    Mute(bool);
 
+        void    DataSave(OperatorData* data);
+        void    DataLoad(const OperatorData* data);
+
 //      static void SetAML(uint32_t l);
 //      static void SetPML(uint32_t l);
 
         int     Out() { return out_; }
+        uint32_t GetNumPrepares() { return num_prepares_; }
 
         int     dbgGetIn2() { return in2_; }
         void    dbgStopPG() { pg_diff_ = 0; pg_diff_lfo_ = 0; }
@@ -100,6 +158,7 @@ namespace FM {
     //  Phase Generator ------------------------------------------------------
         uint32_t    PGCalc();
         uint32_t    PGCalcL();
+        void        SetSoftLFO(int32_t pg, int32_t eg);
 
         uint32_t    dp_;            // ΔP
         uint32_t    detune_;        // Detune
@@ -108,6 +167,10 @@ namespace FM {
         uint32_t    pg_count_;      // Phase 現在値
         uint32_t    pg_diff_;       // Phase 差分値
         int32_t     pg_diff_lfo_;   // Phase 差分値 >> x
+        uint32_t    block_;         // Block
+        uint32_t    pg_unit_;       // F-Number 1 あたりの Phase 差分値
+        int32_t     slfo_pg_;       // ソフトウェア LFO による Phase 差分値 (pg_diff_ に含む)
+        int32_t     slfo_eg_;       // ソフトウェア LFO による減衰量の変化 (eg_out_ に含む)
 
     //  Envelop Generator ---------------------------------------------------
         enum    EGPhase { next, attack, decay, sustain, release, off };
@@ -154,8 +217,17 @@ namespace FM {
 
         bool        keyon_;
         bool        amon_;          // enable Amplitude Modulation
-        bool        param_changed_; // パラメータが更新された
+        bool        param_changed_; // パラメータが更新された (すべて再計算)
         bool        mute_;
+        uint8_t     param_dirty_;   // 部分的に更新されたパラメータ (PARAM_TL, PARAM_PG)
+        bool        ssg_changed_;   // SSG-EG の種類が変わった
+        uint32_t    num_prepares_;  // パラメータをすべて再計算した回数
+
+        //  param_dirty_ のビット. TL や F-Number だけの変更は EG のレートを再計算しない
+        enum {
+            PARAM_TL = 1,           // TL, mute
+            PARAM_PG = 2,           // F-Number, DT, DT2, MULTI
+        };
 
     //  Tables ---------------------------------------------------------------
         static Counter          rate_table[16];
@@ -206,6 +278,13 @@ namespace FM {
         void        Mute(bool);
         void        Refresh();
 
+        void        SetSoftLFO(uint32_t wave, bool sync, uint32_t dcount, int pm, const int am[4]);
+        bool        HasSoftLFO() { return slfo_dcount_ != 0; }
+        void        SoftLFO(bool apply);
+
+        void        DataSave(Channel4Data* data);
+        void        DataLoad(const Channel4Data* data);
+
         void dbgStopPG() {
             for (int i = 0; i < 4; i++)
                 op[i].dbgStopPG();
@@ -221,6 +300,19 @@ namespace FM {
         int     algo_;
         Chip*   chip_;
 
+        //  ソフトウェア LFO (音色の LFO をチップ内で FM_SLFOBLOCK サンプルごとにかける)
+        void    ResetSoftLFO();
+        int32_t NextSoftLFOHold();
+
+        uint32_t    slfo_count_;    // 位相 (2^32 で 1 周期)
+        uint32_t    slfo_dcount_;   // 1 サンプルあたりの位相の増分 (0 なら止まっている)
+        uint32_t    slfo_wave_;     // 0: のこぎり波, 1: 矩形波, 2: 三角波, 3: サンプル&ホールド
+        bool        slfo_sync_;     // キーオンで位相を戻す
+        int32_t     slfo_hold_;     // サンプル&ホールドの値
+        uint32_t    slfo_rand_;     // サンプル&ホールドの乱数 (xorshift)
+        int32_t     slfo_pm_;       // F-Number の変化幅 (1/256 単位)
+        int32_t     slfo_am_[4];    // 減衰量の変化幅 (eg_out_ の単位)
+
         static void MakeTable();
 
         static bool tablehasmade;
@@ -247,6 +339,9 @@ namespace FM {
         int         GetPMV() { return pmv_; }
         uint32_t    GetRatio() { return ratio_; }
 
+        void        DataSave(ChipData* data);
+        void        DataLoad(const ChipData* data);
+
     private:
         void    MakeTable();
 
@@ -74,26 +74,26 @@ inline int Operator::IsOn() {
 
 //  Detune (0-7)
 inline void Operator::SetDT(uint32_t dt) {
-    detune_ = dt * 0x20, param_changed_ = true;
+    detune_ = dt * 0x20, param_dirty_ |= PARAM_PG;
     PARAMCHANGE(4);
 }
 
 //  DT2 (0-3)
 inline void Operator::SetDT2(uint32_t dt2) {
-    detune2_ = dt2 & 3, param_changed_ = true;
+    detune2_ = dt2 & 3, param_dirty_ |= PARAM_PG;
     PARAMCHANGE(5);
 }
 
 //  Multiple (0-15)
 inline void Operator::SetMULTI(uint32_t mul)     {
-    multiple_ = mul, param_changed_ = true;
+    multiple_ = mul, param_dirty_ |= PARAM_PG;
     PARAMCHANGE(6);
 }
 
 //  Total Level (0-127) (0.75dB step)
 inline void Operator::SetTL(uint32_t tl, bool csm) {
     if (!csm) {
-        tl_ = tl, param_changed_ = true;
+        tl_ = tl, param_dirty_ |= PARAM_TL;
         PARAMCHANGE(7);
     }
     tl_latch_ = tl;
@@ -143,10 +143,10 @@ inline void Operator::SetKS(uint32_t ks) {
 
 //  SSG-type Envelop (0-15)
 inline void Operator::SetSSGEC(uint32_t ssgec) {
-    if (ssgec & 8)
-        ssg_type_ = ssgec;
-    else
-        ssg_type_ = 0;
+    uint32_t type = (ssgec & 8) ? ssgec : 0;
+    if (ssg_type_ != type)
+        ssg_changed_ = true;
+    ssg_type_ = type;
 }
 
 inline void Operator::SetAMON(bool amon) {
@@ -157,7 +157,7 @@ inline void Operator::SetAMON(bool amon) {
 
 inline void Operator::Mute(bool mute) {
     mute_ = mute;
-    param_changed_ = true;
+    param_dirty_ |= PARAM_TL;
     PARAMCHANGE(15);
 }
 
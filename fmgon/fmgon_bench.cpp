@@ -0,0 +1,83 @@
+//////////////////////////////////////////////////////////////////////////////
+// fmgon_bench.cpp --- benchmark of the snapshot of fmgon
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "fmgon.h"
+#include "YM2203.h"
+#include <chrono>
+
+#define CLOCK       8000000
+#define SAMPLERATE  44100
+#define NSAMPLES    4410
+#define NLOOPS      100000
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void setup(YM2203& ym, YM2203_Timbre& timbre) {
+    ym.init(CLOCK, SAMPLERATE, NULL);
+    ym.fm_set_timbre(0, &timbre);
+    ym.fm_set_volume(0, 15);
+    ym.fm_set_pitch(0, 4, KEY_A);
+    ym.fm_key_on(0);
+    ym.ssg_set_envelope(0, 8, 300);
+    ym.ssg_set_pitch(0, 4, KEY_E);
+    ym.ssg_set_tone_or_noise(1, NOISE_MODE);
+    ym.ssg_set_volume(1, 12);
+    ym.ssg_set_pitch(1, 3, KEY_C);
+    ym.ssg_key_on(0);
+    ym.ssg_key_on(1);
+}
+
+static void render(YM2203& ym, std::vector<FM_SAMPLETYPE>& buf) {
+    buf.assign(NSAMPLES * 2, 0);
+    ym.mix(buf.data(), NSAMPLES);
+}
+
+int main(void) {
+    YM2203_Timbre timbre(ym2203_tone_table[15]);
+
+    static YM2203 ym, ym2;
+    setup(ym, timbre);
+    ym2.init(CLOCK, SAMPLERATE, NULL);
+
+    // 途中まで演奏してからスナップショットを取る
+    std::vector<FM_SAMPLETYPE> buf0, buf1, buf2;
+    render(ym, buf0);
+
+    static YM2203_Snapshot snap;
+    ym.snapshot(snap);
+
+    // 続きを演奏する
+    render(ym, buf1);
+
+    // 別のチップで復元して続きを演奏する
+    if (!ym2.restore(snap)) {
+        printf("restore failed\n");
+        return 1;
+    }
+    render(ym2, buf2);
+
+    bool exact = (buf1 == buf2);
+    printf("snapshot size:  %u bytes\n", (unsigned)sizeof(YM2203_Snapshot));
+    printf("bit-exact:      %s\n", exact ? "yes" : "NO");
+
+    typedef std::chrono::high_resolution_clock clock_type;
+
+    auto t0 = clock_type::now();
+    for (int i = 0; i < NLOOPS; ++i)
+        ym.snapshot(snap);
+    auto t1 = clock_type::now();
+    for (int i = 0; i < NLOOPS; ++i)
+        ym2.restore(snap);
+    auto t2 = clock_type::now();
+
+    double ns_save = std::chrono::duration<double, std::nano>(t1 - t0).count() / NLOOPS;
+    double ns_load = std::chrono::duration<double, std::nano>(t2 - t1).count() / NLOOPS;
+    printf("snapshot:       %.1f ns\n", ns_save);
+    printf("restore:        %.1f ns\n", ns_load);
+
+    return exact ? 0 : 1;
+} // main
+
+//////////////////////////////////////////////////////////////////////////////
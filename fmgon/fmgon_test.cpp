@@ -5,13 +5,16 @@
 
 #include "fmgon.h"
 #include "soundplayer.h"
+#include "engine.h"
 
 //////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char *argv[]) {
-    //alutInit(NULL, NULL);
+    if (!vsk_sound_init(true))
+        return 1;
 
-    auto phrase = make_shared<VskPhrase>();
+    VskSoundSetting setting;
+    auto phrase = std::make_shared<VskPhrase>(setting);
 
     phrase->m_setting.m_fm = true;
     if (argc <= 1) {
@@ -102,10 +105,9 @@ int main(int argc, char *argv[]) {
     VskScoreBlock block;
     block.push_back(phrase);
 
-    VskSoundPlayer player;
-    player.play_and_wait(block);
+    vsk_default_engine().m_player->play_and_wait(block, -1, true);
 
-    //alutExit();
+    vsk_sound_exit();
 
     return 0;
 } // main
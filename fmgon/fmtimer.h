@@ -10,12 +10,24 @@
 // ---------------------------------------------------------------------------
 
 namespace FM {
+    struct TimerData {
+        uint8_t status;
+        uint8_t regtc;
+        uint8_t regta[2];
+        int32_t timera, timera_count;
+        int32_t timerb, timerb_count;
+        int32_t timer_step;
+    };
+
     class Timer {
     public:
         void    Reset();
         bool    Count(int32_t us);
         int32_t GetNextEvent();
 
+        void    DataSave(TimerData* data);
+        void    DataLoad(const TimerData* data);
+
     protected:
         virtual void SetStatus(uint32_t bit) = 0;
         virtual void ResetStatus(uint32_t bit) = 0;
@@ -149,6 +149,36 @@ void OPNBase::TimerA() {
     }
 }
 
+//  状態の保存
+void OPNBase::DataSave(OPNBaseData* data, Channel4* ch) {
+    Timer::DataSave(&data->timer);
+    data->fmvolume = fmvolume;
+    data->clock = clock;
+    data->rate = rate;
+    data->psgrate = psgrate;
+    data->status = status;
+    data->csmch = uint8_t(csmch - ch);
+    data->prescale = prescale;
+    chip.DataSave(&data->chip);
+    psg.DataSave(&data->psg);
+}
+
+//  状態の復元
+bool OPNBase::DataLoad(const OPNBaseData* data, Channel4* ch) {
+    if (data->clock != clock || data->psgrate != psgrate)
+        return false;
+
+    SetPrescaler(data->prescale);
+    Timer::DataLoad(&data->timer);
+    fmvolume = data->fmvolume;
+    rate = data->rate;
+    status = data->status;
+    csmch = &ch[data->csmch];
+    chip.DataLoad(&data->chip);
+    psg.DataLoad(&data->psg);
+    return true;
+}
+
 #endif // defined(BUILD_OPN) || defined(BUILD_OPNA) || defined (BUILD_OPNB)
 
 // ---------------------------------------------------------------------------
@@ -352,6 +382,7 @@ OPNABase::OPNABase() {
 
     adpcmvol = 0;
     control2 = 0;
+    mono = false;
 
     MakeTable2();
     BuildLFOTable();
@@ -412,6 +443,7 @@ void OPNABase::Reset() {
     adpcmd = 127;
     adpcmx = 0;
     lfocount = 0;
+    slfopos = 0;
     adpcmplay = false;
     adplc = 0;
     adpld = 0x100;
@@ -447,6 +479,39 @@ void OPNABase::SetChannelMask(uint32_t mask) {
     rhythmmask_ = (mask >> 10) & ((1 << 6) - 1);
 }
 
+// ---------------------------------------------------------------------------
+//  ソフトウェア LFO の設定
+//  freq は周波数 (1/65536 Hz 単位). その他は Channel4::SetSoftLFO を参照
+//
+void OPNABase::SetSoftLFO(uint32_t c, uint32_t wave, bool sync, uint32_t freq, int pm, const int am[4]) {
+    if (c >= 6)
+        return;
+    uint64_t dcount = (((uint64_t)freq << 16) + rate / 2) / rate;
+    if (dcount > 0x7fffffff)
+        dcount = 0x7fffffff;
+    ch[c].SetSoftLFO(wave, sync, uint32_t(dcount), pm, am);
+}
+
+// ---------------------------------------------------------------------------
+//  出力をモノラルにする
+//  Mix は 1 サンプルにつき 1 個の値 (左右の平均) を書き込むようになる
+//
+void OPNABase::SetMono(bool m) {
+    mono = m;
+    psg.SetMono(m);
+}
+
+// ---------------------------------------------------------------------------
+//  オペレータのパラメータを再計算した回数の合計
+//
+uint32_t OPNABase::GetNumPrepares() {
+    uint32_t n = 0;
+    for (int i = 0; i < 6; i++)
+        for (int j = 0; j < 4; j++)
+            n += ch[i].op[j].GetNumPrepares();
+    return n;
+}
+
 // ---------------------------------------------------------------------------
 //  レジスタアレイにデータを設定
 //
@@ -868,6 +933,20 @@ inline void OPNABase::DecodeADPCMB() {
     adpcmout = n;
 }
 
+// ---------------------------------------------------------------------------
+//  左右の値を書き込んで次のサンプルの位置を返す
+//  モノラルなら左右の平均を書き込む
+//
+inline Sample* OPNABase::StoreSampleLR(Sample* dest, ISample l, ISample r) {
+    if (mono) {
+        StoreSample(dest[0], (l + r) >> 1);
+        return dest + 1;
+    }
+    StoreSample(dest[0], l);
+    StoreSample(dest[1], r);
+    return dest + 2;
+}
+
 // ---------------------------------------------------------------------------
 //  ADPCM 合成
 //
@@ -889,9 +968,7 @@ void OPNABase::ADPCMBMix(Sample* dest, uint32_t count) {
                         break;
                 }
                 int s = (adplc * apout0 + (8192-adplc) * apout1) >> 13;
-                StoreSample(dest[0], s & maskl);
-                StoreSample(dest[1], s & maskr);
-                dest += 2;
+                dest = StoreSampleLR(dest, s & maskl, s & maskr);
                 adplc -= adpld;
             }
             for (; count>0 && apout0; count--) {
@@ -900,9 +977,7 @@ void OPNABase::ADPCMBMix(Sample* dest, uint32_t count) {
                     adplc += 8192;
                 }
                 int s = (adplc * apout1) >> 13;
-                StoreSample(dest[0], s & maskl);
-                StoreSample(dest[1], s & maskr);
-                dest += 2;
+                dest = StoreSampleLR(dest, s & maskl, s & maskr);
                 adplc -= adpld;
             }
         } else {   // fplay > fsamp    (adpld = fplay/famp*8192)
@@ -918,9 +993,7 @@ void OPNABase::ADPCMBMix(Sample* dest, uint32_t count) {
                 }
                 adplc -= 8192;
                 s >>= 13;
-                StoreSample(dest[0], s & maskl);
-                StoreSample(dest[1], s & maskr);
-                dest += 2;
+                dest = StoreSampleLR(dest, s & maskl, s & maskr);
             }
 stop:
             ;
@@ -939,26 +1012,32 @@ stop:
 //
 void OPNABase::FMMix(Sample* buffer, int nsamples) {
     if (fmvolume > 0) {
-        // 準備
-        // Set F-Number
-        if (!(regtc & 0xc0)) {
-            csmch->SetFNum(fnum[csmch-ch]);
-        } else {
-            // 効果音モード
-            csmch->op[0].SetFNum(fnum3[1]); csmch->op[1].SetFNum(fnum3[2]);
-            csmch->op[2].SetFNum(fnum3[0]); csmch->op[3].SetFNum(fnum[2]);
-        }
-
-        int act = (((ch[2].Prepare() << 2) | ch[1].Prepare()) << 2) | ch[0].Prepare();
-        if (reg29 & 0x80)
-            act |= (ch[3].Prepare() | ((ch[4].Prepare() | (ch[5].Prepare() << 2)) << 2)) << 6;
-        if (!(reg22 & 0x08))
-            act &= 0x555;
-
+        int act = FMPrepare();
         if (act & 0x555) {
             Mix6(buffer, nsamples, act);
+            return;
         }
     }
+    SoftLFOSkip(nsamples);
+}
+
+//  合成の準備をして，鳴っているチャンネルを返す
+int OPNABase::FMPrepare() {
+    // Set F-Number
+    if (!(regtc & 0xc0)) {
+        csmch->SetFNum(fnum[csmch-ch]);
+    } else {
+        // 効果音モード
+        csmch->op[0].SetFNum(fnum3[1]); csmch->op[1].SetFNum(fnum3[2]);
+        csmch->op[2].SetFNum(fnum3[0]); csmch->op[3].SetFNum(fnum[2]);
+    }
+
+    int act = (((ch[2].Prepare() << 2) | ch[1].Prepare()) << 2) | ch[0].Prepare();
+    if (reg29 & 0x80)
+        act |= (ch[3].Prepare() | ((ch[4].Prepare() | (ch[5].Prepare() << 2)) << 2)) << 6;
+    if (!(reg22 & 0x08))
+        act &= 0x555;
+    return act;
 }
 
 // ---------------------------------------------------------------------------
@@ -1027,16 +1106,160 @@ void OPNABase::Mix6(Sample* buffer, int nsamples, int activech) {
     idest[4] = &ibuf[pan[4]];
     idest[5] = &ibuf[pan[5]];
 
-    Sample* limit = buffer + nsamples * 2;
-    for (Sample* dest = buffer; dest < limit; dest += 2) {
-        ibuf[1] = ibuf[2] = ibuf[3] = 0;
-        if (activech & 0xaaa)
-            LFO(), MixSubSL(activech, idest);
-        else
-            MixSubS(activech, idest);
-        StoreSample(dest[0], IStoSample(ibuf[2] + ibuf[3]));
-        StoreSample(dest[1], IStoSample(ibuf[1] + ibuf[3]));
+    // ソフトウェア LFO のあるチャンネルがあれば、変調を更新する区間ごとに合成する
+    bool slfo = false;
+    for (int i = 0; i < 6; i++)
+        slfo = slfo || ch[i].HasSoftLFO();
+    if (!slfo)
+        SoftLFOSkip(nsamples);
+
+    Sample* dest = buffer;
+    while (nsamples > 0) {
+        int n = slfo ? SoftLFOStep(nsamples) : nsamples;
+        Sample* limit = dest + n * (mono ? 1 : 2);
+        while (dest < limit) {
+            ibuf[1] = ibuf[2] = ibuf[3] = 0;
+            if (activech & 0xaaa)
+                LFO(), MixSubSL(activech, idest);
+            else
+                MixSubS(activech, idest);
+            dest = StoreSampleLR(dest, IStoSample(ibuf[2] + ibuf[3]), IStoSample(ibuf[1] + ibuf[3]));
+        }
+        nsamples -= n;
+    }
+}
+
+// ---------------------------------------------------------------------------
+//  ソフトウェア LFO の時間を進める
+//  区間の始めなら各チャンネルの変調を更新し、区間内で進めたサンプル数を返す.
+//  区間はリセットからのサンプル数で決まるので、Mix の分け方によらず同じ音になる
+//
+int OPNABase::SoftLFOStep(int nsamples) {
+    if (slfopos == 0) {
+        for (int i = 0; i < 6; i++) {
+            if (ch[i].HasSoftLFO())
+                ch[i].SoftLFO(!(reg22 & 0x08));
+        }
+    }
+    int n = Min(nsamples, int(FM_SLFOBLOCK - slfopos));
+    slfopos = (slfopos + n) & (FM_SLFOBLOCK - 1);
+    return n;
+}
+
+//  合成せずに進める
+void OPNABase::SoftLFOSkip(int nsamples) {
+    bool slfo = false;
+    for (int i = 0; i < 6; i++)
+        slfo = slfo || ch[i].HasSoftLFO();
+    if (!slfo) {
+        slfopos = (slfopos + nsamples) & (FM_SLFOBLOCK - 1);
+        return;
     }
+    while (nsamples > 0)
+        nsamples -= SoftLFOStep(nsamples);
+}
+
+// ---------------------------------------------------------------------------
+//  状態の保存と復元
+//
+void OPNABase::DataSave(OPNABaseData* data) {
+    int i;
+
+    OPNBase::DataSave(&data->base, ch);
+    memcpy(data->pan, pan, sizeof(pan));
+    memcpy(data->fnum2, fnum2, sizeof(fnum2));
+    data->reg22 = reg22;
+    data->reg29 = reg29;
+    data->stmask = stmask;
+    data->statusnext = statusnext;
+    data->lfocount = lfocount;
+    data->lfodcount = lfodcount;
+    data->slfopos = slfopos;
+    for (i = 0; i < 6; i++)
+        data->fnum[i] = fnum[i];
+    for (i = 0; i < 3; i++)
+        data->fnum3[i] = fnum3[i];
+
+    data->adpcmmask = adpcmmask;
+    data->adpcmnotice = adpcmnotice;
+    data->startaddr = startaddr;
+    data->stopaddr = stopaddr;
+    data->memaddr = memaddr;
+    data->limitaddr = limitaddr;
+    data->adpcmlevel = adpcmlevel;
+    data->adpcmvolume = adpcmvolume;
+    data->adpcmvol = adpcmvol;
+    data->deltan = deltan;
+    data->adplc = adplc;
+    data->adpld = adpld;
+    data->adplbase = adplbase;
+    data->adpcmx = adpcmx;
+    data->adpcmd = adpcmd;
+    data->adpcmout = adpcmout;
+    data->apout0 = apout0;
+    data->apout1 = apout1;
+    data->adpcmreadbuf = adpcmreadbuf;
+    data->adpcmplay = adpcmplay;
+    data->granuality = granuality;
+    data->adpcmmask_ = adpcmmask_;
+    data->control1 = control1;
+    data->control2 = control2;
+    memcpy(data->adpcmreg, adpcmreg, sizeof(adpcmreg));
+    data->rhythmmask_ = rhythmmask_;
+
+    for (i = 0; i < 6; i++)
+        ch[i].DataSave(&data->ch[i]);
+}
+
+bool OPNABase::DataLoad(const OPNABaseData* data) {
+    int i;
+
+    if (!OPNBase::DataLoad(&data->base, ch))
+        return false;
+    memcpy(pan, data->pan, sizeof(pan));
+    memcpy(fnum2, data->fnum2, sizeof(fnum2));
+    reg22 = data->reg22;
+    reg29 = data->reg29;
+    stmask = data->stmask;
+    statusnext = data->statusnext;
+    lfocount = data->lfocount;
+    lfodcount = data->lfodcount;
+    slfopos = data->slfopos & (FM_SLFOBLOCK - 1);
+    for (i = 0; i < 6; i++)
+        fnum[i] = data->fnum[i];
+    for (i = 0; i < 3; i++)
+        fnum3[i] = data->fnum3[i];
+
+    adpcmmask = data->adpcmmask;
+    adpcmnotice = data->adpcmnotice;
+    startaddr = data->startaddr;
+    stopaddr = data->stopaddr;
+    memaddr = data->memaddr;
+    limitaddr = data->limitaddr;
+    adpcmlevel = data->adpcmlevel;
+    adpcmvolume = data->adpcmvolume;
+    adpcmvol = data->adpcmvol;
+    deltan = data->deltan;
+    adplc = data->adplc;
+    adpld = data->adpld;
+    adplbase = data->adplbase;
+    adpcmx = data->adpcmx;
+    adpcmd = data->adpcmd;
+    adpcmout = data->adpcmout;
+    apout0 = data->apout0;
+    apout1 = data->apout1;
+    adpcmreadbuf = data->adpcmreadbuf;
+    adpcmplay = !!data->adpcmplay;
+    granuality = data->granuality;
+    adpcmmask_ = !!data->adpcmmask_;
+    control1 = data->control1;
+    control2 = data->control2;
+    memcpy(adpcmreg, data->adpcmreg, sizeof(adpcmreg));
+    rhythmmask_ = data->rhythmmask_;
+
+    for (i = 0; i < 6; i++)
+        ch[i].DataLoad(&data->ch[i]);
+    return true;
 }
 
 #endif // defined(BUILD_OPNA) || defined(BUILD_OPNB)
@@ -1268,7 +1491,7 @@ void OPNA::SetReg(uint32_t addr, uint32_t data) {
 //
 void OPNA::RhythmMix(Sample* buffer, uint32_t count) {
     if (rhythmtvol < 128 && rhythm[0].sample && (rhythmkey & 0x3f)) {
-        Sample* limit = buffer + count * 2;
+        Sample* limit = buffer + count * (mono ? 1 : 2);
         for (int i = 0; i < 6; i++) {
             Rhythm& r = rhythm[i];
             if ((rhythmkey & (1 << i)) && r.level < 128) {
@@ -1281,13 +1504,10 @@ void OPNA::RhythmMix(Sample* buffer, uint32_t count) {
                     maskl = maskr = 0;
                 }
 
-                for (Sample* dest = buffer;
-                     dest < limit && r.pos < r.size; dest += 2)
-                {
+                for (Sample* dest = buffer; dest < limit && r.pos < r.size; ) {
                     int sample = (r.sample[r.pos / 1024] * vol) >> 12;
                     r.pos += r.step;
-                    StoreSample(dest[0], sample & maskl);
-                    StoreSample(dest[1], sample & maskr);
+                    dest = StoreSampleLR(dest, sample & maskl, sample & maskr);
                 }
             }
         }
@@ -1329,6 +1549,59 @@ void OPNA::Mix(Sample* buffer, int nsamples) {
     RhythmMix(buffer, nsamples);
 }
 
+// ---------------------------------------------------------------------------
+//  合成せずに時間を進める
+//
+bool OPNA::Skip(int nsamples) {
+    if (fmvolume > 0 && (FMPrepare() & 0x555))
+        return false;
+    if (adpcmplay)
+        return false;
+    if (rhythmtvol < 128 && rhythm[0].sample && (rhythmkey & 0x3f))
+        return false;
+
+    psg.Skip(nsamples);
+    SoftLFOSkip(nsamples);
+
+    // ADPCMBMix の後始末と同じ
+    apout0 = apout1 = adpcmout = 0;
+    adplc = 0;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+//  状態の保存と復元
+//
+void OPNA::DataSave(OPNAData* data) {
+    OPNABase::DataSave(&data->base);
+    for (int i = 0; i < 6; i++) {
+        data->rhythm[i].pan = rhythm[i].pan;
+        data->rhythm[i].level = rhythm[i].level;
+        data->rhythm[i].volume = rhythm[i].volume;
+        data->rhythm[i].pos = rhythm[i].pos;
+        data->rhythm[i].step = rhythm[i].step;
+    }
+    data->rhythmtl = rhythmtl;
+    data->rhythmtvol = rhythmtvol;
+    data->rhythmkey = rhythmkey;
+}
+
+bool OPNA::DataLoad(const OPNAData* data) {
+    if (!OPNABase::DataLoad(&data->base))
+        return false;
+    for (int i = 0; i < 6; i++) {
+        rhythm[i].pan = data->rhythm[i].pan;
+        rhythm[i].level = data->rhythm[i].level;
+        rhythm[i].volume = data->rhythm[i].volume;
+        rhythm[i].pos = data->rhythm[i].pos;
+        rhythm[i].step = data->rhythm[i].step;
+    }
+    rhythmtl = data->rhythmtl;
+    rhythmtvol = data->rhythmtvol;
+    rhythmkey = data->rhythmkey;
+    return true;
+}
+
 #endif // BUILD_OPNA
 
 // ---------------------------------------------------------------------------
@@ -1607,7 +1880,7 @@ void OPNB::ADPCMAMix(Sample* buffer, uint32_t count) {
     };
 
     if (adpcmatvol < 128 && (adpcmakey & 0x3f)){
-        Sample* limit = buffer + count * 2;
+        Sample* limit = buffer + count * (mono ? 1 : 2);
         for (int i = 0; i < 6; i++) {
             ADPCMA& r = adpcma[i];
             if ((adpcmakey & (1 << i)) && r.level < 128) {
@@ -1621,7 +1894,7 @@ void OPNB::ADPCMAMix(Sample* buffer, uint32_t count) {
                 int vol = tltable[FM_TLPOS+(db << (FM_TLBITS-7))] >> 4;
 
                 Sample* dest = buffer;
-                for ( ; dest < limit; dest += 2) {
+                while (dest < limit) {
                     r.step += adpcmastep;
                     if (r.pos >= r.stop) {
                         SetStatus(0x100 << i);
@@ -1645,8 +1918,7 @@ void OPNB::ADPCMAMix(Sample* buffer, uint32_t count) {
                         r.adpcmd = Limit(r.adpcmd, 48*16, 0);
                     }
                     int sample = (r.adpcmx * vol) >> 10;
-                    StoreSample(dest[0], sample & maskl);
-                    StoreSample(dest[1], sample & maskr);
+                    dest = StoreSampleLR(dest, sample & maskl, sample & maskr);
                 }
             }
         }
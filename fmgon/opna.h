@@ -49,6 +49,17 @@
 //      ・この関数は音源内部のタイマーとは独立している．
 //        Timer は Count と GetNextEvent で操作する必要がある．
 //
+//  void SetMono(bool mono)
+//      (OPNA ONLY)
+//      Mix の出力をモノラルにする．dest には sample 個分の領域が必要で，
+//      左右の平均が格納される．内部状態ではないので DataSave には含まれない
+//
+//  bool Skip(int nsamples)
+//      (OPNA ONLY)
+//      PCM を合成せずに，Mix と同じだけ内部状態を nsamples 分進める
+//      FM, ADPCM, リズムのいずれかが鳴っているときは何もせずに false を返す
+//      その場合は Mix で合成すること
+//
 //  void Reset()
 //      音源をリセット(初期化)する
 //
@@ -78,7 +89,89 @@
 //      各音源の音量を＋－方向に調節する．標準値は 0.
 //      単位は約 1/2 dB，有効範囲の上限は 20 (10dB)
 //
+//  void DataSave(OPNAData* data)
+//      (OPNA ONLY)
+//      音源の内部状態を data に保存する．
+//      ADPCM RAM の内容とリズムサンプルは含まない
+//
+//  bool DataLoad(const OPNAData* data)
+//      (OPNA ONLY)
+//      DataSave で保存した内部状態を復元する．
+//      クロックやレートが異なる場合は false を返す
+//
 namespace FM {
+    //  状態保存用のデータ ---------------------------------------------
+    struct OPNBaseData {
+        TimerData   timer;
+        int32_t     fmvolume;
+        uint32_t    clock;
+        uint32_t    rate;
+        uint32_t    psgrate;
+        uint32_t    status;
+        uint8_t     csmch;          // ch 内の位置
+        uint8_t     prescale;
+        ChipData    chip;
+        PSGData     psg;
+    };
+
+    struct OPNABaseData {
+        OPNBaseData base;
+        uint8_t     pan[6];
+        uint8_t     fnum2[9];
+        uint8_t     reg22;
+        uint32_t    reg29;
+        uint32_t    stmask;
+        uint32_t    statusnext;
+        uint32_t    lfocount;
+        uint32_t    lfodcount;
+        uint32_t    slfopos;
+        uint32_t    fnum[6];
+        uint32_t    fnum3[3];
+
+        uint32_t    adpcmmask;
+        uint32_t    adpcmnotice;
+        uint32_t    startaddr;
+        uint32_t    stopaddr;
+        uint32_t    memaddr;
+        uint32_t    limitaddr;
+        int32_t     adpcmlevel;
+        int32_t     adpcmvolume;
+        int32_t     adpcmvol;
+        uint32_t    deltan;
+        int32_t     adplc;
+        int32_t     adpld;
+        uint32_t    adplbase;
+        int32_t     adpcmx;
+        int32_t     adpcmd;
+        int32_t     adpcmout;
+        int32_t     apout0;
+        int32_t     apout1;
+        uint32_t    adpcmreadbuf;
+        uint8_t     adpcmplay;
+        int8_t      granuality;
+        uint8_t     adpcmmask_;
+        uint8_t     control1;
+        uint8_t     control2;
+        uint8_t     adpcmreg[8];
+        int32_t     rhythmmask_;
+
+        Channel4Data ch[6];
+    };
+
+    struct OPNAData {
+        OPNABaseData base;
+        struct {
+            uint8_t     pan;
+            int8_t      level;
+            int32_t     volume;
+            uint32_t    pos;
+            uint32_t    step;
+        } rhythm[6];
+        int8_t      rhythmtl;
+        int32_t     rhythmtvol;
+        uint8_t     rhythmkey;
+    };
+
     //  OPN Base -------------------------------------------------------
     class OPNBase : public Timer {
     public:
@@ -92,6 +185,9 @@ namespace FM {
         void        SetLPFCutoff(uint32_t freq) {}  // obsolete
 
     protected:
+        void        DataSave(OPNBaseData* data, Channel4* ch);
+        bool        DataLoad(const OPNBaseData* data, Channel4* ch);
+
         void        SetParameter(Channel4* ch, uint32_t addr, uint32_t data);
         void        SetPrescaler(uint32_t p);
         void        RebuildTimeTable();
@@ -126,6 +222,11 @@ namespace FM {
         }
         uint32_t    ReadStatusEx();
         void        SetChannelMask(uint32_t mask);
+        void        SetSoftLFO(uint32_t c, uint32_t wave, bool sync, uint32_t freq, int pm, const int am[4]);
+        bool        HasSoftLFO(uint32_t c) { return c < 6 && ch[c].HasSoftLFO(); }
+        void        SetMono(bool m);
+        bool        IsMono() { return mono; }
+        uint32_t    GetNumPrepares();
 
     private:
         virtual void Intr(bool) {}
@@ -141,9 +242,15 @@ namespace FM {
         void        SetADPCMBReg(uint32_t reg, uint32_t data);
         uint32_t    GetReg(uint32_t addr);
 
+        void        DataSave(OPNABaseData* data);
+        bool        DataLoad(const OPNABaseData* data);
+
     protected:
         void        FMMix(Sample* buffer, int nsamples);
+        int         FMPrepare();
         void        Mix6(Sample* buffer, int nsamples, int activech);
+        int         SoftLFOStep(int nsamples);
+        void        SoftLFOSkip(int nsamples);
 
         void        MixSubS(int activech, ISample**);
         void        MixSubSL(int activech, ISample**);
@@ -156,6 +263,8 @@ namespace FM {
         void        DecodeADPCMB();
         void        ADPCMBMix(Sample* dest, uint32_t count);
 
+        Sample*     StoreSampleLR(Sample* dest, ISample l, ISample r);
+
         void        WriteRAM(uint32_t data);
         uint32_t    ReadRAM();
         int         ReadRAMN();
@@ -173,6 +282,7 @@ namespace FM {
 
         uint32_t    lfocount;
         uint32_t    lfodcount;
+        uint32_t    slfopos;    // ソフトウェア LFO の区間内の位置
 
         uint32_t    fnum[6];
         uint32_t    fnum3[3];
@@ -209,6 +319,8 @@ namespace FM {
 
         int         rhythmmask_;
 
+        bool        mono;           // モノラルで出力する
+
         Channel4    ch[6];
 
         static void BuildLFOTable();
@@ -264,6 +376,7 @@ namespace FM {
 
         bool        SetRate(uint32_t c, uint32_t r, bool = false);
         void        Mix(Sample* buffer, int nsamples);
+        bool        Skip(int nsamples);
 
         void        Reset();
         void        SetReg(uint32_t addr, uint32_t data);
@@ -275,6 +388,9 @@ namespace FM {
 
         uint8_t*    GetADPCMBuffer() { return adpcmbuf; }
 
+        void        DataSave(OPNAData* data);
+        bool        DataLoad(const OPNAData* data);
+
         int         dbgGetOpOut(int c, int s) { return ch[c].op[s].dbgopout_; }
         int         dbgGetPGOut(int c, int s) { return ch[c].op[s].dbgpgout_; }
         Channel4*   dbgGetCh(int c) { return &ch[c]; }
@@ -11,6 +11,11 @@
 //  コンストラクタ・デストラクタ
 //
 PSG::PSG() {
+    // カウンタは Reset で初期化されないので、ここで揃えておく
+    for (int i = 0; i < 3; i++)
+        scount[i] = 0;
+    ecount = ncount = 0;
+    mono = false;
     SetVolume(0);
     MakeNoiseTable();
     Reset();
@@ -187,13 +192,14 @@ inline void PSG::StoreSample(Sample& dest, int32_t data) {
 }
 
 // ---------------------------------------------------------------------------
-//  PCM データを吐き出す(2ch)
+//  PCM データを吐き出す(2ch, モノラルなら 1ch)
 //  dest        PCM データを展開するポインタ
 //  nsamples    展開する PCM のサンプル数
 //
 void PSG::Mix(Sample* dest, int nsamples) {
     uint8_t chenable[3], nenable[3];
     uint8_t r7 = ~reg[7];
+    const int step = mono ? 1 : 2;      // 1 サンプルあたりの値の数
 
     if ((r7 & 0x3f) | ((reg[8] | reg[9] | reg[10]) & 0x1f)) {
         chenable[0] = (r7 & 0x01) && (speriod[0] <= (1 << toneshift));
@@ -231,8 +237,9 @@ void PSG::Mix(Sample* dest, int nsamples) {
                     }
                     sample /= (1 << oversampling);
                     StoreSample(dest[0], sample);
-                    StoreSample(dest[1], sample);
-                    dest += 2;
+                    if (step == 2)
+                        StoreSample(dest[1], sample);
+                    dest += step;
                 }
             } else {
                 // ノイズ有り
@@ -261,8 +268,9 @@ void PSG::Mix(Sample* dest, int nsamples) {
                     }
                     sample /= (1 << oversampling);
                     StoreSample(dest[0], sample);
-                    StoreSample(dest[1], sample);
-                    dest += 2;
+                    if (step == 2)
+                        StoreSample(dest[1], sample);
+                    dest += step;
                 }
             }
 
@@ -308,13 +316,99 @@ void PSG::Mix(Sample* dest, int nsamples) {
                 }
                 sample /= (1 << oversampling);
                 StoreSample(dest[0], sample);
-                StoreSample(dest[1], sample);
-                dest += 2;
+                if (step == 2)
+                    StoreSample(dest[1], sample);
+                dest += step;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+//  PCM を合成せずに時間を進める
+//  Mix と全く同じだけカウンタを進めること
+//
+void PSG::Skip(int nsamples) {
+    uint8_t r7 = ~reg[7];
+
+    if ((r7 & 0x3f) | ((reg[8] | reg[9] | reg[10]) & 0x1f)) {
+        uint32_t n = uint32_t(nsamples) << oversampling;
+
+        scount[0] += speriod[0] * n;
+        scount[1] += speriod[1] * n;
+        scount[2] += speriod[2] * n;
+
+        bool useenv = ((mask & 1) && (reg[ 8] & 0x10)) ||
+                      ((mask & 2) && (reg[ 9] & 0x10)) ||
+                      ((mask & 4) && (reg[10] & 0x10));
+        if (!useenv) {
+            // エンベロープ無し
+            if ((r7 & 0x38) != 0)
+                ncount += nperiod * n;
+
+            ecount = (ecount >> 8) + (eperiod >> (8-oversampling)) * nsamples;
+            if (ecount >= (1 << (envshift+6+oversampling-8))) {
+                if ((reg[0x0d] & 0x0b) != 0x0a)
+                    ecount |= (1 << (envshift+5+oversampling-8));
+                ecount &= (1 << (envshift+6+oversampling-8)) - 1;
+            }
+            ecount <<= 8;
+        } else {
+            // エンベロープあり
+            ncount += nperiod * n;
+            for (uint32_t i = 0; i < n; i++) {
+                ecount += eperiod;
+                if (ecount >= (1 << (envshift+6+oversampling))) {
+                    if ((reg[0x0d] & 0x0b) != 0x0a)
+                        ecount |= (1 << (envshift+5+oversampling));
+                    ecount &= (1 << (envshift+6+oversampling)) - 1;
+                }
             }
         }
     }
 }
 
+// ---------------------------------------------------------------------------
+//  状態の保存と復元
+//
+void PSG::DataSave(PSGData* data) {
+    memcpy(data->reg, reg, sizeof(reg));
+    for (int i = 0; i < 3; i++) {
+        data->olevel[i] = olevel[i];
+        data->scount[i] = scount[i];
+        data->speriod[i] = speriod[i];
+    }
+    data->ecount = ecount;
+    data->eperiod = eperiod;
+    data->ncount = ncount;
+    data->nperiod = nperiod;
+    data->tperiodbase = tperiodbase;
+    data->eperiodbase = eperiodbase;
+    data->nperiodbase = nperiodbase;
+    data->volume = volume;
+    data->mask = mask;
+    data->envelop = uint8_t((envelop - enveloptable[0]) / 64);
+}
+
+void PSG::DataLoad(const PSGData* data) {
+    memcpy(reg, data->reg, sizeof(reg));
+    for (int i = 0; i < 3; i++) {
+        olevel[i] = data->olevel[i];
+        scount[i] = data->scount[i];
+        speriod[i] = data->speriod[i];
+    }
+    ecount = data->ecount;
+    eperiod = data->eperiod;
+    ncount = data->ncount;
+    nperiod = data->nperiod;
+    tperiodbase = data->tperiodbase;
+    eperiodbase = data->eperiodbase;
+    nperiodbase = data->nperiodbase;
+    volume = data->volume;
+    mask = data->mask;
+    envelop = enveloptable[data->envelop & 15];
+}
+
 // ---------------------------------------------------------------------------
 //  テーブル
 //
@@ -7,7 +7,11 @@
 #ifndef PSG_H
 #define PSG_H
 
-#define PSG_SAMPLETYPE      int16_t     // int32_t or int16_t
+#ifdef FMGON_INT32_SAMPLE
+    #define PSG_SAMPLETYPE  int32_t     // FM_SAMPLETYPE と揃える
+#else
+    #define PSG_SAMPLETYPE  int16_t     // int32_t or int16_t
+#endif
 
 // ---------------------------------------------------------------------------
 //  class PSG
@@ -25,6 +29,12 @@
 //  void Mix(Sample* dest, int nsamples)
 //      PCM を nsamples 分合成し， dest で始まる配列に加える(加算する)
 //      あくまで加算なので，最初に配列をゼロクリアする必要がある
+//
+//  void SetMono(bool mono)
+//      Mix の出力をモノラル (1 サンプルにつき 1 個) にする
+//
+//  void Skip(int nsamples)
+//      合成はせずに，Mix(dest, nsamples) と同じだけ内部状態を進める
 //  
 //  void Reset()
 //      リセットする
@@ -39,6 +49,23 @@
 //      各音源の音量を調節する
 //      単位は約 1/2 dB
 //
+//  void DataSave(PSGData* data) / void DataLoad(const PSGData* data)
+//      内部状態を保存・復元する
+//
+struct PSGData {
+    uint8_t     reg[16];
+    uint32_t    olevel[3];
+    uint32_t    scount[3], speriod[3];
+    uint32_t    ecount, eperiod;
+    uint32_t    ncount, nperiod;
+    uint32_t    tperiodbase;
+    uint32_t    eperiodbase;
+    uint32_t    nperiodbase;
+    int32_t     volume;
+    int32_t     mask;
+    uint8_t     envelop;        // enveloptable 内の位置
+};
+
 class PSG {
 public:
     typedef PSG_SAMPLETYPE Sample;
@@ -56,10 +83,12 @@ public:
     ~PSG();
 
     void        Mix(Sample* dest, int nsamples);
+    void        Skip(int nsamples);
     void        SetClock(int clock, int rate);
     
     void        SetVolume(int vol);
     void        SetChannelMask(int c);
+    void        SetMono(bool m) { mono = m; }
     
     void        Reset();
     void        SetReg(uint32_t regnum, uint8_t data);
@@ -68,6 +97,9 @@ public:
         return reg[regnum & 0x0f];
     }
 
+    void        DataSave(PSGData* data);
+    void        DataLoad(const PSGData* data);
+
 protected:
     void        MakeNoiseTable();
     void        MakeEnvelopTable();
@@ -85,6 +117,7 @@ protected:
     uint32_t            nperiodbase;
     int                 volume;
     int                 mask;
+    bool                mono;           // モノラルで出力する
 
     static uint32_t     enveloptable[16][64];
     static uint32_t     noisetable[noisetablesize];
@@ -15,6 +15,9 @@
 #include <shlwapi.h>
 #include <strsafe.h>
 #include "sound.h"
+#include "engine.h"
+#include "rendercache.h"
+#include "batch.h"
 #include "server/server.h"
 
 enum RET { // exit code of this program
@@ -71,6 +74,11 @@ enum TEXT_ID { // text id
     IDT_CANT_OPEN_FILE,
     IDT_BAD_CALL,
     IDT_CIRCULAR_REFERENCE,
+    IDT_BAD_MANIFEST,
+    IDT_BATCH_BAD_CALL,
+    IDT_BATCH_CANT_OPEN_FILE,
+    IDT_BATCH_SUMMARY,
+    IDT_BAD_REGLOG,
 };
 
 // localization
@@ -88,11 +96,25 @@ LPCTSTR get_text(INT id)
                    TEXT("オプション:\n")
                    TEXT("  -D変数名=値            変数に代入。\n")
                    TEXT("  -save-wav 出力.wav     WAVファイルとして保存。\n")
+                   TEXT("                         拡張子が .vgm か .s98 ならレジスタ書き込みのログとして保存。\n")
+                   TEXT("                         SSGのノイズ周期やエンベロープを複数のチャンネルで食い違って使うと保存できない。\n")
+                   TEXT("                         LFOのある音色を使っても保存できない。\n")
                    TEXT("  -stopm                 音楽を止めて設定をリセット。\n")
                    TEXT("  -stereo                音をステレオにする（デフォルト）。\n")
                    TEXT("  -mono                  音をモノラルにする。\n")
+                   TEXT("  -format 形式           WAVファイルのサンプルの形式。s16（デフォルト）, s24, f32 のどれか。\n")
                    TEXT("  -bgm 0                     演奏が終わるまで待つ（デフォルト）。\n")
                    TEXT("  -bgm 1                     演奏が終わるまで待たない。\n")
+                   TEXT("  -no-cache              描画キャッシュを使わない。\n")
+                   TEXT("  -batch マニフェスト    マニフェストの各行の文字列をWAVファイルに一括保存。\n")
+                   TEXT("                         各行は「文字列<TAB>出力.wav[<TAB>オプション]」。\n")
+                   TEXT("  -jobs 数               -batchで使うスレッド数（デフォルトはCPU数）。\n")
+                   TEXT("  -stats                 段階ごとの時間と数をJSONで標準エラーに出力する。\n")
+                   TEXT("                         環境変数 CMD_SING_STATS=1 でも有効になる。\n")
+                   TEXT("  -replay 入力.vgm       VGMファイルのレジスタ書き込みを直接演奏する。\n")
+                   TEXT("                         -save-wav と一緒に使うとWAVファイルに書き出す。\n")
+                   TEXT("  -stream 入力           入力から一行ずつ文字列を読み込み、切れ目なく続けて演奏する。\n")
+                   TEXT("                         入力が - なら標準入力。-save-wav と一緒に使うとWAVファイルに書き出す。\n")
                    TEXT("  -help                  このメッセージを表示する。\n")
                    TEXT("  -version               バージョン情報を表示する。\n")
                    TEXT("\n")
@@ -104,6 +126,11 @@ LPCTSTR get_text(INT id)
         case IDT_CANT_OPEN_FILE: return TEXT("エラー: ファイル「%s」が開けません。\n");
         case IDT_BAD_CALL: return TEXT("エラー: 不正な関数呼び出しです。\n");
         case IDT_CIRCULAR_REFERENCE: return TEXT("エラー: 変数の循環参照を検出しました。\n");
+        case IDT_BAD_MANIFEST: return TEXT("エラー: マニフェスト「%s」が読み込めないか、不正な行があります。\n");
+        case IDT_BATCH_BAD_CALL: return TEXT("エラー: %d行目: 不正な関数呼び出しです。\n");
+        case IDT_BATCH_CANT_OPEN_FILE: return TEXT("エラー: %d行目: ファイル「%s」が開けません。\n");
+        case IDT_BATCH_SUMMARY: return TEXT("成功: %d, 失敗: %d, 時間: %.2f秒, %.1f 個/秒, 実時間比: %.1f倍\n");
+        case IDT_BAD_REGLOG: return TEXT("エラー: 「%s」は、YM2203を使った正しいVGMファイルではありません。\n");
         }
     }
     else // The others are Let's la English
@@ -118,11 +145,25 @@ LPCTSTR get_text(INT id)
                    TEXT("Options:\n")
                    TEXT("  -DVAR=VALUE            Assign to a variable.\n")
                    TEXT("  -save-wav output.wav   Save as WAV file.\n")
+                   TEXT("                         If the extension is .vgm or .s98, save the register writes.\n")
+                   TEXT("                         Fails if SSG channels disagree on the noise period or envelope.\n")
+                   TEXT("                         Also fails if a timbre with an LFO is used.\n")
                    TEXT("  -stopm                 Stop music and reset settings.\n")
                    TEXT("  -stereo                Make sound stereo (default).\n")
                    TEXT("  -mono                  Make sound mono.\n")
+                   TEXT("  -format format         The sample format of WAV files: s16 (default), s24 or f32.\n")
                    TEXT("  -bgm 0                     Wait until the performance is over (default).\n")
                    TEXT("  -bgm 1                     Don't wait until the performance is over.\n")
+                   TEXT("  -no-cache              Don't use the render cache.\n")
+                   TEXT("  -batch manifest        Save each line of the manifest as a WAV file.\n")
+                   TEXT("                         Each line is 'string<TAB>output.wav[<TAB>options]'.\n")
+                   TEXT("  -jobs count            The number of threads for -batch (default: CPUs).\n")
+                   TEXT("  -stats                 Print per-stage timings and counts as JSON to stderr.\n")
+                   TEXT("                         Also enabled by the environment variable CMD_SING_STATS=1.\n")
+                   TEXT("  -replay input.vgm      Play the register writes of a VGM file directly.\n")
+                   TEXT("                         With -save-wav, write them to a WAV file.\n")
+                   TEXT("  -stream input          Read strings line by line from input and play them seamlessly.\n")
+                   TEXT("                         '-' means stdin. With -save-wav, write them to a WAV file.\n")
                    TEXT("  -help                  Display this message.\n")
                    TEXT("  -version               Display version info.\n")
                    TEXT("\n")
@@ -134,6 +175,11 @@ LPCTSTR get_text(INT id)
         case IDT_CANT_OPEN_FILE: return TEXT("ERROR: Unable to open file '%s'.\n");
         case IDT_BAD_CALL: return TEXT("ERROR: Illegal function call\n");
         case IDT_CIRCULAR_REFERENCE: return TEXT("ERROR: Circular variable reference detected.\n");
+        case IDT_BAD_MANIFEST: return TEXT("ERROR: Unable to read manifest '%s' or it has an invalid line.\n");
+        case IDT_BATCH_BAD_CALL: return TEXT("ERROR: line %d: Illegal function call\n");
+        case IDT_BATCH_CANT_OPEN_FILE: return TEXT("ERROR: line %d: Unable to open file '%s'.\n");
+        case IDT_BATCH_SUMMARY: return TEXT("Succeeded: %d, Failed: %d, Time: %.2f sec, %.1f scores/sec, Realtime factor: %.1fx\n");
+        case IDT_BAD_REGLOG: return TEXT("ERROR: '%s' is not a valid VGM file for YM2203.\n");
         }
     }
 
@@ -171,7 +217,12 @@ struct CMD_SING
     bool m_bgm2 = false;
     bool m_stopm = false;
     bool m_stereo = true;
+    VskSampleFormat m_format = VSK_SAMPLE_FORMAT_S16;
     bool m_no_reg = false;
+    std::wstring m_batch;
+    int m_jobs = 0;
+    std::wstring m_replay;
+    std::wstring m_stream;
     std::map<VskString, VskString> m_variables;
 
     RET parse_cmd_line(int argc, wchar_t **argv);
@@ -182,6 +233,9 @@ struct CMD_SING
 
     VSK_SOUND_ERR save_wav();
     VSK_SOUND_ERR play_str(bool no_sound);
+    RET run_batch();
+    RET run_replay();
+    RET run_stream();
     std::wstring build_server_cmd_line(int argc, wchar_t **argv);
     RET start_server(const std::wstring& cmd_line);
 };
@@ -192,6 +246,8 @@ bool CMD_SING::load_settings()
     if (m_no_reg)
         return false;
 
+    VskStageTimer timer(vsk_default_engine().m_stats, VSK_STAGE_REGISTRY);
+
     HKEY hKey;
 
     // レジストリを開く
@@ -258,6 +314,8 @@ bool CMD_SING::save_settings()
     if (m_no_reg)
         return false;
 
+    VskStageTimer timer(vsk_default_engine().m_stats, VSK_STAGE_REGISTRY);
+
     std::vector<uint8_t> setting;
     if (!vsk_cmd_sing_get_setting(setting))
         return false;
@@ -321,6 +379,8 @@ bool CMD_SING::save_bgm_only()
     if (m_no_reg)
         return false;
 
+    VskStageTimer timer(vsk_default_engine().m_stats, VSK_STAGE_REGISTRY);
+
     // レジストリを作成
     HKEY hKey;
     LSTATUS error = RegCreateKeyExW(HKEY_CURRENT_USER, L"Software\\Katayama Hirofumi MZ\\cmd_sing", 0,
@@ -348,6 +408,7 @@ void erase_reg_settings(void)
 
 VSK_SOUND_ERR CMD_SING::save_wav()
 {
+    vsk_default_engine().m_player->m_sample_format = m_format;
     return vsk_sound_cmd_sing_save(m_str_to_play.c_str(), m_output_file.c_str(), m_stereo);
 }
 
@@ -356,6 +417,215 @@ VSK_SOUND_ERR CMD_SING::play_str(bool no_sound)
     return vsk_sound_cmd_sing(m_str_to_play.c_str(), m_stereo, no_sound);
 }
 
+// マニフェストの各行を並列にWAVファイルに保存する。
+// 音源の初期化は一回だけで済み、すべてのCPUを使う
+RET CMD_SING::run_batch()
+{
+    std::vector<VskBatchJob> jobs;
+    if (!vsk_batch_load_manifest(m_batch.c_str(), m_stereo, m_format, jobs))
+    {
+        my_printf(stderr, get_text(IDT_BAD_MANIFEST), m_batch.c_str());
+        return RET_CANT_OPEN_FILE;
+    }
+
+    // g_variablesをm_variablesで上書き
+    for (auto& pair : m_variables)
+        g_variables[pair.first] = pair.second;
+
+    // リズム音源のある場所を取得
+    char rhythm_path[MAX_PATH];
+    vsk_get_rhythm_path(rhythm_path, _countof(rhythm_path));
+
+    VskBatchResult result;
+    vsk_batch_render(vsk_default_engine(), rhythm_path, jobs, m_jobs, result);
+
+    for (auto& failure : result.m_failures)
+    {
+        auto& job = jobs[failure.m_index];
+        if (failure.m_error == VSK_SOUND_ERR_IO_ERROR)
+            my_printf(stderr, get_text(IDT_BATCH_CANT_OPEN_FILE), (int)job.m_line, job.m_output.c_str());
+        else
+            my_printf(stderr, get_text(IDT_BATCH_BAD_CALL), (int)job.m_line);
+    }
+
+    double scores_per_sec = (result.m_seconds > 0) ? jobs.size() / result.m_seconds : 0;
+    double realtime_factor = (result.m_seconds > 0) ? result.m_audio_seconds / result.m_seconds : 0;
+    my_printf(stdout, get_text(IDT_BATCH_SUMMARY),
+              (int)result.m_num_succeeded, (int)result.m_failures.size(),
+              result.m_seconds, scores_per_sec, realtime_factor);
+
+    return result.m_failures.empty() ? RET_SUCCESS : RET_BAD_CALL;
+}
+
+// VGMファイルのレジスタ書き込みを、MMLを解析せずに直接音源に流す。
+// -save-wav があれば少しずつWAVファイルに書き出し、なければ演奏する
+RET CMD_SING::run_replay()
+{
+    std::vector<uint8_t> data;
+    FILE *fin = _wfopen(m_replay.c_str(), L"rb");
+    if (!fin)
+    {
+        my_printf(stderr, get_text(IDT_CANT_OPEN_FILE), m_replay.c_str());
+        return RET_CANT_OPEN_FILE;
+    }
+    uint8_t buf[4096];
+    size_t size;
+    while ((size = fread(buf, 1, sizeof(buf), fin)) > 0)
+        data.insert(data.end(), buf, buf + size);
+    fclose(fin);
+
+    if (m_output_file.size())
+    {
+        VskPcmWavSink sink;
+        if (!sink.open(m_output_file.c_str(), m_stereo, m_format))
+        {
+            my_printf(stderr, get_text(IDT_CANT_OPEN_FILE), m_output_file.c_str());
+            return RET_CANT_OPEN_FILE;
+        }
+        if (!vsk_replay_vgm(data.data(), data.size(), sink, m_stereo))
+        {
+            my_printf(stderr, get_text(IDT_BAD_REGLOG), m_replay.c_str());
+            return RET_BAD_CALL;
+        }
+        if (!sink.close())
+        {
+            my_printf(stderr, get_text(IDT_CANT_OPEN_FILE), m_output_file.c_str());
+            return RET_CANT_OPEN_FILE;
+        }
+        return RET_SUCCESS;
+    }
+
+    VskPcmMemorySink sink;
+    if (!vsk_replay_vgm(data.data(), data.size(), sink, m_stereo))
+    {
+        my_printf(stderr, get_text(IDT_BAD_REGLOG), m_replay.c_str());
+        return RET_BAD_CALL;
+    }
+
+    if (!vsk_sound_init(m_stereo))
+    {
+        my_puts(get_text(IDT_SOUND_INIT_FAILED), stderr);
+        return RET_BAD_SOUND_INIT;
+    }
+    vsk_sound_play(sink.m_values.data(), sink.m_values.size() * sizeof(VSK_PCM16_VALUE), m_stereo);
+    vsk_sound_wait(-1);
+    vsk_sound_exit();
+    return RET_SUCCESS;
+}
+
+// 入力から一行ずつ文字列を読み込み、前の行の続きとして切れ目なく演奏する。
+// 音源と設定は前の行から引き継ぐ。-save-wav があればWAVファイルに書き出す。
+// 不正な行は報告して飛ばす
+RET CMD_SING::run_stream()
+{
+    FILE *fin = (m_stream == L"-") ? stdin : _wfopen(m_stream.c_str(), L"rb");
+    if (!fin)
+    {
+        my_printf(stderr, get_text(IDT_CANT_OPEN_FILE), m_stream.c_str());
+        return RET_CANT_OPEN_FILE;
+    }
+
+    // g_variablesをm_variablesで上書き
+    for (auto& pair : m_variables)
+        g_variables[pair.first] = pair.second;
+
+    if (!vsk_sound_init(m_stereo))
+    {
+        if (fin != stdin)
+            fclose(fin);
+        my_puts(get_text(IDT_SOUND_INIT_FAILED), stderr);
+        return RET_BAD_SOUND_INIT;
+    }
+
+    // 出力先を開く
+    std::shared_ptr<VskPcmSink> sink;
+    std::shared_ptr<VskPcmWavSink> wav_sink;
+    if (m_output_file.size())
+    {
+        wav_sink = std::make_shared<VskPcmWavSink>();
+        if (wav_sink->open(m_output_file.c_str(), m_stereo, m_format))
+            sink = wav_sink;
+    }
+    else
+    {
+        sink = vsk_sound_open_stream(m_stereo);
+    }
+    if (!sink)
+    {
+        if (fin != stdin)
+            fclose(fin);
+        vsk_sound_exit();
+        if (m_output_file.size())
+        {
+            my_printf(stderr, get_text(IDT_CANT_OPEN_FILE), m_output_file.c_str());
+            return RET_CANT_OPEN_FILE;
+        }
+        my_puts(get_text(IDT_SOUND_INIT_FAILED), stderr);
+        return RET_BAD_SOUND_INIT;
+    }
+
+    // 一行を演奏する。書き込めなければfalseを返す
+    RET ret = RET_SUCCESS;
+    int iline = 0;
+    auto sing_line = [&](std::string& line) {
+        ++iline;
+        while (line.size() && (line.back() == '\n' || line.back() == '\r'))
+            line.pop_back();
+        if (line.empty())
+            return true;
+
+        switch (vsk_sound_cmd_sing_stream(line.c_str(), *sink, m_stereo))
+        {
+        case VSK_SOUND_ERR_SUCCESS:
+            return true;
+        case VSK_SOUND_ERR_ILLEGAL:
+            my_printf(stderr, get_text(IDT_BATCH_BAD_CALL), iline);
+            do_beep();
+            ret = RET_BAD_CALL;
+            return true;
+        default:
+            // 書き込めないか、止められた
+            if (m_output_file.size())
+            {
+                my_printf(stderr, get_text(IDT_CANT_OPEN_FILE), m_output_file.c_str());
+                ret = RET_CANT_OPEN_FILE;
+            }
+            return false;
+        }
+    };
+
+    // 行が届くたびに演奏する。長い行はつなげてから演奏する
+    std::string line;
+    char buf[1024];
+    bool ok = true;
+    while (ok && fgets(buf, sizeof(buf), fin))
+    {
+        line += buf;
+        if (line.back() != '\n')
+            continue;
+        ok = sing_line(line);
+        line.clear();
+    }
+    if (ok && line.size()) // 改行で終わらない最後の行
+        sing_line(line);
+
+    if (fin != stdin)
+        fclose(fin);
+
+    // 鳴り終わるのを待ってから閉じる
+    if (wav_sink && !wav_sink->close() && ret == RET_SUCCESS)
+    {
+        my_printf(stderr, get_text(IDT_CANT_OPEN_FILE), m_output_file.c_str());
+        ret = RET_CANT_OPEN_FILE;
+    }
+    wav_sink = nullptr;
+    sink = nullptr;
+
+    save_settings();
+    vsk_sound_exit();
+    return ret;
+}
+
 RET CMD_SING::parse_cmd_line(int argc, wchar_t **argv)
 {
     if (argc <= 1)
@@ -413,6 +683,25 @@ RET CMD_SING::parse_cmd_line(int argc, wchar_t **argv)
             continue;
         }
 
+        if (_wcsicmp(arg, L"-format") == 0 || _wcsicmp(arg, L"--format") == 0)
+        {
+            if (iarg + 1 < argc)
+            {
+                ++iarg;
+                if (!vsk_sample_format_from_name(vsk_sjis_from_wide(argv[iarg]).c_str(), m_format))
+                {
+                    my_printf(stderr, get_text(IDT_INVALID_OPTION), argv[iarg]);
+                    return RET_BAD_CMDLINE;
+                }
+                continue;
+            }
+            else
+            {
+                my_printf(stderr, get_text(IDT_NEEDS_OPERAND), arg);
+                return RET_BAD_CMDLINE;
+            }
+        }
+
         if (_wcsicmp(arg, L"-bgm") == 0 || _wcsicmp(arg, L"--bgm") == 0)
         {
             if (iarg + 1 < argc)
@@ -427,6 +716,74 @@ RET CMD_SING::parse_cmd_line(int argc, wchar_t **argv)
             }
         }
 
+        if (_wcsicmp(arg, L"-batch") == 0 || _wcsicmp(arg, L"--batch") == 0)
+        {
+            if (iarg + 1 < argc)
+            {
+                m_batch = argv[++iarg];
+                continue;
+            }
+            else
+            {
+                my_printf(stderr, get_text(IDT_NEEDS_OPERAND), arg);
+                return RET_BAD_CMDLINE;
+            }
+        }
+
+        if (_wcsicmp(arg, L"-jobs") == 0 || _wcsicmp(arg, L"--jobs") == 0)
+        {
+            if (iarg + 1 < argc)
+            {
+                m_jobs = _wtoi(argv[++iarg]);
+                continue;
+            }
+            else
+            {
+                my_printf(stderr, get_text(IDT_NEEDS_OPERAND), arg);
+                return RET_BAD_CMDLINE;
+            }
+        }
+
+        if (_wcsicmp(arg, L"-stats") == 0 || _wcsicmp(arg, L"--stats") == 0)
+        {
+            // wmainで処理済み
+            continue;
+        }
+
+        if (_wcsicmp(arg, L"-replay") == 0 || _wcsicmp(arg, L"--replay") == 0)
+        {
+            if (iarg + 1 < argc)
+            {
+                m_replay = argv[++iarg];
+                continue;
+            }
+            else
+            {
+                my_printf(stderr, get_text(IDT_NEEDS_OPERAND), arg);
+                return RET_BAD_CMDLINE;
+            }
+        }
+
+        if (_wcsicmp(arg, L"-stream") == 0 || _wcsicmp(arg, L"--stream") == 0)
+        {
+            if (iarg + 1 < argc)
+            {
+                m_stream = argv[++iarg];
+                continue;
+            }
+            else
+            {
+                my_printf(stderr, get_text(IDT_NEEDS_OPERAND), arg);
+                return RET_BAD_CMDLINE;
+            }
+        }
+
+        if (_wcsicmp(arg, L"-no-cache") == 0 || _wcsicmp(arg, L"--no-cache") == 0)
+        {
+            vsk_render_cache_enable(false);
+            continue;
+        }
+
         // hidden feature
         if (_wcsicmp(arg, L"-no-beep") == 0 || _wcsicmp(arg, L"--no-beep") == 0)
         {
@@ -543,6 +900,15 @@ RET CMD_SING::run(INT argc, wchar_t **argv)
         return RET_SUCCESS;
     }
 
+    if (m_batch.size()) // 一括保存か？
+        return run_batch();
+
+    if (m_replay.size()) // レジスタ書き込みの再生か？
+        return run_replay();
+
+    if (m_stream.size()) // 入力から続けて演奏するか？
+        return run_stream();
+
     if (!vsk_sound_init(m_stereo))
     {
         my_puts(get_text(IDT_SOUND_INIT_FAILED), stderr);
@@ -678,19 +1044,46 @@ static BOOL WINAPI HandlerRoutine(DWORD signal)
     return FALSE;
 }
 
+// 統計を集計するか？ レジストリの読み込みも計測したいので、コマンドラインの解析より先に調べる
+static bool wants_stats(int argc, wchar_t **argv)
+{
+    const wchar_t *env = _wgetenv(L"CMD_SING_STATS");
+    if (env && *env && wcscmp(env, L"0") != 0)
+        return true;
+
+    for (int iarg = 1; iarg < argc; ++iarg)
+    {
+        if (_wcsicmp(argv[iarg], L"-stats") == 0 || _wcsicmp(argv[iarg], L"--stats") == 0)
+            return true;
+    }
+
+    return false;
+}
+
 int wmain(int argc, wchar_t **argv)
 {
     SetConsoleCtrlHandler(HandlerRoutine, TRUE); // Ctrl+C
 
+    VskStats stats;
+    bool use_stats = wants_stats(argc, argv);
+    if (use_stats)
+        vsk_default_engine().m_stats = &stats;
+
     CMD_SING sing;
     sing.load_settings();
-    if (RET ret = sing.parse_cmd_line(argc, argv))
-    {
+    RET ret = sing.parse_cmd_line(argc, argv);
+    if (ret)
         do_beep();
-        return ret;
+    else
+        ret = sing.run(argc, argv);
+
+    if (use_stats)
+    {
+        stats.dump(vsk_default_engine(), stderr);
+        vsk_default_engine().m_stats = nullptr;
     }
 
-    return sing.run(argc, argv);
+    return ret;
 }
 
 #include <clocale>
@@ -8,28 +8,169 @@
     #include <cstdlib>
     #include <cassert>
     #include <cerrno>
+    #include <climits>
+    #include <ctime>
 #else
     #include <stdlib.h>
     #include <assert.h>
     #include <errno.h>
+    #include <limits.h>
+    #include <time.h>
 #endif
 
-#include <sys/time.h>   /* for struct timeval, timespec */
 #include <pthread.h>    /* for POSIX threads */
 
+#ifdef __linux__
+    #include <unistd.h>         /* for syscall */
+    #include <sys/syscall.h>    /* for SYS_futex */
+    #include <linux/futex.h>    /* for FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE */
+    #define PE_USE_FUTEX
+#endif
+
 #include "pevent.h"
 
 /*--------------------------------------------------------------------------*/
 /* internal type */
 
+/*
+ * The state of an event is guarded by m_lock, whose critical sections are
+ * only a few instructions long.  Waiters do not sleep on the lock but on
+ * m_generation, which pe_set_event and pe_pulse_event advance before they
+ * wake them.  On Linux the sleep is a futex wait on that word; elsewhere a
+ * condition variable is used.  Polls and waits on an already signaled
+ * event take no lock at all.
+ *
+ * A pulse hands out releases to the threads waiting at that moment: all of
+ * them for a manual-reset event, one of them for an auto-reset event.  Only
+ * a thread that started waiting before the latest pulse can take one, so
+ * a pulse is neither lost nor stolen by a thread that arrives later.
+ */
 typedef struct pe_event_impl_t
 {
-    pthread_cond_t      m_condition;
     pthread_mutex_t     m_lock;
-    bool                m_signaled;
+#ifndef PE_USE_FUTEX
+    pthread_cond_t      m_condition;
+#endif
+    uint32_t            m_generation;       /* advanced to wake the waiters */
+    uint32_t            m_signaled;         /* 1 if signaled */
+    uint32_t            m_waiters;          /* number of sleeping threads */
+    uint32_t            m_releases;         /* releases not taken yet */
+    uint32_t            m_pulse_generation; /* m_generation of the latest pulse */
     bool                m_auto_reset;
 } pe_event_impl_t;
 
+/*--------------------------------------------------------------------------*/
+/* internal functions */
+
+#define pe_load(ptr)            __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define pe_store(ptr, value)    __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+
+#ifdef PE_USE_FUTEX
+    #define PE_CLOCK    CLOCK_MONOTONIC
+#else
+    #define PE_CLOCK    CLOCK_REALTIME  /* pthread_cond_timedwait's clock */
+#endif
+
+static const long pe_giga = 1000 * 1000 * 1000;
+
+static void pe_lock(pe_event_impl_t *e)
+{
+    int result = pthread_mutex_lock(&e->m_lock);
+    assert(result == 0);
+    result = result;
+} /* pe_lock */
+
+static void pe_unlock(pe_event_impl_t *e)
+{
+    int result = pthread_mutex_unlock(&e->m_lock);
+    assert(result == 0);
+    result = result;
+} /* pe_unlock */
+
+/* takes the signaled state without blocking. returns true if signaled. */
+static bool pe_try_take(pe_event_impl_t *e)
+{
+    uint32_t expected = 1;
+
+    if (!e->m_auto_reset)
+        return pe_load(&e->m_signaled) != 0;
+
+    return __atomic_compare_exchange_n(&e->m_signaled, &expected, 0, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+} /* pe_try_take */
+
+/* takes a release of a pulse. the lock must be held. */
+static bool pe_take_release(pe_event_impl_t *e, uint32_t generation)
+{
+    if (e->m_releases == 0)
+        return false;
+
+    /* did this thread start waiting before the latest pulse? */
+    if ((int32_t)(e->m_pulse_generation - generation) <= 0)
+        return false;
+
+    --e->m_releases;
+    return true;
+} /* pe_take_release */
+
+/* sleeps while m_generation is generation. the lock must be held.
+   returns false if the deadline has passed. */
+static bool pe_sleep(pe_event_impl_t *e, uint32_t generation,
+                     const struct timespec *deadline)
+{
+#ifdef PE_USE_FUTEX
+    struct timespec now, rel, *prel = NULL;
+    long result;
+
+    if (deadline != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        rel.tv_sec = deadline->tv_sec - now.tv_sec;
+        rel.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if (rel.tv_nsec < 0) {
+            rel.tv_nsec += pe_giga;
+            --rel.tv_sec;
+        }
+        if (rel.tv_sec < 0)
+            return false;
+        prel = &rel;
+    }
+
+    pe_unlock(e);
+    /* returns at once if m_generation has already moved on */
+    result = syscall(SYS_futex, &e->m_generation, FUTEX_WAIT_PRIVATE,
+                     generation, prel, NULL, 0);
+    pe_lock(e);
+
+    return !(result == -1 && errno == ETIMEDOUT);
+#else
+    int result;
+
+    if (deadline != NULL)
+        result = pthread_cond_timedwait(&e->m_condition, &e->m_lock, deadline);
+    else
+        result = pthread_cond_wait(&e->m_condition, &e->m_lock);
+
+    return result != ETIMEDOUT;
+#endif
+} /* pe_sleep */
+
+/* wakes the sleeping threads. call it after unlocking. */
+static void pe_wake(pe_event_impl_t *e, bool wake_one)
+{
+#ifdef PE_USE_FUTEX
+    syscall(SYS_futex, &e->m_generation, FUTEX_WAKE_PRIVATE,
+            (wake_one ? 1 : INT_MAX), NULL, NULL, 0);
+#else
+    int result;
+    if (wake_one)
+        result = pthread_cond_signal(&e->m_condition);
+    else
+        result = pthread_cond_broadcast(&e->m_condition);
+    assert(result == 0);
+    result = result;
+#endif
+} /* pe_wake */
+
 /*--------------------------------------------------------------------------*/
 /* the definitions of C functions */
 
@@ -45,105 +186,79 @@ pe_event_t pe_create_event(bool manual_reset, bool initial_state)
 
     e = (pe_event_impl_t *)malloc(sizeof(pe_event_impl_t));
     if (e != NULL) {
-        result = pthread_cond_init(&e->m_condition, 0);
+        result = pthread_mutex_init(&e->m_lock, 0);
         assert(result == 0);
         result = result;
 
-        result = pthread_mutex_init(&e->m_lock, 0);
+#ifndef PE_USE_FUTEX
+        result = pthread_cond_init(&e->m_condition, 0);
         assert(result == 0);
         result = result;
+#endif
 
-        e->m_signaled = false;
+        e->m_generation = 0;
+        e->m_signaled = (initial_state ? 1 : 0);
+        e->m_waiters = 0;
+        e->m_releases = 0;
+        e->m_pulse_generation = 0;
         e->m_auto_reset = !manual_reset;
 
-        if (initial_state) {
-            bool ret = pe_set_event((pe_event_t)e);
-            assert(ret);
-            ret = ret;
-        }
         event = (pe_event_t)e;
     }
 
     return event;
 } /* pe_create_event */
 
-bool pe_unlocked_wait(pe_event_t event, uint32_t milliseconds)
+bool pe_wait_for_event(pe_event_t event, uint32_t milliseconds)
 {
-    bool timeout;
-    int result;
+    bool signaled;
+    uint32_t generation;
     pe_event_impl_t *e;
-    struct timespec ts;
-    struct timeval tv;
-    uint64_t nanoseconds;
-    const uint64_t kilo = 1000;
-    const uint64_t mega = 1000 * 1000;
-    const uint64_t giga = 1000 * 1000 * 1000;
+    struct timespec ts, *deadline = NULL;
 
     e = (pe_event_impl_t *)event;
 
-    if (e->m_signaled) {
-        if (e->m_auto_reset) {
-            e->m_signaled = false;
-        }
-        timeout = false;
-    } else {
-        if (milliseconds != (uint32_t)(-1)) {
-            gettimeofday(&tv, NULL);
-
-            nanoseconds =
-                (tv.tv_sec * giga) +
-                (milliseconds * mega) +
-                (tv.tv_usec * kilo);
-
-            ts.tv_sec = nanoseconds / giga;
-            ts.tv_nsec = nanoseconds % giga;
-
-            do {
-                result = pthread_cond_timedwait(&e->m_condition, &e->m_lock, &ts);
-            } while ((result == 0) && !e->m_signaled);
-        } else {
-            do {
-                result = pthread_cond_wait(&e->m_condition, &e->m_lock);
-            } while ((result == 0) && !e->m_signaled);
-        }
-
-        timeout = (result == ETIMEDOUT);
-        if (result == 0) {
-            if (e->m_auto_reset) {
-                e->m_signaled = false;
-            }
+    /* a poll or an already signaled event takes no lock */
+    if (pe_try_take(e))
+        return false;
+    if (milliseconds == 0)
+        return true;
+
+    if (milliseconds != (uint32_t)(-1)) {
+        clock_gettime(PE_CLOCK, &ts);
+        ts.tv_sec += milliseconds / 1000;
+        ts.tv_nsec += (long)(milliseconds % 1000) * 1000 * 1000;
+        if (ts.tv_nsec >= pe_giga) {
+            ts.tv_nsec -= pe_giga;
+            ++ts.tv_sec;
         }
+        deadline = &ts;
     }
 
-    return timeout;
-} /* pe_unlocked_wait */
-
-bool pe_wait_for_event(pe_event_t event, uint32_t milliseconds)
-{
-    bool timeout;
-    int result;
-    pe_event_impl_t *e;
-
-    e = (pe_event_impl_t *)event;
-
-    if (milliseconds > 0) {
-        result = pthread_mutex_lock(&e->m_lock);
-    } else {
-        result = pthread_mutex_trylock(&e->m_lock);
-        if (result == EBUSY) {
-            return true;
+    pe_lock(e);
+    ++e->m_waiters;
+    generation = e->m_generation;
+    for (;;) {
+        if (pe_try_take(e)) {
+            signaled = true;
+            break;
         }
+        if (!pe_sleep(e, generation, deadline)) {
+            /* a pulse that came before the timeout still counts */
+            signaled = pe_take_release(e, generation) || pe_try_take(e);
+            break;
+        }
+        if (pe_take_release(e, generation)) {
+            signaled = true;
+            break;
+        }
+        /* woken for another thread or for nothing; wait for the next one */
+        generation = e->m_generation;
     }
-    assert(result == 0);
-    result = result;
-
-    timeout = pe_unlocked_wait((pe_event_t)e, milliseconds);
-
-    result = pthread_mutex_unlock(&e->m_lock);
-    assert(result == 0);
-    result = result;
+    --e->m_waiters;
+    pe_unlock(e);
 
-    return timeout;
+    return !signaled;
 } /* pe_wait_for_event */
 
 bool pe_close_event(pe_event_t event)
@@ -153,9 +268,11 @@ bool pe_close_event(pe_event_t event)
 
     e = (pe_event_impl_t *)event;
 
+#ifndef PE_USE_FUTEX
     result = pthread_cond_destroy(&e->m_condition);
     assert(result == 0);
     result = result;
+#endif
 
     result = pthread_mutex_destroy(&e->m_lock);
     assert(result == 0);
@@ -168,36 +285,24 @@ bool pe_close_event(pe_event_t event)
 
 bool pe_set_event(pe_event_t event)
 {
-    int result;
+    bool wake_one;
+    uint32_t waiters;
     pe_event_impl_t *e;
 
     e = (pe_event_impl_t *)event;
 
-    result = pthread_mutex_lock(&e->m_lock);
-    assert(result == 0);
-    result = result;
-
-    e->m_signaled = true;
+    pe_lock(e);
+    pe_store(&e->m_signaled, 1);
+    waiters = e->m_waiters;
+    if (waiters > 0)
+        pe_store(&e->m_generation, e->m_generation + 1);
+    /* any one waiter can take an auto-reset event, unless a pulse is
+       being handed out, in which case the waiters must sort it out */
+    wake_one = (e->m_auto_reset && e->m_releases == 0);
+    pe_unlock(e);
 
-    if (e->m_auto_reset) {
-        if (e->m_signaled) {
-            result = pthread_mutex_unlock(&e->m_lock);
-            assert(result == 0);
-            result = result;
-
-            result = pthread_cond_signal(&e->m_condition);
-            assert(result == 0);
-            result = result;
-        }
-    } else {
-        result = pthread_mutex_unlock(&e->m_lock);
-        assert(result == 0);
-        result = result;
-
-        result = pthread_cond_broadcast(&e->m_condition);
-        assert(result == 0);
-        result = result;
-    }
+    if (waiters > 0)
+        pe_wake(e, wake_one);
 
     return true;
 } /* pe_set_event */
@@ -206,28 +311,34 @@ bool pe_reset_event(pe_event_t event)
 {
     pe_event_impl_t *e = (pe_event_impl_t *)event;
 
-    int result = pthread_mutex_lock(&e->m_lock);
-    assert(result == 0);
-    result = result;
-
-    e->m_signaled = false;
-
-    result = pthread_mutex_unlock(&e->m_lock);
-    assert(result == 0);
-    result = result;
+    pe_store(&e->m_signaled, 0);
 
     return true;
 } /* pe_reset_event */
 
 bool pe_pulse_event(pe_event_t event)
 {
-    bool ret = pe_set_event(event);
-    assert(ret);
-    ret = ret;
+    uint32_t waiters;
+    pe_event_impl_t *e;
+
+    e = (pe_event_impl_t *)event;
+
+    pe_lock(e);
+    waiters = e->m_waiters;
+    if (waiters > 0) {
+        /* release the threads waiting now, and nobody else */
+        if (!e->m_auto_reset)
+            e->m_releases = waiters;
+        else if (e->m_releases < waiters)
+            ++e->m_releases;
+        pe_store(&e->m_generation, e->m_generation + 1);
+        e->m_pulse_generation = e->m_generation;
+    }
+    pe_store(&e->m_signaled, 0);
+    pe_unlock(e);
 
-    ret = pe_reset_event(event);
-    assert(ret);
-    ret = ret;
+    if (waiters > 0)
+        pe_wake(e, false);
 
     return true;
 } /* pe_pulse_event */
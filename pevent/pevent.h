@@ -68,6 +68,8 @@ pe_event_t pe_create_event(bool manual_reset   pe_optional(false),
 bool pe_close_event(pe_event_t event);
 bool pe_set_event(pe_event_t event);
 bool pe_reset_event(pe_event_t event);
+/* NOTE: pulse_event() releases the threads waiting at that moment (all of
+         them if manual reset, one if auto reset) and leaves the event reset. */
 bool pe_pulse_event(pe_event_t event);
 /* NOTE: wait_for_event() returns true if timeout. */
 bool pe_wait_for_event(pe_event_t event, uint32_t milliseconds pe_optional(-1));
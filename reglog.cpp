@@ -0,0 +1,444 @@
+﻿//////////////////////////////////////////////////////////////////////////////
+// reglog --- records register writes of YM2203 and exports VGM / S98
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "reglog.h"
+#include "soundplayer.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+
+#define VSK_VGM_RATE 44100  // VGMのサンプルレート (Hz)
+
+//////////////////////////////////////////////////////////////////////////////
+// VskRegLog - レジスタ書き込みの記録
+
+// 音源の書き込みを記録し始める
+void VskRegLog::attach(YM2203& ym0, YM2203& ym1)
+{
+    ym0.set_write_hook(write_hook_0, this);
+    ym1.set_write_hook(write_hook_1, this);
+}
+
+// 記録をやめる
+void VskRegLog::detach(YM2203& ym0, YM2203& ym1)
+{
+    ym0.set_write_hook(NULL, NULL);
+    ym1.set_write_hook(NULL, NULL);
+}
+
+// SSGの三つのチャンネルが共有するレジスタの番号。共有しなければ-1
+static int vsk_shared_ssg_index(uint32_t addr)
+{
+    switch (addr) {
+    case ADDR_SSG_NOISE_FREQ:   return 0;
+    case ADDR_SSG_ENV_FREQ_L:   return 1;
+    case ADDR_SSG_ENV_FREQ_H:   return 2;
+    case ADDR_SSG_ENV_TYPE:     return 3;
+    default:                    return -1;
+    }
+}
+
+void VskRegLog::add(int chip, uint32_t addr, uint32_t data)
+{
+    // YM2203にないポート1のレジスタは記録しない
+    if (addr > 0xFF)
+        return;
+
+    // フレーズが共有レジスタに書き込んだら覚えておく
+    int ishared = vsk_shared_ssg_index(addr);
+    if (m_phrase >= 0 && ishared >= 0) {
+        SharedWriter& writer = m_shared[chip][ishared];
+        if (writer.m_phrase < 0) {
+            writer.m_phrase = m_phrase;
+            writer.m_data = uint8_t(data);
+        } else {
+            if (writer.m_phrase != m_phrase)
+                writer.m_others = true;
+            if (writer.m_data != uint8_t(data))
+                writer.m_varied = true;
+        }
+    }
+
+    VskRegLogEvent event;
+    event.m_isample = m_base + m_now;
+    event.m_chip = uint8_t(chip);
+    event.m_addr = uint8_t(addr);
+    event.m_data = uint8_t(data);
+    event.m_ssg_channel = int8_t(m_ssg_channel);
+    m_events.push_back(event);
+}
+
+// ブロックを実現し終えた
+void VskRegLog::end_block(uint32_t num_samples)
+{
+    // 別々のフレーズが共有レジスタに違う値を書き込んだら、書き込みの順序で音が変わる。
+    // エンベロープの形の書き込みは、同じ値でもエンベロープを最初からやり直す
+    for (int chip = 0; chip < 2; ++chip) {
+        for (int ishared = 0; ishared < 4; ++ishared) {
+            SharedWriter& writer = m_shared[chip][ishared];
+            if (writer.m_others && (writer.m_varied || ishared == 3))
+                m_conflict = true;
+            writer = SharedWriter();
+        }
+    }
+
+    m_base += num_samples;
+    m_now = 0;
+}
+
+/*static*/ void VskRegLog::write_hook_0(void *user, uint32_t addr, uint32_t data)
+{
+    reinterpret_cast<VskRegLog *>(user)->add(0, addr, data);
+}
+
+/*static*/ void VskRegLog::write_hook_1(void *user, uint32_t addr, uint32_t data)
+{
+    reinterpret_cast<VskRegLog *>(user)->add(1, addr, data);
+}
+
+// 時刻順に並べ、音源ごとのSSGミキサーの値を合成した書き込み列を取得する
+void VskRegLog::get_stream(std::vector<VskRegLogEvent>& stream, bool& dual) const
+{
+    stream = m_events;
+    std::stable_sort(stream.begin(), stream.end(),
+        [](const VskRegLogEvent& a, const VskRegLogEvent& b) {
+            return a.m_isample < b.m_isample;
+        }
+    );
+
+    dual = false;
+    for (auto& event : stream) {
+        if (event.m_chip == 1) {
+            dual = true;
+            break;
+        }
+    }
+
+    // SSGのフレーズは自分のチャンネルのビットだけをミキサーに書いたことにする。
+    // フレーズは別々に実現されるので、他のチャンネルのビットは当てにならない
+    uint8_t mixing[2] = { 0x3F, 0x3F }; // YM2203::init が書く値
+    for (auto& event : stream) {
+        if (event.m_addr != ADDR_SSG_MIXING)
+            continue;
+        uint8_t& value = mixing[event.m_chip];
+        if (event.m_ssg_channel >= 0) {
+            uint8_t mask = uint8_t(0x09 << event.m_ssg_channel);
+            value = uint8_t((value & ~mask) | (event.m_data & mask));
+        } else {
+            value = event.m_data;
+        }
+        event.m_data = value;
+    }
+
+    // 音源の初期状態
+    VskRegLogEvent init = { 0, 0, ADDR_SSG_MIXING, 0x3F, -1 };
+    stream.insert(stream.begin(), init);
+    if (dual) {
+        init.m_chip = 1;
+        stream.insert(stream.begin() + 1, init);
+    }
+}
+
+static void vsk_put_le32(std::vector<uint8_t>& data, size_t offset, uint32_t value)
+{
+    data[offset + 0] = uint8_t(value);
+    data[offset + 1] = uint8_t(value >> 8);
+    data[offset + 2] = uint8_t(value >> 16);
+    data[offset + 3] = uint8_t(value >> 24);
+}
+
+static bool vsk_save_binary(const wchar_t *filename, const std::vector<uint8_t>& data)
+{
+    FILE *fout = _wfopen(filename, L"wb");
+    if (!fout)
+        return false;
+    bool ok = (std::fwrite(data.data(), data.size(), 1, fout) == 1);
+    std::fclose(fout);
+    return ok;
+}
+
+// VGM 1.51 の待機コマンドを追加する
+static void vsk_vgm_wait(std::vector<uint8_t>& data, uint32_t nsamples)
+{
+    while (nsamples > 0) {
+        if (nsamples == 735) {
+            data.push_back(0x62); // 1/60秒
+            return;
+        }
+        if (nsamples == 882) {
+            data.push_back(0x63); // 1/50秒
+            return;
+        }
+        if (nsamples <= 16) {
+            data.push_back(uint8_t(0x70 + nsamples - 1));
+            return;
+        }
+        uint32_t n = std::min<uint32_t>(nsamples, 0xFFFF);
+        data.push_back(0x61);
+        data.push_back(uint8_t(n));
+        data.push_back(uint8_t(n >> 8));
+        nsamples -= n;
+    }
+}
+
+// VGM 1.51 のバイト列を作る。clockはYM2203のクロック
+void VskRegLog::get_vgm(std::vector<uint8_t>& data, uint32_t clock) const
+{
+    std::vector<VskRegLogEvent> stream;
+    bool dual;
+    get_stream(stream, dual);
+
+    const size_t header_size = 0x80;
+    data.assign(header_size, 0);
+
+    // コマンド列
+    uint32_t isample = 0;
+    for (auto& event : stream) {
+        vsk_vgm_wait(data, event.m_isample - isample);
+        isample = event.m_isample;
+        data.push_back(event.m_chip ? 0xA5 : 0x55); // YM2203 #0 / #1
+        data.push_back(event.m_addr);
+        data.push_back(event.m_data);
+    }
+    uint32_t total = std::max(m_base, isample);
+    vsk_vgm_wait(data, total - isample);
+    data.push_back(0x66); // 終わり
+
+    // ヘッダー
+    std::memcpy(&data[0x00], "Vgm ", 4);
+    vsk_put_le32(data, 0x04, uint32_t(data.size() - 0x04));     // EOF offset
+    vsk_put_le32(data, 0x08, 0x00000151);                       // version
+    vsk_put_le32(data, 0x18, total);                            // total # samples
+    vsk_put_le32(data, 0x34, uint32_t(header_size - 0x34));     // VGM data offset
+    vsk_put_le32(data, 0x44, clock | (dual ? 0x40000000 : 0));  // YM2203 clock (bit 30: dual)
+}
+
+// VGM 1.51 として保存する。clockはYM2203のクロック
+bool VskRegLog::save_as_vgm(const wchar_t *filename, uint32_t clock) const
+{
+    std::vector<uint8_t> data;
+    get_vgm(data, clock);
+    return vsk_save_binary(filename, data);
+}
+
+// S98 の待機コマンドを追加する
+static void vsk_s98_wait(std::vector<uint8_t>& data, uint32_t nsync)
+{
+    if (nsync == 0)
+        return;
+    if (nsync == 1) {
+        data.push_back(0xFF);
+        return;
+    }
+    // 0xFE のあとに (nsync - 2) を7ビットずつ可変長で書く
+    data.push_back(0xFE);
+    uint32_t n = nsync - 2;
+    for (;;) {
+        uint8_t byte = uint8_t(n & 0x7F);
+        n >>= 7;
+        if (n) {
+            data.push_back(byte | 0x80);
+        } else {
+            data.push_back(byte);
+            break;
+        }
+    }
+}
+
+// S98 v3 として保存する。clockはYM2203のクロック
+bool VskRegLog::save_as_s98(const wchar_t *filename, uint32_t clock) const
+{
+    std::vector<VskRegLogEvent> stream;
+    bool dual;
+    get_stream(stream, dual);
+
+    const uint32_t num_devices = (dual ? 2 : 1);
+    const size_t header_size = 0x20 + 0x10 * num_devices;
+    std::vector<uint8_t> data(header_size, 0);
+
+    // ヘッダー。一同期は 1/44100 秒
+    std::memcpy(&data[0x00], "S983", 4);
+    vsk_put_le32(data, 0x04, 1);                        // timer info (numerator)
+    vsk_put_le32(data, 0x08, VSK_VGM_RATE);             // timer info 2 (denominator)
+    vsk_put_le32(data, 0x14, uint32_t(header_size));    // offset to dump data
+    vsk_put_le32(data, 0x1C, num_devices);              // device count
+    for (uint32_t i = 0; i < num_devices; ++i) {
+        vsk_put_le32(data, 0x20 + 0x10 * i + 0x0, 2);   // device type: OPN (YM2203)
+        vsk_put_le32(data, 0x20 + 0x10 * i + 0x4, clock);
+    }
+
+    // コマンド列
+    uint32_t isample = 0;
+    for (auto& event : stream) {
+        vsk_s98_wait(data, event.m_isample - isample);
+        isample = event.m_isample;
+        data.push_back(uint8_t(event.m_chip * 2));
+        data.push_back(event.m_addr);
+        data.push_back(event.m_data);
+    }
+    vsk_s98_wait(data, std::max(m_base, isample) - isample);
+    data.push_back(0xFD); // 終わり
+
+    return vsk_save_binary(filename, data);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// VGMの再生
+
+static uint32_t vsk_get_le32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (uint32_t(data[3]) << 24);
+}
+
+// 音源を進めて、nsamples個のサンプルを出力先に書き込む
+static bool vsk_replay_mix(YM2203& ym0, YM2203 *ym1, uint32_t nsamples, VskPcmSink& sink, bool stereo,
+                           std::vector<VSK_SAMPLE_VALUE> (&buffers)[2], std::vector<int32_t>& out)
+{
+    // s16でなければ、16ビットに収める前の値を渡す
+    const bool wide = (sink.get_format() != VSK_SAMPLE_FORMAT_S16);
+    const uint32_t unit = 4096;
+    while (nsamples > 0) {
+        uint32_t n = std::min(nsamples, unit);
+        nsamples -= n;
+
+        buffers[0].assign(n * 2, 0);
+        ym0.mix(buffers[0].data(), int(n));
+        if (ym1) {
+            buffers[1].assign(n * 2, 0);
+            ym1->mix(buffers[1].data(), int(n));
+        }
+
+        // 足し合わせて16ビットに収める（s16のときだけ）。モノラルなら左右の平均を取る
+        out.resize(stereo ? n * 2 : n);
+        int32_t prev_value = 0;
+        for (uint32_t i = 0; i < n * 2; ++i) {
+            int32_t value = buffers[0][i];
+            if (ym1)
+                value += buffers[1][i];
+            if (!wide) {
+                if (value < -32768)
+                    value = -32768;
+                else if (value > 32767)
+                    value = 32767;
+            }
+            if (stereo)
+                out[i] = value;
+            else if (i & 1)
+                out[i >> 1] = (prev_value + value) >> 1;
+            else
+                prev_value = value;
+        }
+
+        if (!sink.write_mix(out.data(), out.size()))
+            return false;
+    }
+    return true;
+}
+
+// VGMのレジスタ書き込みを音源へ直接流して、波形を出力先に書き込む
+bool vsk_replay_vgm(const uint8_t *data, size_t size, VskPcmSink& sink, bool stereo,
+                    uint64_t *pnum_samples)
+{
+    if (pnum_samples)
+        *pnum_samples = 0;
+
+    // ヘッダーを確認する
+    if (size < 0x48 || std::memcmp(data, "Vgm ", 4) != 0)
+        return false;
+    uint32_t version = vsk_get_le32(&data[0x08]);
+    uint32_t clock = vsk_get_le32(&data[0x44]);
+    bool dual = !!(clock & 0x40000000);
+    clock &= 0x3FFFFFFF;
+    if (version < 0x151 || clock == 0)
+        return false; // YM2203を使っていない
+    size_t offset = vsk_get_le32(&data[0x34]);
+    size_t pos = (offset ? 0x34 + offset : 0x40);
+    if (pos > size)
+        return false;
+
+    // OPNAは倍のクロックでYM2203と同じ音程になる
+    std::unique_ptr<YM2203> ym0(new YM2203()), ym1;
+    ym0->init(clock * 2, VSK_VGM_RATE, NULL);
+    if (dual) {
+        ym1.reset(new YM2203());
+        ym1->init(clock * 2, VSK_VGM_RATE, NULL);
+    }
+
+    std::vector<VSK_SAMPLE_VALUE> buffers[2];
+    std::vector<int32_t> out;
+    uint64_t num_samples = 0;
+    auto wait = [&](uint32_t nsamples) {
+        num_samples += nsamples;
+        return vsk_replay_mix(*ym0, ym1.get(), nsamples, sink, stereo, buffers, out);
+    };
+
+    while (pos < size) {
+        uint8_t cmd = data[pos++];
+        size_t operands;
+        if (cmd == 0x66) { // 終わり
+            if (pnum_samples)
+                *pnum_samples = num_samples;
+            return true;
+        }
+
+        if (cmd == 0x55 || cmd == 0xA5) { // YM2203 #0 / #1
+            if (pos + 2 > size)
+                return false;
+            YM2203 *ym = (cmd == 0x55 ? ym0.get() : ym1.get());
+            if (ym)
+                ym->write_reg(data[pos], data[pos + 1]);
+            pos += 2;
+            continue;
+        }
+
+        if (cmd == 0x61) { // nnnnサンプル待つ
+            if (pos + 2 > size)
+                return false;
+            if (!wait(data[pos] | (data[pos + 1] << 8)))
+                return false;
+            pos += 2;
+            continue;
+        }
+        if (cmd == 0x62 || cmd == 0x63) { // 1/60秒か1/50秒待つ
+            if (!wait(cmd == 0x62 ? 735 : 882))
+                return false;
+            continue;
+        }
+        if ((cmd & 0xF0) == 0x70 || (cmd & 0xF0) == 0x80) { // n+1サンプルかnサンプル待つ
+            uint32_t n = (cmd & 0x0F) + ((cmd & 0xF0) == 0x70 ? 1 : 0);
+            if (!wait(n))
+                return false;
+            continue;
+        }
+        if (cmd == 0x67) { // データブロックは読み飛ばす
+            if (pos + 6 > size)
+                return false;
+            pos += 6 + vsk_get_le32(&data[pos + 2]);
+            continue;
+        }
+
+        // 他の音源のコマンドは読み飛ばす
+        if (0x30 <= cmd && cmd <= 0x3F)
+            operands = 1;
+        else if (0x40 <= cmd && cmd <= 0x4E)
+            operands = 2;
+        else if (cmd == 0x4F || cmd == 0x50)
+            operands = 1;
+        else if (0x51 <= cmd && cmd <= 0x5F)
+            operands = 2;
+        else if (0xA0 <= cmd && cmd <= 0xBF)
+            operands = 2;
+        else if (0xC0 <= cmd && cmd <= 0xDF)
+            operands = 3;
+        else if (0xE0 <= cmd)
+            operands = 4;
+        else
+            return false; // 未知のコマンド
+        pos += operands;
+    }
+
+    return false; // 終わりがない
+}
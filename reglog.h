@@ -0,0 +1,100 @@
+//////////////////////////////////////////////////////////////////////////////
+// reglog --- records register writes of YM2203 and exports VGM / S98
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+struct YM2203;
+struct VskPcmSink;
+
+//////////////////////////////////////////////////////////////////////////////
+// VskRegLogEvent - 時刻つきのレジスタ書き込み
+
+struct VskRegLogEvent {
+    uint32_t    m_isample;      // サンプル位置 (44100Hz)
+    uint8_t     m_chip;         // 音源 #0 か #1 か
+    uint8_t     m_addr;         // レジスタのアドレス
+    uint8_t     m_data;         // 書き込んだ値
+    int8_t      m_ssg_channel;  // SSGのフレーズのチャンネル（ミキサーの合成用）。なければ-1
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// VskRegLog - レジスタ書き込みの記録
+//
+// サウンドプレーヤーの m_recorder に設定すると、波形を実現する間の
+// 音源 #0, #1 へのレジスタ書き込みをサンプル位置つきで記録する。
+// フレーズは一つずつ実現されるので、書き出すときに時刻順に並べ直す。
+// 記録を始める前の音源の状態は含まれない（初期状態から始めること）。
+// SSGの三つのチャンネルが共有するノイズ周期とエンベロープのレジスタに
+// 同じブロックの別々のフレーズが食い違う書き込みをすると、時刻順に並べた書き込みは
+// 波形を描画したときと違う音になるので、m_conflict を立てる。
+// 音色のLFOは音源の中でかかり、レジスタの書き込みにならないので、使えば m_lfo を立てる。
+
+class VskRegLog {
+public:
+    std::vector<VskRegLogEvent> m_events;           // 記録した書き込み
+    uint32_t                    m_base = 0;         // 前のブロックまでのサンプル数
+    uint32_t                    m_now = 0;          // ブロック内の現在のサンプル位置
+    int                         m_ssg_channel = -1; // 実現中のSSGのフレーズのチャンネル
+    int                         m_phrase = -1;      // 実現中のフレーズの番号。なければ-1
+    int                         m_num_phrases = 0;  // 実現し始めたフレーズの数
+    bool                        m_conflict = false; // SSGの共有レジスタの書き込みが食い違ったか？
+    bool                        m_lfo = false;      // 音色のLFOを使ったか？
+
+    VskRegLog() { }
+
+    // フレーズを実現し始める / 実現し終えた
+    void begin_phrase(int ssg_channel) {
+        m_now = 0;
+        m_ssg_channel = ssg_channel;
+        m_phrase = m_num_phrases++;
+    }
+    void end_phrase() {
+        m_ssg_channel = -1;
+        m_phrase = -1;
+    }
+
+    // 音源の書き込みを記録し始める / 記録をやめる
+    void attach(YM2203& ym0, YM2203& ym1);
+    void detach(YM2203& ym0, YM2203& ym1);
+
+    // ブロックを実現し終えた
+    void end_block(uint32_t num_samples);
+
+    // 時刻順に並べ、音源ごとのSSGミキサーの値を合成した書き込み列を取得する
+    void get_stream(std::vector<VskRegLogEvent>& stream, bool& dual) const;
+
+    void get_vgm(std::vector<uint8_t>& data, uint32_t clock) const;
+    bool save_as_vgm(const wchar_t *filename, uint32_t clock) const;
+    bool save_as_s98(const wchar_t *filename, uint32_t clock) const;
+
+protected:
+    // ブロック内でSSGの共有レジスタに書き込んだフレーズ
+    struct SharedWriter {
+        int         m_phrase = -1;      // 最初に書き込んだフレーズ。なければ-1
+        uint8_t     m_data = 0;         // 最初に書き込んだ値
+        bool        m_others = false;   // 他のフレーズも書き込んだか？
+        bool        m_varied = false;   // 違う値が書き込まれたか？
+    };
+    SharedWriter                m_shared[2][4];     // 音源ごと、共有レジスタごと
+
+    void add(int chip, uint32_t addr, uint32_t data);
+    static void write_hook_0(void *user, uint32_t addr, uint32_t data);
+    static void write_hook_1(void *user, uint32_t addr, uint32_t data);
+}; // class VskRegLog
+
+//////////////////////////////////////////////////////////////////////////////
+// VGMの再生
+//
+// 記録したレジスタ書き込みを、MMLやフレーズを介さずに新しい音源へ直接流し、
+// 待機のたびに波形を少しずつ出力先に書き込む。YM2203以外のコマンドは読み飛ばす。
+
+bool vsk_replay_vgm(const uint8_t *data, size_t size, VskPcmSink& sink, bool stereo,
+                    uint64_t *pnum_samples = nullptr);
+
+//////////////////////////////////////////////////////////////////////////////
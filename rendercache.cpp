@@ -0,0 +1,513 @@
+﻿//////////////////////////////////////////////////////////////////////////////
+// rendercache --- a content-addressed on-disk cache of rendered PCM
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "rendercache.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/types.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <dirent.h>
+    #include <time.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// VskSha256
+
+static const uint32_t s_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t sha256_rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+VskSha256::VskSha256() {
+    m_state[0] = 0x6a09e667;
+    m_state[1] = 0xbb67ae85;
+    m_state[2] = 0x3c6ef372;
+    m_state[3] = 0xa54ff53a;
+    m_state[4] = 0x510e527f;
+    m_state[5] = 0x9b05688c;
+    m_state[6] = 0x1f83d9ab;
+    m_state[7] = 0x5be0cd19;
+    m_total = 0;
+    m_used = 0;
+}
+
+void VskSha256::transform(const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t(block[i * 4 + 0]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) |
+               (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t S1 = sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + S1 + ch + s_sha256_k[i] + w[i];
+        uint32_t S0 = sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = S0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+    m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+}
+
+void VskSha256::update(const void *data, size_t size) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+    m_total += size;
+    while (size) {
+        size_t n = sizeof(m_block) - m_used;
+        if (n > size)
+            n = size;
+        std::memcpy(&m_block[m_used], bytes, n);
+        m_used += n;
+        bytes += n;
+        size -= n;
+        if (m_used == sizeof(m_block)) {
+            transform(m_block);
+            m_used = 0;
+        }
+    }
+}
+
+std::string VskSha256::finish() {
+    uint64_t bits = m_total * 8;
+    static const uint8_t pad = 0x80, zero = 0;
+    update(&pad, 1);
+    while (m_used != 56)
+        update(&zero, 1);
+    uint8_t length[8];
+    for (int i = 0; i < 8; ++i)
+        length[i] = uint8_t(bits >> (56 - i * 8));
+    update(length, 8);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string ret;
+    for (int i = 0; i < 8; ++i) {
+        for (int k = 28; k >= 0; k -= 4)
+            ret += hex[(m_state[i] >> k) & 0xF];
+    }
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// キャッシュファイルの形式
+
+#define VSK_RENDER_CACHE_MAGIC "VSKPCM1" // 8バイト（ヌル文字を含む）
+
+struct VskRenderCacheHeader {
+    char        m_magic[8];     // VSK_RENDER_CACHE_MAGIC
+    uint64_t    m_count;        // PCMデータの個数
+};
+
+// キャッシュを有効にするか？
+static bool s_render_cache_enabled = true;
+
+void vsk_render_cache_enable(bool enable)
+{
+    s_render_cache_enabled = enable;
+}
+
+bool vsk_render_cache_is_enabled(void)
+{
+    return s_render_cache_enabled;
+}
+
+// ヘッダーとサイズを検証する
+static bool vsk_render_cache_check(const void *base, uint64_t file_size)
+{
+    if (file_size < sizeof(VskRenderCacheHeader))
+        return false;
+    auto header = reinterpret_cast<const VskRenderCacheHeader *>(base);
+    if (std::memcmp(header->m_magic, VSK_RENDER_CACHE_MAGIC, sizeof(header->m_magic)) != 0)
+        return false;
+    return sizeof(VskRenderCacheHeader) + header->m_count * sizeof(int16_t) == file_size;
+}
+
+// キャッシュファイルの項目（LRU用）
+struct VskRenderCacheEntry {
+    uint64_t    m_time;     // 最終アクセス時刻
+    uint64_t    m_size;     // ファイルサイズ
+#ifdef _WIN32
+    std::wstring m_path;
+#else
+    std::string  m_path;
+#endif
+
+    bool operator<(const VskRenderCacheEntry& other) const {
+        return m_time < other.m_time;
+    }
+};
+
+// 上限サイズを超えたら、古いものから削除する
+static void vsk_render_cache_evict(std::vector<VskRenderCacheEntry>& entries)
+{
+    uint64_t total = 0;
+    for (auto& entry : entries)
+        total += entry.m_size;
+    if (total <= VSK_RENDER_CACHE_MAX_BYTES)
+        return;
+
+    std::sort(entries.begin(), entries.end());
+    for (auto& entry : entries) {
+        if (total <= VSK_RENDER_CACHE_MAX_BYTES)
+            break;
+#ifdef _WIN32
+        if (DeleteFileW(entry.m_path.c_str()))
+#else
+        if (unlink(entry.m_path.c_str()) == 0)
+#endif
+            total -= entry.m_size;
+    }
+}
+
+#ifdef _WIN32
+
+//////////////////////////////////////////////////////////////////////////////
+// Win32
+
+// キャッシュのフォルダを取得する
+static std::wstring vsk_render_cache_dir(void)
+{
+    WCHAR szPath[MAX_PATH];
+    DWORD cch = GetEnvironmentVariableW(L"LOCALAPPDATA", szPath, _countof(szPath));
+    if (cch == 0 || cch >= _countof(szPath)) {
+        cch = GetTempPathW(_countof(szPath), szPath);
+        if (cch == 0 || cch >= _countof(szPath))
+            return L"";
+    }
+
+    std::wstring dir = szPath;
+    if (dir.size() && dir[dir.size() - 1] != L'\\')
+        dir += L'\\';
+    dir += L"cmd_sing";
+    CreateDirectoryW(dir.c_str(), NULL);
+    dir += L"\\cache";
+    CreateDirectoryW(dir.c_str(), NULL);
+    return dir;
+}
+
+static std::wstring vsk_render_cache_path(const std::wstring& dir, const std::string& key)
+{
+    return dir + L'\\' + std::wstring(key.begin(), key.end()) + L".pcm";
+}
+
+VskRenderCacheView::~VskRenderCacheView()
+{
+    if (m_base)
+        UnmapViewOfFile(m_base);
+    if (m_hMapping)
+        CloseHandle(m_hMapping);
+}
+
+std::shared_ptr<VskRenderCacheView> vsk_render_cache_lookup(const std::string& key)
+{
+    if (!s_render_cache_enabled)
+        return nullptr;
+
+    auto dir = vsk_render_cache_dir();
+    if (dir.empty())
+        return nullptr;
+    auto path = vsk_render_cache_path(dir, key);
+
+    // 開く。LRUのために時刻を更新したいので、できれば属性の書き込みを許可する
+    const DWORD dwShare = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ | FILE_WRITE_ATTRIBUTES, dwShare,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        hFile = CreateFileW(path.c_str(), GENERIC_READ, dwShare,
+                            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return nullptr;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(hFile, &file_size) ||
+        uint64_t(file_size.QuadPart) < sizeof(VskRenderCacheHeader) ||
+        uint64_t(file_size.QuadPart) > SIZE_MAX)
+    {
+        CloseHandle(hFile);
+        return nullptr;
+    }
+
+    HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!hMapping) {
+        CloseHandle(hFile);
+        return nullptr;
+    }
+
+    void *base = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!base || !vsk_render_cache_check(base, file_size.QuadPart)) {
+        if (base)
+            UnmapViewOfFile(base);
+        CloseHandle(hMapping);
+        CloseHandle(hFile);
+        return nullptr;
+    }
+
+    // 最終アクセス時刻として更新時刻を更新する（失敗しても構わない）
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    SetFileTime(hFile, NULL, NULL, &ft);
+    CloseHandle(hFile); // マッピングが残っている間はファイルも有効
+
+    std::shared_ptr<VskRenderCacheView> view(new VskRenderCacheView());
+    view->m_base = base;
+    view->m_map_size = size_t(file_size.QuadPart);
+    view->m_hMapping = hMapping;
+    view->m_values = reinterpret_cast<const int16_t *>(
+        reinterpret_cast<const uint8_t *>(base) + sizeof(VskRenderCacheHeader));
+    view->m_count = size_t(reinterpret_cast<const VskRenderCacheHeader *>(base)->m_count);
+    return view;
+}
+
+bool vsk_render_cache_store(const std::string& key, const int16_t *values, size_t count)
+{
+    if (!s_render_cache_enabled)
+        return false;
+
+    auto dir = vsk_render_cache_dir();
+    if (dir.empty())
+        return false;
+    auto path = vsk_render_cache_path(dir, key);
+
+    // 一時ファイルに書き込んでから置き換える（他のプロセスに途中のファイルを見せない）
+    WCHAR szSuffix[64];
+    wsprintfW(szSuffix, L".%lu.%lu.tmp", GetCurrentProcessId(), GetTickCount());
+    std::wstring tmp_path = path + szSuffix;
+
+    HANDLE hFile = CreateFileW(tmp_path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW,
+                               FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    VskRenderCacheHeader header;
+    std::memcpy(header.m_magic, VSK_RENDER_CACHE_MAGIC, sizeof(header.m_magic));
+    header.m_count = count;
+
+    bool ok = true;
+    DWORD cbWritten;
+    ok = ok && WriteFile(hFile, &header, sizeof(header), &cbWritten, NULL) && cbWritten == sizeof(header);
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(values);
+    size_t remaining = count * sizeof(int16_t);
+    while (ok && remaining) {
+        DWORD cb = DWORD((remaining > 0x10000000) ? 0x10000000 : remaining);
+        ok = WriteFile(hFile, bytes, cb, &cbWritten, NULL) && cbWritten == cb;
+        bytes += cb;
+        remaining -= cb;
+    }
+    CloseHandle(hFile);
+
+    if (!ok || !MoveFileExW(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileW(tmp_path.c_str());
+        return false;
+    }
+
+    // 上限サイズを超えたら、古いものから削除する
+    std::vector<VskRenderCacheEntry> entries;
+    WIN32_FIND_DATAW find;
+    HANDLE hFind = FindFirstFileW((dir + L"\\*.pcm").c_str(), &find);
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                continue;
+            VskRenderCacheEntry entry;
+            entry.m_time = (uint64_t(find.ftLastWriteTime.dwHighDateTime) << 32) | find.ftLastWriteTime.dwLowDateTime;
+            entry.m_size = (uint64_t(find.nFileSizeHigh) << 32) | find.nFileSizeLow;
+            entry.m_path = dir + L'\\' + find.cFileName;
+            entries.push_back(entry);
+        } while (FindNextFileW(hFind, &find));
+        FindClose(hFind);
+    }
+    vsk_render_cache_evict(entries);
+
+    return true;
+}
+
+#else   // ndef _WIN32
+
+//////////////////////////////////////////////////////////////////////////////
+// POSIX
+
+// キャッシュのフォルダを取得する。使えなければ空文字列を返す。
+// 他のユーザーが置いたファイルを読まないように、自分のフォルダでなければ使わない
+static std::string vsk_render_cache_dir(void)
+{
+    std::string dir;
+    const char *xdg = std::getenv("XDG_CACHE_HOME");
+    const char *home = std::getenv("HOME");
+    if (xdg && *xdg) {
+        // 途中のフォルダもなければ作る
+        dir = xdg;
+        for (size_t i = 1; i < dir.size(); ++i) {
+            if (dir[i] == '/')
+                mkdir(dir.substr(0, i).c_str(), 0700);
+        }
+        mkdir(dir.c_str(), 0700);
+    } else if (home && *home) {
+        dir = home;
+        dir += "/.cache";
+        mkdir(dir.c_str(), 0755);
+    } else {
+        return "";
+    }
+    dir += "/cmd_sing";
+    mkdir(dir.c_str(), 0700);
+
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid())
+        return "";
+    return dir;
+}
+
+static std::string vsk_render_cache_path(const std::string& dir, const std::string& key)
+{
+    return dir + '/' + key + ".pcm";
+}
+
+VskRenderCacheView::~VskRenderCacheView()
+{
+    if (m_base)
+        munmap(m_base, m_map_size);
+}
+
+std::shared_ptr<VskRenderCacheView> vsk_render_cache_lookup(const std::string& key)
+{
+    if (!s_render_cache_enabled)
+        return nullptr;
+
+    auto dir = vsk_render_cache_dir();
+    if (dir.empty())
+        return nullptr;
+    auto path = vsk_render_cache_path(dir, key);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || uint64_t(st.st_size) < sizeof(VskRenderCacheHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *base = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+    if (!vsk_render_cache_check(base, st.st_size)) {
+        munmap(base, size_t(st.st_size));
+        close(fd);
+        return nullptr;
+    }
+
+    // 最終アクセス時刻として更新時刻を更新する（失敗しても構わない）
+    futimens(fd, NULL);
+    close(fd); // マッピングが残っている間はファイルも有効
+
+    std::shared_ptr<VskRenderCacheView> view(new VskRenderCacheView());
+    view->m_base = base;
+    view->m_map_size = size_t(st.st_size);
+    view->m_values = reinterpret_cast<const int16_t *>(
+        reinterpret_cast<const uint8_t *>(base) + sizeof(VskRenderCacheHeader));
+    view->m_count = size_t(reinterpret_cast<const VskRenderCacheHeader *>(base)->m_count);
+    return view;
+}
+
+bool vsk_render_cache_store(const std::string& key, const int16_t *values, size_t count)
+{
+    if (!s_render_cache_enabled)
+        return false;
+
+    auto dir = vsk_render_cache_dir();
+    if (dir.empty())
+        return false;
+    auto path = vsk_render_cache_path(dir, key);
+
+    // 一時ファイルに書き込んでから置き換える（他のプロセスに途中のファイルを見せない）
+    char suffix[64];
+    std::snprintf(suffix, sizeof(suffix), ".%ld.%ld.tmp", long(getpid()), long(time(NULL)));
+    std::string tmp_path = path + suffix;
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return false;
+
+    VskRenderCacheHeader header;
+    std::memcpy(header.m_magic, VSK_RENDER_CACHE_MAGIC, sizeof(header.m_magic));
+    header.m_count = count;
+
+    bool ok = (write(fd, &header, sizeof(header)) == ssize_t(sizeof(header)));
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(values);
+    size_t remaining = count * sizeof(int16_t);
+    while (ok && remaining) {
+        ssize_t written = write(fd, bytes, remaining);
+        if (written <= 0) {
+            ok = false;
+            break;
+        }
+        bytes += written;
+        remaining -= size_t(written);
+    }
+    close(fd);
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    // 上限サイズを超えたら、古いものから削除する
+    std::vector<VskRenderCacheEntry> entries;
+    if (DIR *pdir = opendir(dir.c_str())) {
+        while (struct dirent *ent = readdir(pdir)) {
+            std::string name = ent->d_name;
+            if (name.size() <= 4 || name.compare(name.size() - 4, 4, ".pcm") != 0)
+                continue;
+            VskRenderCacheEntry entry;
+            entry.m_path = dir + '/' + name;
+            struct stat st;
+            if (stat(entry.m_path.c_str(), &st) != 0)
+                continue;
+            entry.m_time = uint64_t(st.st_mtime);
+            entry.m_size = uint64_t(st.st_size);
+            entries.push_back(entry);
+        }
+        closedir(pdir);
+    }
+    vsk_render_cache_evict(entries);
+
+    return true;
+}
+
+#endif  // ndef _WIN32
+
+//////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,85 @@
+//////////////////////////////////////////////////////////////////////////////
+// rendercache --- a content-addressed on-disk cache of rendered PCM
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <memory>
+
+// キャッシュの上限サイズ（バイト）
+#ifndef VSK_RENDER_CACHE_MAX_BYTES
+    #define VSK_RENDER_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// VskSha256 - キャッシュのキーを計算するためのハッシュ
+
+class VskSha256 {
+public:
+    VskSha256();
+
+    void update(const void *data, size_t size);
+
+    template <typename T_VALUE>
+    void update_value(const T_VALUE& value) {
+        update(&value, sizeof(value));
+    }
+
+    void update_string(const std::string& str) {
+        update_value(uint32_t(str.size()));
+        update(str.data(), str.size());
+    }
+
+    // 16進数の文字列としてダイジェストを取得する
+    std::string finish();
+
+protected:
+    uint32_t    m_state[8];
+    uint64_t    m_total;
+    uint8_t     m_block[64];
+    size_t      m_used;
+
+    void transform(const uint8_t *block);
+}; // class VskSha256
+
+//////////////////////////////////////////////////////////////////////////////
+// VskRenderCacheView - メモリーマップされたキャッシュのPCMデータ
+
+class VskRenderCacheView {
+public:
+    ~VskRenderCacheView();
+
+    const int16_t *data() const { return m_values; }
+    size_t count() const        { return m_count; }
+
+protected:
+    friend std::shared_ptr<VskRenderCacheView> vsk_render_cache_lookup(const std::string& key);
+
+    VskRenderCacheView() { }
+
+    void *          m_base = nullptr;       // マップされた先頭
+    size_t          m_map_size = 0;         // マップされたサイズ
+    const int16_t * m_values = nullptr;     // PCMデータ
+    size_t          m_count = 0;            // PCMデータの個数
+#ifdef _WIN32
+    void *          m_hMapping = nullptr;   // ファイルマッピングのハンドル
+#endif
+}; // class VskRenderCacheView
+
+//////////////////////////////////////////////////////////////////////////////
+
+// キャッシュを有効にするか？
+void vsk_render_cache_enable(bool enable);
+bool vsk_render_cache_is_enabled(void);
+
+// キャッシュを探す。見つからなければnullptrを返す
+std::shared_ptr<VskRenderCacheView> vsk_render_cache_lookup(const std::string& key);
+
+// キャッシュに格納する
+bool vsk_render_cache_store(const std::string& key, const int16_t *values, size_t count);
+
+//////////////////////////////////////////////////////////////////////////////
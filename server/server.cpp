@@ -10,6 +10,7 @@
 #include <string>
 #include <stack>
 #include "../sound.h"
+#include "../rendercache.h"
 #include "server.h"
 
 HINSTANCE g_hInst = NULL;
@@ -203,6 +204,12 @@ int SERVER_CMD::parse_cmd_line(INT argc, LPWSTR *argv)
             continue;
         }
 
+        if (_wcsicmp(arg, L"-no-cache") == 0 || _wcsicmp(arg, L"--no-cache") == 0)
+        {
+            vsk_render_cache_enable(false);
+            continue;
+        }
+
         // hidden feature
         if (_wcsicmp(arg, L"-no-beep") == 0 || _wcsicmp(arg, L"--no-beep") == 0)
         {
@@ -1,24 +1,23 @@
 ﻿#include "types.h"
 #include "sound.h"
 #include <cstdio>
+#include <deque>
 #include <windows.h>
 #include <mmsystem.h>
 #include <shlwapi.h>
 
 #include "soundplayer.h"                // サウンドプレーヤー
+#include "engine.h"                     // VskEngine
 
-// 変数
-std::map<VskString, VskString> g_variables;
-
-// サウンドプレーヤー
-std::shared_ptr<VskSoundPlayer> vsk_sound_player;
-
-// WAVE出力用の変数
-WAVEFORMATEX vsk_wfx;
-HWAVEOUT vsk_hWaveOut = nullptr;
-WAVEHDR vsk_waveHdr = { nullptr };
+// WAVE出力の状態
+struct VskWaveOut
+{
+    WAVEFORMATEX m_wfx;
+    HWAVEOUT m_hWaveOut = nullptr;
+    WAVEHDR m_waveHdr = { nullptr };
+};
 
-// WAVE出力用のコールバック関数
+// WAVE出力用のコールバック関数。dwInstanceはエンジン
 static void CALLBACK
 waveOutProc(
     HWAVEOUT hWaveOut,
@@ -30,7 +29,8 @@ waveOutProc(
     if (uMsg == WOM_DONE) {
         // バッファの再生が完了したときの処理
         Sleep(50);
-        vsk_sound_player->m_stopping_event.set();
+        VskEngine *engine = reinterpret_cast<VskEngine *>(dwInstance);
+        engine->m_player->m_stopping_event.set();
     }
 }
 
@@ -80,101 +80,291 @@ bool vsk_get_rhythm_path(char *path, size_t path_max)
 }
 
 // 音源を初期化する
-bool vsk_sound_init(bool stereo)
+bool vsk_sound_init(VskEngine& engine, bool stereo)
 {
     // リズム音源のある場所を取得
     char rhythm_path[MAX_PATH];
     vsk_get_rhythm_path(rhythm_path, _countof(rhythm_path));
 
     // サウンドプレーヤーを作成
-    vsk_sound_player = std::make_shared<VskSoundPlayer>(rhythm_path);
+    if (!vsk_engine_init(engine, rhythm_path))
+        return false;
 
     // WAVEFORMATEX構造体を初期化
-    ZeroMemory(&vsk_wfx, sizeof(vsk_wfx));
-    vsk_wfx.wFormatTag = WAVE_FORMAT_PCM; // PCM
-    vsk_wfx.nChannels = (stereo ? 2 : 1); // チャンネル数
-    vsk_wfx.nSamplesPerSec = 44100; // サンプリングレート
-    vsk_wfx.wBitsPerSample = 16; // ビット深度
-    vsk_wfx.nBlockAlign = (vsk_wfx.nChannels * vsk_wfx.wBitsPerSample) / 8;
-    vsk_wfx.nAvgBytesPerSec = vsk_wfx.nSamplesPerSec * vsk_wfx.nBlockAlign;
-    vsk_wfx.cbSize = 0;
+    engine.m_wave_out = std::make_shared<VskWaveOut>();
+    auto& wfx = engine.m_wave_out->m_wfx;
+    ZeroMemory(&wfx, sizeof(wfx));
+    wfx.wFormatTag = WAVE_FORMAT_PCM; // PCM
+    wfx.nChannels = (stereo ? 2 : 1); // チャンネル数
+    wfx.nSamplesPerSec = 44100; // サンプリングレート
+    wfx.wBitsPerSample = 16; // ビット深度
+    wfx.nBlockAlign = (wfx.nChannels * wfx.wBitsPerSample) / 8;
+    wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
+    wfx.cbSize = 0;
 
     // Wave出力を開く
-    ZeroMemory(&vsk_waveHdr, sizeof(vsk_waveHdr));
-    vsk_waveHdr.dwFlags |= WHDR_DONE;
-    MMRESULT result = waveOutOpen(&vsk_hWaveOut, WAVE_MAPPER, &vsk_wfx, (DWORD_PTR)waveOutProc, 0, CALLBACK_FUNCTION | WAVE_ALLOWSYNC);
+    auto& waveHdr = engine.m_wave_out->m_waveHdr;
+    ZeroMemory(&waveHdr, sizeof(waveHdr));
+    waveHdr.dwFlags |= WHDR_DONE;
+    MMRESULT result = waveOutOpen(&engine.m_wave_out->m_hWaveOut, WAVE_MAPPER, &wfx,
+                                  (DWORD_PTR)waveOutProc, (DWORD_PTR)&engine,
+                                  CALLBACK_FUNCTION | WAVE_ALLOWSYNC);
     return (result == MMSYSERR_NOERROR);
 }
 
+// 音源を初期化する
+bool vsk_sound_init(bool stereo)
+{
+    return vsk_sound_init(vsk_default_engine(), stereo);
+}
+
 // 音源を停止する
-void vsk_sound_stop(void)
+void vsk_sound_stop(VskEngine& engine)
 {
     // Wave出力をリセット
-    vsk_waveHdr.dwFlags |= WHDR_DONE;
-    waveOutReset(vsk_hWaveOut);
+    if (engine.m_wave_out) {
+        engine.m_wave_out->m_waveHdr.dwFlags |= WHDR_DONE;
+        waveOutReset(engine.m_wave_out->m_hWaveOut);
+    }
 
-    vsk_sound_player->m_stopping_event.set();
+    engine.m_player->m_stopping_event.set();
+}
+
+// 音源を停止する
+void vsk_sound_stop(void)
+{
+    vsk_sound_stop(vsk_default_engine());
 }
 
 // 音声を再生する
-void vsk_sound_play(const void *data, size_t data_size, bool stereo)
+void vsk_sound_play(VskEngine& engine, const void *data, size_t data_size, bool stereo)
 {
     // いったん音声を止める
-    vsk_sound_stop();
-    vsk_sound_player->m_stopping_event.reset();
+    vsk_sound_stop(engine);
+    engine.m_player->m_stopping_event.reset();
+
+    // 出力先がなければ何もしない
+    if (!engine.m_wave_out)
+        return;
 
     // Wave出力の準備をする
-    ZeroMemory(&vsk_waveHdr, sizeof(vsk_waveHdr));
-    vsk_waveHdr.lpData = (LPSTR)data;
-    vsk_waveHdr.dwBufferLength = data_size;
-    vsk_waveHdr.dwFlags = 0;
-    vsk_waveHdr.dwLoops = 0;
-    waveOutPrepareHeader(vsk_hWaveOut, &vsk_waveHdr, sizeof(WAVEHDR));
+    VskStageTimer timer(engine.m_stats, VSK_STAGE_DEVICE);
+    auto& waveHdr = engine.m_wave_out->m_waveHdr;
+    ZeroMemory(&waveHdr, sizeof(waveHdr));
+    waveHdr.lpData = (LPSTR)data;
+    waveHdr.dwBufferLength = data_size;
+    waveHdr.dwFlags = 0;
+    waveHdr.dwLoops = 0;
+    waveOutPrepareHeader(engine.m_wave_out->m_hWaveOut, &waveHdr, sizeof(WAVEHDR));
 
     // Waveデータを出力する
-    waveOutWrite(vsk_hWaveOut, &vsk_waveHdr, sizeof(WAVEHDR));
+    waveOutWrite(engine.m_wave_out->m_hWaveOut, &waveHdr, sizeof(WAVEHDR));
+}
+
+// 音声を再生する
+void vsk_sound_play(const void *data, size_t data_size, bool stereo)
+{
+    vsk_sound_play(vsk_default_engine(), data, data_size, stereo);
 }
 
 // 音源を破棄する
-void vsk_sound_exit(void)
+void vsk_sound_exit(VskEngine& engine)
 {
     // 音を止める
-    vsk_sound_stop();
+    vsk_sound_stop(engine);
 
     // Wave出力を閉じる
-    waveOutUnprepareHeader(vsk_hWaveOut, &vsk_waveHdr, sizeof(WAVEHDR));
-    waveOutClose(vsk_hWaveOut);
-    vsk_hWaveOut = nullptr;
+    if (engine.m_wave_out) {
+        waveOutUnprepareHeader(engine.m_wave_out->m_hWaveOut, &engine.m_wave_out->m_waveHdr, sizeof(WAVEHDR));
+        waveOutClose(engine.m_wave_out->m_hWaveOut);
+        engine.m_wave_out = nullptr;
+    }
 
     // サウンドプレーヤーを解放する
-    vsk_sound_player = nullptr;
+    if (engine.m_stats && engine.m_player)
+        engine.m_stats->collect(*engine.m_player);
+    engine.m_player = nullptr;
+}
+
+// 音源を破棄する
+void vsk_sound_exit(void)
+{
+    vsk_sound_exit(vsk_default_engine());
+}
+
+// 音源が演奏中か？
+bool vsk_sound_is_playing(VskEngine& engine)
+{
+    return engine.m_wave_out && !(engine.m_wave_out->m_waveHdr.dwFlags & WHDR_DONE);
 }
 
 // 音源が演奏中か？
 bool vsk_sound_is_playing(void)
 {
-    return !(vsk_waveHdr.dwFlags & WHDR_DONE);
+    return vsk_sound_is_playing(vsk_default_engine());
 }
 
 // 音源を待つ。単位はミリ秒
-bool vsk_sound_wait(VskDword milliseconds)
+bool vsk_sound_wait(VskEngine& engine, VskDword milliseconds)
 {
-    if (!vsk_sound_is_playing())
+    if (!vsk_sound_is_playing(engine))
         return false;
 
-    return vsk_sound_player->wait_for_stop(milliseconds);
+    return engine.m_player->wait_for_stop(milliseconds);
+}
+
+// 音源を待つ。単位はミリ秒
+bool vsk_sound_wait(VskDword milliseconds)
+{
+    return vsk_sound_wait(vsk_default_engine(), milliseconds);
 }
 
 // OPNのレジスタにデータを設定する
-bool vsk_sound_voice_reg(int addr, int data)
+bool vsk_sound_voice_reg(VskEngine& engine, int addr, int data)
 {
-    if (!vsk_sound_player)
+    if (!engine.m_player)
         return false;
 
-    vsk_sound_player->write_reg(addr, data);
+    engine.m_player->write_reg(addr, data);
     return true;
 }
 
+// OPNのレジスタにデータを設定する
+bool vsk_sound_voice_reg(int addr, int data)
+{
+    return vsk_sound_voice_reg(vsk_default_engine(), addr, data);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// VskPcmDeviceSink - 出力デバイスに波形を少しずつ送る出力先
+
+// 出力デバイスに送って鳴り終わっていないバッファの最大数
+#define VSK_STREAM_MAX_BUFFERS 4
+
+struct VskPcmDeviceSink : VskPcmSink
+{
+    VskEngine& m_engine;
+    HWAVEOUT m_hWaveOut = nullptr;
+    HANDLE m_hEvent = nullptr; // バッファが鳴り終わるとセットされる
+
+    struct Buffer
+    {
+        WAVEHDR m_waveHdr;
+        std::vector<VSK_PCM16_VALUE> m_values;
+    };
+    std::deque<std::unique_ptr<Buffer>> m_queue; // 送った順のバッファ
+
+    VskPcmDeviceSink(VskEngine& engine) : m_engine(engine) { }
+
+    ~VskPcmDeviceSink()
+    {
+        // 送った波形が鳴り終わるまで待つ
+        while (reclaim() && !is_stopped())
+            WaitForSingleObject(m_hEvent, 100);
+
+        if (m_hWaveOut) {
+            waveOutReset(m_hWaveOut);
+            reclaim();
+            waveOutClose(m_hWaveOut);
+        }
+        if (m_hEvent)
+            CloseHandle(m_hEvent);
+    }
+
+    bool open(bool stereo)
+    {
+        m_hEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        if (!m_hEvent)
+            return false;
+
+        WAVEFORMATEX wfx;
+        ZeroMemory(&wfx, sizeof(wfx));
+        wfx.wFormatTag = WAVE_FORMAT_PCM; // PCM
+        wfx.nChannels = (stereo ? 2 : 1); // チャンネル数
+        wfx.nSamplesPerSec = 44100; // サンプリングレート
+        wfx.wBitsPerSample = 16; // ビット深度
+        wfx.nBlockAlign = (wfx.nChannels * wfx.wBitsPerSample) / 8;
+        wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
+        wfx.cbSize = 0;
+
+        MMRESULT result = waveOutOpen(&m_hWaveOut, WAVE_MAPPER, &wfx, (DWORD_PTR)m_hEvent, 0, CALLBACK_EVENT);
+        if (result != MMSYSERR_NOERROR) {
+            m_hWaveOut = nullptr;
+            return false;
+        }
+
+        m_engine.m_player->m_stopping_event.reset();
+        return true;
+    }
+
+    // vsk_sound_stopで止められたか？
+    bool is_stopped()
+    {
+        // NOTE: wait_for_event() returns true if timeout.
+        return !m_engine.m_player->m_stopping_event.wait_for_event(0);
+    }
+
+    // 鳴り終わったバッファを先頭から片付ける。まだ鳴っているバッファがあればtrueを返す
+    bool reclaim()
+    {
+        while (m_queue.size() && (m_queue.front()->m_waveHdr.dwFlags & WHDR_DONE)) {
+            waveOutUnprepareHeader(m_hWaveOut, &m_queue.front()->m_waveHdr, sizeof(WAVEHDR));
+            m_queue.pop_front();
+        }
+        return !m_queue.empty();
+    }
+
+    bool write(const VSK_PCM16_VALUE *data, size_t count) override
+    {
+        if (count == 0)
+            return true;
+
+        // 先に送ったバッファが鳴り終わるのを待って、送りすぎないようにする
+        for (;;) {
+            if (is_stopped())
+                return false;
+            reclaim();
+            if (m_queue.size() < VSK_STREAM_MAX_BUFFERS)
+                break;
+            WaitForSingleObject(m_hEvent, 100);
+        }
+
+        VskStageTimer timer(m_engine.m_stats, VSK_STAGE_DEVICE);
+        std::unique_ptr<Buffer> buffer(new Buffer());
+        buffer->m_values.assign(data, data + count);
+        auto& waveHdr = buffer->m_waveHdr;
+        ZeroMemory(&waveHdr, sizeof(waveHdr));
+        waveHdr.lpData = (LPSTR)buffer->m_values.data();
+        waveHdr.dwBufferLength = DWORD(count * sizeof(VSK_PCM16_VALUE));
+        if (waveOutPrepareHeader(m_hWaveOut, &waveHdr, sizeof(WAVEHDR)) != MMSYSERR_NOERROR)
+            return false;
+        if (waveOutWrite(m_hWaveOut, &waveHdr, sizeof(WAVEHDR)) != MMSYSERR_NOERROR) {
+            waveOutUnprepareHeader(m_hWaveOut, &waveHdr, sizeof(WAVEHDR));
+            return false;
+        }
+        m_queue.push_back(std::move(buffer));
+        return true;
+    }
+};
+
+// 出力デバイスに波形を少しずつ送る出力先を開く。失敗したらnullを返す
+std::shared_ptr<VskPcmSink> vsk_sound_open_stream(VskEngine& engine, bool stereo)
+{
+    if (!engine.m_player)
+        return nullptr;
+
+    auto sink = std::make_shared<VskPcmDeviceSink>(engine);
+    if (!sink->open(stereo))
+        return nullptr;
+    return sink;
+}
+
+// 出力デバイスに波形を少しずつ送る出力先を開く。失敗したらnullを返す
+std::shared_ptr<VskPcmSink> vsk_sound_open_stream(bool stereo)
+{
+    return vsk_sound_open_stream(vsk_default_engine(), stereo);
+}
+
 // 音色のサイズを取得する
 size_t vsk_sound_voice_size(void)
 {
@@ -2,7 +2,20 @@
 
 #include "types.h"
 #include <map>
+#include <memory>
 
+// 演奏エンジンの文脈 (engine.h)
+struct VskEngine;
+// 波形の出力先 (soundplayer.h)
+struct VskPcmSink;
+VskEngine& vsk_default_engine(void);
+bool vsk_engine_init(VskEngine& engine, const char *rhythm_path);
+// 前の描画と変わった部分だけを描画し直すか（エディタで楽譜を直しながら聞くとき）。
+// オンなら、演奏と保存は毎回音源を初期状態に戻してから描画する
+void vsk_sound_set_incremental(VskEngine& engine, bool incremental);
+void vsk_sound_set_incremental(bool incremental);
+
+bool vsk_get_rhythm_path(char *path, size_t path_max);
 bool vsk_sound_init(bool stereo);
 void vsk_sound_exit(void);
 void vsk_sound_play(const void *data, size_t data_size, bool stereo);
@@ -12,6 +25,17 @@ void vsk_sound_stop(void);
 bool vsk_sound_voice_reg(int addr, int data);
 size_t vsk_sound_voice_size(void);
 bool vsk_sound_voice_copy(int tone, std::vector<uint8_t>& data);
+bool vsk_sound_init(VskEngine& engine, bool stereo);
+void vsk_sound_exit(VskEngine& engine);
+void vsk_sound_play(VskEngine& engine, const void *data, size_t data_size, bool stereo);
+bool vsk_sound_is_playing(VskEngine& engine);
+bool vsk_sound_wait(VskEngine& engine, VskDword milliseconds);
+void vsk_sound_stop(VskEngine& engine);
+bool vsk_sound_voice_reg(VskEngine& engine, int addr, int data);
+// 出力デバイスに波形を少しずつ送る出力先。送った波形は切れ目なく続けて鳴る。
+// 破棄するときに、送った波形が鳴り終わるまで待つ（vsk_sound_stopで止まる）。vsk_sound_exitより先に破棄すること
+std::shared_ptr<VskPcmSink> vsk_sound_open_stream(VskEngine& engine, bool stereo);
+std::shared_ptr<VskPcmSink> vsk_sound_open_stream(bool stereo);
 #ifndef VEYSICK
 std::string vsk_sjis_from_wide(const wchar_t *wide);
 #endif
@@ -21,6 +45,7 @@ enum VSK_SOUND_ERR
     VSK_SOUND_ERR_SUCCESS = 0,
     VSK_SOUND_ERR_ILLEGAL,
     VSK_SOUND_ERR_IO_ERROR,
+    VSK_SOUND_ERR_CANCELLED,    // 非同期のタスクが取り消された
 };
 
 // CMD SING
@@ -33,6 +58,14 @@ size_t vsk_cmd_sing_get_setting_size(void);
 bool vsk_cmd_sing_get_setting(std::vector<uint8_t>& data);
 bool vsk_cmd_sing_set_setting(const std::vector<uint8_t>& data);
 VskString vsk_replace_sing_placeholders(const VskString& str);
+VSK_SOUND_ERR vsk_sound_cmd_sing(VskEngine& engine, const char *str, bool stereo, bool no_sound);
+VSK_SOUND_ERR vsk_sound_cmd_sing_save(VskEngine& engine, const char *str, const wchar_t *filename, bool stereo);
+VSK_SOUND_ERR vsk_sound_cmd_sing_stream(const char *str, VskPcmSink& sink, bool stereo);
+VSK_SOUND_ERR vsk_sound_cmd_sing_stream(VskEngine& engine, const char *str, VskPcmSink& sink, bool stereo);
+void vsk_cmd_sing_reset_settings(VskEngine& engine);
+bool vsk_cmd_sing_get_setting(VskEngine& engine, std::vector<uint8_t>& data);
+bool vsk_cmd_sing_set_setting(VskEngine& engine, const std::vector<uint8_t>& data);
+VskString vsk_replace_sing_placeholders(VskEngine& engine, const VskString& str);
 
 // CMD PLAY
 VSK_SOUND_ERR vsk_sound_cmd_play_ssg(const std::vector<VskString>& strs, bool stereo, bool no_sound);
@@ -47,6 +80,17 @@ bool vsk_cmd_play_get_setting(int ch, std::vector<uint8_t>& data);
 bool vsk_cmd_play_set_setting(int ch, const std::vector<uint8_t>& data);
 bool vsk_cmd_play_voice(int ich, const void *data, size_t data_size);
 std::string vsk_replace_play_placeholders(const std::string& str);
+VSK_SOUND_ERR vsk_sound_cmd_play_ssg(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound);
+VSK_SOUND_ERR vsk_sound_cmd_play_fm_and_ssg(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound);
+VSK_SOUND_ERR vsk_sound_cmd_play_fm(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound);
+VSK_SOUND_ERR vsk_sound_cmd_play_ssg_save(VskEngine& engine, const std::vector<VskString>& strs, const wchar_t *filename, bool stereo);
+VSK_SOUND_ERR vsk_sound_cmd_play_fm_and_ssg_save(VskEngine& engine, const std::vector<VskString>& strs, const wchar_t *filename, bool stereo);
+VSK_SOUND_ERR vsk_sound_cmd_play_fm_save(VskEngine& engine, const std::vector<VskString>& strs, const wchar_t *filename, bool stereo);
+void vsk_cmd_play_reset_settings(VskEngine& engine);
+bool vsk_cmd_play_get_setting(VskEngine& engine, int ch, std::vector<uint8_t>& data);
+bool vsk_cmd_play_set_setting(VskEngine& engine, int ch, const std::vector<uint8_t>& data);
+bool vsk_cmd_play_voice(VskEngine& engine, int ich, const void *data, size_t data_size);
+std::string vsk_replace_play_placeholders(VskEngine& engine, const std::string& str);
 
-// variables
-extern std::map<VskString, VskString> g_variables;
+// variables (既定のエンジンの変数)
+extern std::map<VskString, VskString>& g_variables;
@@ -5,175 +5,24 @@
 #include "fmgon/fmgon.h"
 #include "soundplayer.h"
 #include "sound.h"
+#include "engine.h"
 #include <map>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cwchar>
 #include <limits>
+#include <algorithm>
+
+// SSE2の命令で波形を変換する
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define VSK_USE_SSE2
+    #include <emmintrin.h>
+#endif
 
 #define CLOCK       8000000     // クロック数
 #define SAMPLERATE  44100       // サンプルレート (Hz)
 
-#define LFO_INTERVAL 150
-
-class VskLFOCtrl {
-    int     m_waveform;
-    int     m_qperiod; // quarter of period
-    int     m_count;
-    int     m_phase; // 0, 1, 2 or 3
-    float   m_adj_p_max;
-    float   m_adj_v_max[4];
-    float   m_adj_p_diff;
-    float   m_adj_v_diff[4];
-public:
-    float   m_adj_p; // for pitch
-    float   m_adj_v[4]; // for volume
-
-public:
-    VskLFOCtrl() {
-        m_adj_p = 0;
-        memset(m_adj_v_diff, 0, sizeof(m_adj_v_diff));
-    }
-
-    void init_for_timbre(YM2203_Timbre *p_timbre) {
-        int i;
-        m_waveform = p_timbre->waveForm;
-        if (p_timbre->speed) {
-            m_qperiod = 900 * LFO_INTERVAL / (4*p_timbre->speed);
-        } else {
-            m_qperiod = 0;
-        }
-        //m_count = 0;
-        m_phase = 0;
-        m_adj_p_max = p_timbre->pmd * (float)p_timbre->pms / 2.0f; // TBD
-        for (i = 0; i < 4; ++i) {
-            m_adj_v_max[i] =
-                p_timbre->amd * (float)p_timbre->ams[i] / 2; // TBD
-        }
-        init_for_phase(true);
-    }
-
-    void init_for_keyon(YM2203_Timbre *p_timbre) {
-        if (p_timbre->sync) {
-            m_phase = 0;
-            init_for_phase();
-        }
-    }
-
-    void increment() {
-        int i;
-        if (0 == m_qperiod) {
-            return;
-        }
-        m_count++;
-        if (m_count < m_qperiod) {
-            m_adj_p += m_adj_p_diff;
-            for (i = 0; i < 4; ++i) {
-                m_adj_v[i] += m_adj_v_diff[i];
-            }
-        } else {
-            m_phase = (m_phase + 1) & 3;
-            init_for_phase();
-        }
-    }
-
-protected:
-    void init_for_phase(bool flag_first = false) {
-        int i;
-        m_count = 0;
-        if (flag_first) {
-            switch (m_waveform) {
-            case 0: // saw
-                m_adj_p = 0;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v[i] = 0;
-                }
-                m_adj_p_diff = m_adj_p_max / (m_qperiod * 2);
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v_diff[i] = m_adj_v_max[i] / (m_qperiod * 2);
-                }
-                break;
-            case 1: // square
-                m_adj_p = -m_adj_p_max;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v[i] = -m_adj_v_max[i];
-                }
-                m_adj_p_diff = 0;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v_diff[i] = 0;
-                }
-                break;
-            case 2: // triangle
-                m_adj_p = 0;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v[i] = 0;
-                }
-                m_adj_p_diff = m_adj_p_max / m_qperiod;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v_diff[i] = m_adj_v_max[i] / m_qperiod;
-                }
-                break;
-            default: // sample and hold
-                //m_adj_p = m_adj_p_max * (rand() * 2.0 / RAND_MAX - 1);
-                //for (i = 0; i < 4; ++i) {
-                //    m_adj_v[i] = m_adj_v_max[i] * (rand() * 2.0 / RAND_MAX - 1);
-                //}
-                m_adj_p_diff = 0;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v_diff[i] = 0;
-                }
-                break;
-            }
-        }
-        switch (m_waveform) {
-        case 0: // saw
-            if (0 == m_phase) {
-                m_adj_p = 0;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v[i] = 0;
-                }
-            } else if (2 == m_phase) {
-                m_adj_p = -m_adj_p;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v[i] = -m_adj_v[i];
-                }
-            }
-            break;
-        case 1: // square
-            if (0 == (m_phase & 1)) {
-                m_adj_p = -m_adj_p;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v[i] = -m_adj_v[i];
-                }
-            }
-            break;
-        case 2: // triangle
-            if (0 == m_phase) {
-                m_adj_p = 0;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v[i] = 0;
-                }
-            } else if (1 == (m_phase & 1)) {
-                m_adj_p_diff = -m_adj_p_diff;
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v_diff[i] = -m_adj_v_diff[i];
-                }
-            }
-            break;
-        default: // sample and hold
-            if (0 == (m_phase & 1)) {
-                m_adj_p = float(
-                    m_adj_p_max * (rand() * 2.0 / RAND_MAX - 1)
-                );
-                for (i = 0; i < 4; ++i) {
-                    m_adj_v[i] = float(
-                        m_adj_v_max[i] * (rand() * 2.0 / RAND_MAX - 1)
-                    );
-                }
-            }
-            break;
-        }
-    }
-}; // class VskLFOCtrl
-
 //////////////////////////////////////////////////////////////////////////////
 // VskNote - 音符、休符、その他の何か
 
@@ -278,7 +127,7 @@ void VskPhrase::execute_special_actions() {
                 auto action_numbers = pair2.second;
 
                 // 前のgateからの待機時間を計算して待機
-                if (!m_player->wait_for_stop(uint32_t(gate - last_gate) * 1000)) {
+                if (!m_player->wait_for_stop(uint32_t((gate - last_gate) * 1000))) {
                     // 待機中にstopされた場合、ループを抜ける
                     break;
                 }
@@ -303,104 +152,363 @@ void VskPhrase::execute_special_actions() {
     ).detach();
 }
 
-// 音楽記号のタイを実現するために、フレーズデータを再スキャンする
-void VskPhrase::rescan_notes() {
-    std::vector<VskNote> new_notes;
+// フレーズを仕上げる。音符を一度だけ走査して、タイでつながった音符をその場で
+// 一つにまとめ、まとめた後の開始時刻とゴール（演奏終了）の時刻を決め、
+// スペシャルアクションを予約する。フレーズを作り終えたときに呼ぶ。二度目以降は何もしない
+void VskPhrase::finalize() {
+    if (m_finalized)
+        return;
+    m_finalized = true;
+
+    m_gate_to_special_action_no.clear();
+    m_writes_all = false;
+
+    // 長い楽譜でも誤差が溜まらないように、時刻は倍精度で足し合わせる
+    double gate = 0;
+    size_t count = 0;
     for (size_t i = 0; i < m_notes.size(); ++i) {
-        if (!m_notes[i].m_and) {
-            new_notes.push_back(m_notes[i]);
-            continue;
+        if (count != i)
+            m_notes[count] = m_notes[i];
+        VskNote& note = m_notes[count++];
+
+        // タイがあれば、続く音符の長さと秒数を足し込む。末尾の「&」は無視する
+        while (note.m_and && i + 1 < m_notes.size()) {
+            const VskNote& next = m_notes[++i];
+            note.m_length += next.m_length;
+            note.m_sec += next.m_sec;
+            note.m_and = next.m_and;
         }
+        note.m_and = false;
 
-        // タイがあった。長さと秒数を再計算
-        size_t k = 0;
-        float length = 0, sec = 0;
-        do {
-            length += m_notes[i + k].m_length;
-            sec += m_notes[i + k].m_sec;
-            ++k;
-        } while (m_notes[i + k].m_and);
-        length += m_notes[i + k].m_length;
-        sec += m_notes[i + k].m_sec;
+        note.m_gate = float(gate);
+        if (note.m_key == KEY_SPECIAL_ACTION)
+            schedule_special_action(note.m_gate, note.m_data);
+        if (note.m_key == KEY_REG || note.m_key == KEY_ENVELOP_INTERVAL || note.m_key == KEY_ENVELOP_TYPE)
+            m_writes_all = true;
+        gate += note.m_sec;
+    }
+    m_notes.erase(m_notes.begin() + count, m_notes.end());
+    m_goal = float(gate);
+} // VskPhrase::finalize
 
-        // 新しい長さと秒数を格納
-        m_notes[i].m_length = length;
-        m_notes[i].m_sec = sec;
+// 波形を実現する（プレーヤーのチャンネル数で）。
+// 合成を省いた区間は、並列描画用の音源 #iworker から num_threads 個（0なら自動）で描画する
+VskSampleBuffer VskPhrase::realize(int ich, size_t iworker, size_t num_threads)
+{
+    assert(m_player != nullptr);
 
-        new_notes.push_back(m_notes[i]);
-        i += k; // 次の場所へ
+    // チャンネルに応じてチップに振り分ける
+    YM2203& ym = m_player->get_chip(ich / 3);
+    ich %= 3;
+
+    // 前の演奏のバッファを借りる
+    const int nch = m_player->m_num_channels;
+    auto count = uint32_t(m_goal * SAMPLERATE + 1) * nch;
+    VskSampleBuffer data(m_player->m_arena, count);
+    data.zero();
+
+    m_num_samples = count / nch;
+    m_keyframes.clear();
+    // キーフレームは少なくともVSK_KEYFRAME_INTERVALずつ離れるので、先に確保しておく
+    m_keyframes.reserve(m_num_samples / VSK_KEYFRAME_INTERVAL + 1);
+
+    // 記録するなら、フレーズの先頭から時刻を数え、
+    // SSGミキサーへの書き込みがどのチャンネルのものかを覚えておく
+    VskRegLog *recorder = m_player->m_recorder.get();
+    if (recorder)
+        recorder->begin_phrase(m_setting.m_fm ? -1 : ich);
+
+    auto& timbre = m_setting.m_timbre;
+    if (m_setting.m_fm) { // FM sound?
+        ym.fm_set_timbre(ich, &timbre);
+        if (recorder && ym.fm_has_lfo(ich))
+            recorder->m_lfo = true;
     }
 
-    m_notes = std::move(new_notes);
-} // VskPhrase::rescan_notes
+    // SSGだけのフレーズなら、FMが鳴っていない区間の合成を省いて、後から並列に描画する。
+    // FMのフレーズは順番に合成する
+    bool skipping = !m_setting.m_fm;
+    uint32_t isample = realize_notes(ym, ich, false, skipping, 0, 0, timbre, &data[0], 0, m_num_samples);
+    if (skipping)
+        realize_skipped(ich, &data[0], iworker, num_threads);
+    m_isample_end = isample;
 
-// 音符再生の時刻とゴール（演奏終了）の時刻を更新する
-void VskPhrase::calc_gate_and_goal() {
-    float gate = 0;
-    for (auto& note : m_notes) {
-        note.m_gate = gate;
-        gate += note.m_sec;
-    }
-    m_goal = gate;
+    // 最後の音符の後の無音も進み具合に数える
+    VskCancelToken *cancel = m_player->m_cancel.get();
+    if (cancel && !cancel->is_cancelled() && isample < m_num_samples)
+        cancel->m_samples_done += m_num_samples - isample;
+
+    if (recorder)
+        recorder->end_phrase();
+
+    return data;
 }
 
-// 波形を実現する（ステレオ）
-std::unique_ptr<VSK_PCM16_VALUE[]> VskPhrase::realize(int ich, size_t *pdata_size)
+// 前の描画 old のキーフレーム #ikeyframe から実現し直す。それより前の波形は old_data から写す。
+// 音符はキーフレームの位置まで old と同じで、音源は old を実現する前と同じ状態であること。
+// old のキーフレームは引き継ぐ
+VskSampleBuffer VskPhrase::realize_from(int ich, VskPhrase& old, size_t ikeyframe,
+                                        const VskSampleBuffer& old_data,
+                                        size_t iworker, size_t num_threads)
 {
     assert(m_player != nullptr);
+    assert(&old != this);
+    assert(ikeyframe < old.m_keyframes.size());
 
-    // チャンネルに応じてチップに振り分ける
-    YM2203& ym = (ich >= 3) ? m_player->m_ym1 : m_player->m_ym0;
-    if (ich >= 3)
-        ich -= 3;
+    YM2203& ym = m_player->get_chip(ich / 3);
+    ich %= 3;
 
-    // メモリーを割り当て
-    auto count = uint32_t(m_goal * SAMPLERATE + 1) * 2; // stereo
-    *pdata_size = count * sizeof(VSK_PCM16_VALUE);
-    auto data = std::make_unique<VSK_PCM16_VALUE[]>(count);
-    std::memset(&data[0], 0, *pdata_size);
+    const int nch = m_player->m_num_channels;
+    auto count = uint32_t(m_goal * SAMPLERATE + 1) * nch;
+    VskSampleBuffer data(m_player->m_arena, count);
+    m_num_samples = count / nch;
 
-    uint32_t isample = 0;
-    if (m_setting.m_fm) { // FM sound?
-        auto& timbre = m_setting.m_timbre;
-        ym.fm_set_timbre(ich, &timbre);
+    // キーフレームより前はそのまま使う。キーフレーム自身は描画し直すときにまた記録される
+    m_keyframes = std::move(old.m_keyframes);
+    VskPhraseKeyframe keyframe = m_keyframes[ikeyframe];
+    m_keyframes.erase(m_keyframes.begin() + ikeyframe, m_keyframes.end());
+    m_keyframes.reserve(m_num_samples / VSK_KEYFRAME_INTERVAL + 1);
+
+    size_t prefix = std::min(size_t(keyframe.m_isample) * nch, std::min(old_data.size(), data.size()));
+    std::memcpy(data.data(), old_data.data(), prefix * sizeof(VSK_SAMPLE_VALUE));
+    std::memset(data.data() + prefix, 0, (data.size() - prefix) * sizeof(VSK_SAMPLE_VALUE));
+
+    VskCancelToken *cancel = m_player->m_cancel.get();
+    if (cancel)
+        cancel->m_samples_done += keyframe.m_isample;
 
-        VskLFOCtrl lc;
-        lc.init_for_timbre(&timbre);
+    ym.restore(keyframe.m_snapshot);
+    m_setting.m_timbre = keyframe.m_timbre;
 
-        for (auto& note : m_notes) { // For each note
-            if (note.m_key == KEY_SPECIAL_ACTION) { // Special action?
-                schedule_special_action(note.m_gate, note.m_data);
-                continue;
+    auto& timbre = m_setting.m_timbre;
+    bool skipping = !m_setting.m_fm;
+    uint32_t isample = realize_notes(ym, ich, false, skipping, keyframe.m_inote, keyframe.m_isample,
+                                     timbre, &data[0], 0, m_num_samples);
+    if (skipping)
+        realize_skipped(ich, &data[0], iworker, num_threads, ikeyframe);
+    m_isample_end = isample;
+
+    if (cancel && !cancel->is_cancelled() && isample < m_num_samples)
+        cancel->m_samples_done += m_num_samples - isample;
+
+    return data;
+}
+
+// 合成を省いた区間を、キーフレームから別々の音源で並列に描画する。
+// キーフレーム #ifirst より前の区間は描画済みとする
+void VskPhrase::realize_skipped(int ich, VSK_SAMPLE_VALUE *data, size_t iworker, size_t num_threads,
+                                size_t ifirst)
+{
+    // 合成を省いた区間を集める
+    std::vector<size_t> todo;
+    for (size_t i = ifirst; i < m_keyframes.size(); ++i) {
+        if (m_keyframes[i].m_skipped)
+            todo.push_back(i);
+    }
+    if (todo.empty())
+        return;
+
+    // 区間を描画する。合成済みの部分も同じ値で上書きされる
+    const int nch = m_player->m_num_channels;
+    auto render_segment = [this, ich, data, nch](YM2203& chip, size_t i) {
+        uint32_t begin = m_keyframes[i].m_isample;
+        uint32_t end = (i + 1 < m_keyframes.size()) ? m_keyframes[i + 1].m_isample : m_num_samples;
+        VskSampleBuffer segment(m_player->m_arena, (end - begin) * nch);
+        segment.zero();
+        realize_range(chip, ich, begin, end, segment.data());
+        std::memcpy(&data[begin * nch], segment.data(), segment.size() * sizeof(VSK_SAMPLE_VALUE));
+    };
+
+    if (num_threads == 0)
+        num_threads = m_player->m_num_threads;
+    if (num_threads == 0)
+        num_threads = unboost::thread::hardware_concurrency();
+    if (num_threads > todo.size())
+        num_threads = todo.size();
+    if (num_threads <= 1) {
+        for (auto i : todo)
+            render_segment(m_player->get_worker_chip(iworker), i);
+        return;
+    }
+
+    // スレッドごとに音源を用意する
+    for (size_t k = 0; k < num_threads; ++k)
+        m_player->get_worker_chip(iworker + k);
+
+    // 空いたスレッドが次の区間を取っていく
+    unboost::mutex lock;
+    size_t next = 0;
+    std::vector<std::unique_ptr<unboost::thread>> threads;
+    for (size_t k = 0; k < num_threads; ++k) {
+        YM2203& chip = m_player->get_worker_chip(iworker + k);
+        threads.emplace_back(new unboost::thread([&, k](int dummy) {
+            for (;;) {
+                lock.lock();
+                size_t j = next++;
+                lock.unlock();
+                if (j >= todo.size())
+                    break;
+                render_segment(chip, todo[j]);
             }
+        }, 0));
+    }
+    for (auto& thread : threads)
+        thread->join();
+}
+
+// 直前のキーフレームから音源を復元して、サンプル位置[isample_begin, isample_end)の
+// 波形だけを実現する。dataはゼロで初期化しておくこと。
+// realizeでキーフレームを記録していなければ失敗する
+bool VskPhrase::realize_range(YM2203& ym, int ich, uint32_t isample_begin, uint32_t isample_end,
+                              VSK_SAMPLE_VALUE *data)
+{
+    if (m_keyframes.empty())
+        return false;
+
+    // isample_begin以前の最後のキーフレームを探す
+    auto it = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), isample_begin,
+        [](uint32_t isample, const VskPhraseKeyframe& keyframe) {
+            return isample < keyframe.m_isample;
+        }
+    );
+    assert(it != m_keyframes.begin());
+    --it;
+
+    if (!ym.restore(it->m_snapshot))
+        return false;
+
+    ich %= 3;
+
+    YM2203_Timbre timbre = it->m_timbre;
+    realize_notes(ym, ich, true, false, it->m_inote, it->m_isample, timbre,
+                  data, isample_begin, isample_end);
+    return true;
+}
 
-            if (note.m_key == KEY_TONE) { // Tone change?
+// inote番目の音符からサンプル位置isampleとして実現する。
+// dataはサンプル位置[isample_base, isample_limit)の波形を受け取る。
+// シーク中でなければキーフレームを記録し、シーク中なら範囲の終わりで止まる。
+// skippingなら、FMが鳴っていない区間は合成せずに音源の時間だけ進める。
+// 戻り値は実現し終えたサンプル位置
+uint32_t VskPhrase::realize_notes(YM2203& ym, int ich, bool seeking, bool skipping, size_t inote, uint32_t isample,
+                                  YM2203_Timbre& timbre, VSK_SAMPLE_VALUE *data,
+                                  uint32_t isample_base, uint32_t isample_limit)
+{
+    // 記録するなら、書き込みの時刻を合わせる
+    VskRegLog *recorder = (seeking ? nullptr : m_player->m_recorder.get());
+
+    // 取り消せるなら、描画をブロックに分けて間で調べる
+    VskCancelToken *cancel = m_player->m_cancel.get();
+
+    // 波形を描画する
+    const int nch = m_player->m_num_channels;
+    std::vector<VSK_SAMPLE_VALUE> scratch;
+    auto mix_block = [&](uint32_t isample, int nsamples) {
+        if (isample_base <= isample && isample + nsamples <= isample_limit) {
+            ym.mix(&data[(isample - isample_base) * nch], nsamples);
+            return;
+        }
+        // 範囲からはみ出す場合は一時バッファに描画して、範囲内だけを写す
+        scratch.assign(nsamples * nch, 0);
+        ym.mix(scratch.data(), nsamples);
+        for (int i = 0; i < nsamples; ++i) {
+            uint32_t k = isample + i;
+            if (isample_base <= k && k < isample_limit) {
+                for (int j = 0; j < nch; ++j)
+                    data[(k - isample_base) * nch + j] = scratch[i * nch + j];
+            }
+        }
+    };
+    auto mix = [&](uint32_t isample, int nsamples) {
+        if (recorder)
+            recorder->m_now = isample + nsamples;
+        if (skipping && ym.skip(nsamples)) {
+            if (nsamples)
+                m_keyframes.back().m_skipped = true;
+            if (cancel)
+                cancel->m_samples_done += nsamples;
+            return;
+        }
+        if (!cancel) {
+            mix_block(isample, nsamples);
+            return;
+        }
+        while (nsamples > 0 && !cancel->is_cancelled()) {
+            int n = std::min(nsamples, VSK_RENDER_BLOCK);
+            mix_block(isample, n);
+            if (!seeking)
+                cancel->m_samples_done += n;
+            isample += n;
+            nsamples -= n;
+        }
+    };
+
+    // レジスタに書き込む。シーク中はシーク用の音源だけに書き込む
+    auto write_reg = [&](uint32_t addr, uint32_t value) {
+        if (seeking)
+            ym.write_reg(addr, value);
+        else
+            m_player->write_reg(addr, value);
+    };
+
+    for (; inote < m_notes.size(); ++inote) {
+        auto& note = m_notes[inote];
+
+        if (cancel && cancel->is_cancelled())
+            break;
+
+        if (recorder)
+            recorder->m_now = isample;
+
+        if (seeking) {
+            if (isample >= isample_limit)
+                break;
+        } else if (m_keyframes.empty() ||
+                   isample - m_keyframes.back().m_isample >= VSK_KEYFRAME_INTERVAL)
+        {
+            // キーフレームを記録する
+            m_keyframes.emplace_back();
+            auto& keyframe = m_keyframes.back();
+            keyframe.m_inote = inote;
+            keyframe.m_isample = isample;
+            ym.snapshot(keyframe.m_snapshot);
+            keyframe.m_timbre = timbre;
+        }
+
+        if (note.m_key == KEY_SPECIAL_ACTION) // Special action? (予約はfinalizeで済んでいる)
+            continue;
+
+        if (note.m_key == KEY_TONE) { // Tone change?
+            if (m_setting.m_fm) {
                 const auto new_tone = note.m_data;
                 assert((0 <= new_tone) && (new_tone < NUM_TONES));
                 timbre = ym2203_tone_table[new_tone];
                 ym.fm_set_timbre(ich, &timbre);
-                lc.init_for_timbre(&timbre);
-                continue;
+                if (recorder && ym.fm_has_lfo(ich))
+                    recorder->m_lfo = true;
             }
+            continue;
+        }
 
-            if (note.m_key == KEY_REG) { // Register?
-                m_player->write_reg(note.m_reg, note.m_data);
-                continue;
-            }
+        if (note.m_key == KEY_REG) { // Register?
+            write_reg(note.m_reg, note.m_data);
+            continue;
+        }
 
-            if (note.m_key == KEY_ENVELOP_INTERVAL) {
-                auto interval = note.m_data;
-                m_player->write_reg(ADDR_SSG_ENV_FREQ_L, (interval & 0xFF));
-                m_player->write_reg(ADDR_SSG_ENV_FREQ_H, ((interval >> 8) & 0xFF));
-                continue;
-            }
+        if (note.m_key == KEY_ENVELOP_INTERVAL) {
+            auto interval = note.m_data;
+            write_reg(ADDR_SSG_ENV_FREQ_L, (interval & 0xFF));
+            write_reg(ADDR_SSG_ENV_FREQ_H, ((interval >> 8) & 0xFF));
+            continue;
+        }
 
-            if (note.m_key == KEY_ENVELOP_TYPE) {
-                auto type = note.m_data;
-                m_player->write_reg(ADDR_SSG_ENV_TYPE, (type & 0x0F));
-                continue;
-            }
+        if (note.m_key == KEY_ENVELOP_TYPE) {
+            auto type = note.m_data;
+            write_reg(ADDR_SSG_ENV_TYPE, (type & 0x0F));
+            continue;
+        }
 
+        if (m_setting.m_fm) { // FM sound?
             // 左右を設定する
             auto LR = note.m_LR;
             auto pms = timbre.pms;
@@ -410,39 +518,17 @@ std::unique_ptr<VSK_PCM16_VALUE[]> VskPhrase::realize(int ich, size_t *pdata_siz
                 ym.write_reg(0xB4 + i, value);
             }
 
-            if (note.m_key != KEY_SPECIAL_REST) { // Not special rest?
-                // do key on
-                if (note.m_key != KEY_REST) { // Has key?
-                    ym.fm_set_pitch(ich, note.m_octave, note.m_key);
-                    ym.fm_set_volume(ich, int(note.m_volume));
-                    ym.fm_key_on(ich);
-                }
-
-                lc.init_for_keyon(&timbre);
+            // do key on. LFOは音源が1サンプルごとにかける
+            if (note.m_key != KEY_REST && note.m_key != KEY_SPECIAL_REST) { // Has key?
+                ym.fm_set_pitch(ich, note.m_octave, note.m_key);
+                ym.fm_set_volume(ich, int(note.m_volume));
+                ym.fm_key_on(ich);
             }
 
             // render sound
             auto sec = note.m_sec * note.m_quantity / 8.0f;
             auto nsamples = int(SAMPLERATE * sec);
-            int unit;
-            while (nsamples) {
-                unit = SAMPLERATE / LFO_INTERVAL;
-                if (unit > nsamples) {
-                    unit = nsamples;
-                }
-                ym.mix(&data[isample * 2], unit);
-                isample += unit;
-                if (note.m_key != KEY_REST && note.m_key != KEY_SPECIAL_REST) {
-                    lc.increment();
-                    int adj[4] = {
-                        int(lc.m_adj_v[0]), int(lc.m_adj_v[1]),
-                        int(lc.m_adj_v[2]), int(lc.m_adj_v[3]),
-                    };
-                    ym.fm_set_volume(ich, int(note.m_volume), adj);
-                    ym.fm_set_pitch(ich, note.m_octave, note.m_key, int(lc.m_adj_p));
-                }
-                nsamples -= unit;
-            }
+            mix(isample, nsamples);
             ym.count(uint32_t(sec * 1000 * 1000));
             isample += nsamples;
 
@@ -452,39 +538,16 @@ std::unique_ptr<VSK_PCM16_VALUE[]> VskPhrase::realize(int ich, size_t *pdata_siz
                 // do key off
                 ym.fm_key_off(ich);
             }
-            unit = SAMPLERATE;
+            int unit = SAMPLERATE;
             if (unit > nsamples) {
                 unit = nsamples;
             }
-            ym.mix(&data[isample * 2], unit);
+            mix(isample, unit);
+            if (cancel && !seeking)
+                cancel->m_samples_done += nsamples - unit;
             ym.count(uint32_t(sec * 1000 * 1000));
             isample += nsamples;
-        }
-    } else { // SSG sound?
-        for (auto& note : m_notes) {
-            if (note.m_key == KEY_SPECIAL_ACTION) { // Special action?
-                schedule_special_action(note.m_gate, note.m_data);
-                continue;
-            }
-
-            if (note.m_key == KEY_REG) { // Register?
-                m_player->write_reg(note.m_reg, note.m_data);
-                continue;
-            }
-
-            if (note.m_key == KEY_ENVELOP_INTERVAL) {
-                auto interval = note.m_data;
-                m_player->write_reg(ADDR_SSG_ENV_FREQ_L, (interval & 0xFF));
-                m_player->write_reg(ADDR_SSG_ENV_FREQ_H, ((interval >> 8) & 0xFF));
-                continue;
-            }
-
-            if (note.m_key == KEY_ENVELOP_TYPE) {
-                auto type = note.m_data;
-                m_player->write_reg(ADDR_SSG_ENV_TYPE, (type & 0x0F));
-                continue;
-            }
-
+        } else { // SSG sound?
             // do key on
             if (note.m_key != KEY_REST && note.m_key != KEY_SPECIAL_REST) {
                 ym.ssg_set_pitch(ich, note.m_octave, note.m_key);
@@ -495,7 +558,7 @@ std::unique_ptr<VSK_PCM16_VALUE[]> VskPhrase::realize(int ich, size_t *pdata_siz
             // render sound
             auto sec = note.m_sec * note.m_quantity / 8.0f;
             auto nsamples = int(SAMPLERATE * sec);
-            ym.mix(&data[isample * 2], nsamples);
+            mix(isample, nsamples);
             ym.count(uint32_t(sec * 1000 * 1000));
             isample += nsamples;
 
@@ -505,69 +568,363 @@ std::unique_ptr<VSK_PCM16_VALUE[]> VskPhrase::realize(int ich, size_t *pdata_siz
                 // do key off
                 ym.ssg_key_off(ich);
             }
-            ym.mix(&data[isample * 2], nsamples);
+            mix(isample, nsamples);
             ym.count(uint32_t(sec * 1000 * 1000));
             isample += nsamples;
         }
     }
 
-    return data;
+    return isample;
+}
+
+// 波形を実現せずに、実現したときの副作用（音色の変更、
+// レジスタの書き込み）だけを行う。キャッシュが見つかったときに使う
+void VskPhrase::skip_realize(int ich)
+{
+    assert(m_player != nullptr);
+
+    // チャンネルに応じてチップに振り分ける
+    YM2203& ym = m_player->get_chip(ich / 3);
+    ich %= 3;
+
+    for (auto& note : m_notes) {
+        switch (note.m_key) {
+        case KEY_TONE: // Tone change?
+            if (m_setting.m_fm) {
+                const auto new_tone = note.m_data;
+                assert((0 <= new_tone) && (new_tone < NUM_TONES));
+                m_setting.m_timbre = ym2203_tone_table[new_tone];
+            }
+            break;
+        case KEY_REG: // Register?
+            m_player->write_reg(note.m_reg, note.m_data);
+            break;
+        case KEY_ENVELOP_INTERVAL:
+            m_player->write_reg(ADDR_SSG_ENV_FREQ_L, (note.m_data & 0xFF));
+            m_player->write_reg(ADDR_SSG_ENV_FREQ_H, ((note.m_data >> 8) & 0xFF));
+            break;
+        case KEY_ENVELOP_TYPE:
+            m_player->write_reg(ADDR_SSG_ENV_TYPE, (note.m_data & 0x0F));
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (m_setting.m_fm)
+        ym.fm_set_timbre(ich, &m_setting.m_timbre);
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // WAVEヘッダ
 
-#define WAV_HEADER_SIZE 44 // WAVEヘッダのバイトサイズ
-
-// WAVEヘッダを取得する
-static uint8_t*
-get_wav_header(uint32_t data_size, uint32_t sample_rate, uint16_t bit_depth, bool stereo)
-{
-    static uint8_t wav_header[WAV_HEADER_SIZE] = { 0 };
+#define WAV_HEADER_MAX_SIZE 68 // WAVEヘッダの最大バイトサイズ
 
-    std::memcpy(&wav_header[0], "RIFF", 4);
-    std::memcpy(&wav_header[8], "WAVE", 4);
-    std::memcpy(&wav_header[12], "fmt ", 4);
-    std::memcpy(&wav_header[36], "data", 4);
+// WAVE_FORMAT_EXTENSIBLE のサブ形式 KSDATAFORMAT_SUBTYPE_PCM
+static const uint8_t s_subtype_pcm[16] = {
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+    0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+};
 
+// WAVEヘッダを取得する。ヘッダのバイトサイズを返す。
+// 16ビットは従来どおりの44バイトのPCM、24ビットはWAVE_FORMAT_EXTENSIBLE、
+// 浮動小数点数はfactチャンクつきのWAVE_FORMAT_IEEE_FLOATになる
+static size_t
+get_wav_header(uint8_t (&wav_header)[WAV_HEADER_MAX_SIZE],
+               uint32_t data_size, uint32_t sample_rate, VskSampleFormat format, bool stereo)
+{
     uint16_t num_channels = (stereo ? 2 : 1);
-    uint16_t block_align = num_channels * (bit_depth / 8);
-    uint32_t byte_rate = sample_rate * num_channels * (bit_depth / 8);
+    uint16_t bytes_per_sample = uint16_t(vsk_sample_format_size(format));
+    uint16_t bit_depth = bytes_per_sample * 8;
+    uint16_t block_align = num_channels * bytes_per_sample;
+    uint32_t byte_rate = sample_rate * block_align;
 
-    uint32_t chunk_size = data_size + WAV_HEADER_SIZE - 8;
+    uint16_t audio_format = 1; // WAVE_FORMAT_PCM
     uint32_t subchunk1_size = 16;
-    uint16_t audio_format = 1; // PCM
+    bool has_fact = false;
+    if (format == VSK_SAMPLE_FORMAT_F32) {
+        audio_format = 3; // WAVE_FORMAT_IEEE_FLOAT
+        subchunk1_size = 18;
+        has_fact = true;
+    } else if (format == VSK_SAMPLE_FORMAT_S24) {
+        audio_format = 0xFFFE; // WAVE_FORMAT_EXTENSIBLE
+        subchunk1_size = 40;
+    }
 
     // Windows なのでリトルエンディアンを仮定する
+    size_t i = 0;
+    auto put = [&](const void *data, size_t size) {
+        std::memcpy(&wav_header[i], data, size);
+        i += size;
+    };
+    auto put16 = [&](uint16_t value) { put(&value, 2); };
+    auto put32 = [&](uint32_t value) { put(&value, 4); };
+
+    put("RIFF", 4);
+    put32(0); // 後で書き直す
+    put("WAVE", 4);
+
+    put("fmt ", 4);
+    put32(subchunk1_size);
+    put16(audio_format);
+    put16(num_channels);
+    put32(sample_rate);
+    put32(byte_rate);
+    put16(block_align);
+    put16(bit_depth);
+    if (format == VSK_SAMPLE_FORMAT_F32) {
+        put16(0); // cbSize
+    } else if (format == VSK_SAMPLE_FORMAT_S24) {
+        put16(22); // cbSize
+        put16(bit_depth); // wValidBitsPerSample
+        put32(stereo ? 0x3 : 0x4); // dwChannelMask (FL|FR か FC)
+        put(s_subtype_pcm, sizeof(s_subtype_pcm));
+    }
+
+    if (has_fact) {
+        put("fact", 4);
+        put32(4);
+        put32(data_size / block_align); // サンプル数
+    }
+
+    put("data", 4);
+    put32(data_size);
+
+    // RIFFチャンクは偶数バイトに揃える
+    uint32_t chunk_size = uint32_t(i - 8) + data_size + (data_size & 1);
     std::memcpy(&wav_header[4], &chunk_size, 4);
-    std::memcpy(&wav_header[16], &subchunk1_size, 4);
-    std::memcpy(&wav_header[20], &audio_format, 2);
-    std::memcpy(&wav_header[22], &num_channels, 2);
-    std::memcpy(&wav_header[24], &sample_rate, 4);
-    std::memcpy(&wav_header[28], &byte_rate, 4);
-    std::memcpy(&wav_header[32], &block_align, 2);
-    std::memcpy(&wav_header[34], &bit_depth, 2);
-    std::memcpy(&wav_header[40], &data_size, 4);
 
-    return wav_header;
+    return i;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// サンプルの形式
+
+bool vsk_sample_format_from_name(const char *name, VskSampleFormat& format)
+{
+    if (std::strcmp(name, "s16") == 0 || std::strcmp(name, "S16") == 0) {
+        format = VSK_SAMPLE_FORMAT_S16;
+        return true;
+    }
+    if (std::strcmp(name, "s24") == 0 || std::strcmp(name, "S24") == 0) {
+        format = VSK_SAMPLE_FORMAT_S24;
+        return true;
+    }
+    if (std::strcmp(name, "f32") == 0 || std::strcmp(name, "F32") == 0) {
+        format = VSK_SAMPLE_FORMAT_F32;
+        return true;
+    }
+    return false;
+}
+
+// 一時バッファがキャッシュに収まる大きさ（値の個数）
+#define VSK_CONVERT_CHUNK 4096
+
+// 分岐のない単純なループにして、コンパイラーにベクトル化させる
+void vsk_convert_pcm16(const VSK_PCM16_VALUE *src, size_t count, VskSampleFormat format, void *dest)
+{
+    switch (format) {
+    case VSK_SAMPLE_FORMAT_S16:
+        std::memcpy(dest, src, count * sizeof(VSK_PCM16_VALUE));
+        break;
+    case VSK_SAMPLE_FORMAT_S24:
+        {
+            // 下位8ビットを0にした24ビットのリトルエンディアン
+            uint8_t *out = reinterpret_cast<uint8_t *>(dest);
+            for (size_t i = 0; i < count; ++i) {
+                uint16_t value = uint16_t(src[i]);
+                out[3 * i + 0] = 0;
+                out[3 * i + 1] = uint8_t(value);
+                out[3 * i + 2] = uint8_t(value >> 8);
+            }
+        }
+        break;
+    case VSK_SAMPLE_FORMAT_F32:
+        {
+            // [-1.0, 1.0) に正規化する
+            float *out = reinterpret_cast<float *>(dest);
+            const float scale = 1.0f / 32768.0f;
+            for (size_t i = 0; i < count; ++i)
+                out[i] = float(src[i]) * scale;
+        }
+        break;
+    }
+}
+
+// 足し合わせた値を16ビットに収める
+static inline VSK_PCM16_VALUE vsk_clip_pcm16(int32_t value) {
+    if (value < std::numeric_limits<VSK_PCM16_VALUE>::min())
+        return std::numeric_limits<VSK_PCM16_VALUE>::min();
+    if (value > std::numeric_limits<VSK_PCM16_VALUE>::max())
+        return std::numeric_limits<VSK_PCM16_VALUE>::max();
+    return VSK_PCM16_VALUE(value);
+}
+
+void vsk_convert_pcm32(const int32_t *src, size_t count, VskSampleFormat format, void *dest)
+{
+    switch (format) {
+    case VSK_SAMPLE_FORMAT_S16:
+        {
+            VSK_PCM16_VALUE *out = reinterpret_cast<VSK_PCM16_VALUE *>(dest);
+            size_t i = 0;
+#ifdef VSK_USE_SSE2
+            // 飽和付きで詰めると、8個ずつ16ビットに収められる
+            for (; i + 8 <= count; i += 8) {
+                __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&src[i]));
+                __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&src[i + 4]));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(&out[i]), _mm_packs_epi32(lo, hi));
+            }
+#endif
+            for (; i < count; ++i)
+                out[i] = vsk_clip_pcm16(src[i]);
+        }
+        break;
+    case VSK_SAMPLE_FORMAT_S24:
+        {
+            // 音源の分解能は16ビットなので、16ビットに収めてから下位8ビットを0にする
+            uint8_t *out = reinterpret_cast<uint8_t *>(dest);
+            size_t i = 0;
+#ifdef VSK_USE_SSE2
+            // 16ビットに収めた値を32ビットの {0, 下位, 上位, 0} に広げ、64ビットごとに
+            // 2個を6バイトに詰める。8バイトずつ重ねて書くので、後ろに1個以上残しておく
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i lo32 = _mm_set_epi32(0, -1, 0, -1);
+            const __m128i hi32 = _mm_set_epi32(-1, 0, -1, 0);
+            for (; i + 8 < count; i += 8) {
+                __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&src[i]));
+                __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&src[i + 4]));
+                __m128i packed = _mm_packs_epi32(lo, hi);
+                __m128i a = _mm_srli_epi32(_mm_unpacklo_epi16(zero, packed), 8);
+                __m128i b = _mm_srli_epi32(_mm_unpackhi_epi16(zero, packed), 8);
+                a = _mm_or_si128(_mm_and_si128(a, lo32), _mm_srli_epi64(_mm_and_si128(a, hi32), 8));
+                b = _mm_or_si128(_mm_and_si128(b, lo32), _mm_srli_epi64(_mm_and_si128(b, hi32), 8));
+                uint8_t *p = &out[3 * i];
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(p + 0), a);
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(p + 6), _mm_srli_si128(a, 8));
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(p + 12), b);
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(p + 18), _mm_srli_si128(b, 8));
+            }
+#endif
+            for (; i < count; ++i) {
+                uint16_t value = uint16_t(vsk_clip_pcm16(src[i]));
+                out[3 * i + 0] = 0;
+                out[3 * i + 1] = uint8_t(value);
+                out[3 * i + 2] = uint8_t(value >> 8);
+            }
+        }
+        break;
+    case VSK_SAMPLE_FORMAT_F32:
+        {
+            // 16ビットを越えた値も飽和させずに残す
+            float *out = reinterpret_cast<float *>(dest);
+            const float scale = 1.0f / 32768.0f;
+            size_t i = 0;
+#ifdef VSK_USE_SSE2
+            const __m128 scale4 = _mm_set1_ps(scale);
+            for (; i + 4 <= count; i += 4) {
+                __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&src[i]));
+                _mm_storeu_ps(&out[i], _mm_mul_ps(_mm_cvtepi32_ps(value), scale4));
+            }
+#endif
+            for (; i < count; ++i)
+                out[i] = float(src[i]) * scale;
+        }
+        break;
+    }
+}
+
+static inline void
+vsk_convert_samples(const VSK_PCM16_VALUE *src, size_t count, VskSampleFormat format, void *dest)
+{
+    vsk_convert_pcm16(src, count, format, dest);
+}
+
+static inline void
+vsk_convert_samples(const int32_t *src, size_t count, VskSampleFormat format, void *dest)
+{
+    vsk_convert_pcm32(src, count, format, dest);
+}
+
+// 波形を指定の形式に変換しながら書き込む。書き込んだバイト数を返す。失敗したら-1
+template <typename T_VALUE>
+static int64_t
+vsk_write_samples(FILE *fout, const T_VALUE *data, size_t count, VskSampleFormat format)
+{
+    const size_t sample_size = vsk_sample_format_size(format);
+    if (format == VSK_SAMPLE_FORMAT_S16 && sizeof(T_VALUE) == sizeof(VSK_PCM16_VALUE)) {
+        if (count && std::fwrite(data, count * sample_size, 1, fout) != 1)
+            return -1;
+        return int64_t(count * sample_size);
+    }
+
+    // 一時バッファがキャッシュに収まる大きさずつ変換する
+    uint8_t buf[VSK_CONVERT_CHUNK * 4];
+    for (size_t i = 0; i < count; i += VSK_CONVERT_CHUNK) {
+        size_t n = std::min(size_t(VSK_CONVERT_CHUNK), count - i);
+        vsk_convert_samples(&data[i], n, format, buf);
+        if (std::fwrite(buf, n * sample_size, 1, fout) != 1)
+            return -1;
+    }
+    return int64_t(count * sample_size);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// VskPcmSink - 波形の出力先
+
+bool VskPcmSink::write_mix(const int32_t *data, size_t count)
+{
+    VSK_PCM16_VALUE buf[VSK_CONVERT_CHUNK];
+    for (size_t i = 0; i < count; i += VSK_CONVERT_CHUNK) {
+        size_t n = std::min(size_t(VSK_CONVERT_CHUNK), count - i);
+        vsk_convert_pcm32(&data[i], n, VSK_SAMPLE_FORMAT_S16, buf);
+        if (!write(buf, n))
+            return false;
+    }
+    return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // VskSoundPlayer - サウンドプレーヤー
 
 VskSoundPlayer::VskSoundPlayer(const char *rhythm_path)
-    : m_playing_music(false)
+    : m_engine(nullptr)
+    , m_playing_music(false)
     , m_stopping_event(false, false)
+    , m_fresh(true)
+    , m_num_threads(0)
+    , m_num_samples_generated(0)
+    , m_num_channels(2)
+    , m_sample_format(VSK_SAMPLE_FORMAT_S16)
+    , m_incremental(false)
+    , m_history_channels(0)
 {
     // YMを初期化
     m_ym0.init(CLOCK, SAMPLERATE, rhythm_path);
     m_ym1.init(CLOCK, SAMPLERATE, rhythm_path);
+    m_ym_seek.init(CLOCK, SAMPLERATE, rhythm_path);
+    if (rhythm_path)
+        m_rhythm_path = rhythm_path;
 
     for (int ich = 0; ich < SSG_CH_NUM; ++ich)
     {
         m_ym0.ssg_set_tone_or_noise(ich, TONE_MODE);
         m_ym1.ssg_set_tone_or_noise(ich, TONE_MODE);
     }
+
+    // 初期状態を覚えておく
+    m_ym0.snapshot(m_initial[0]);
+    m_ym1.snapshot(m_initial[1]);
+}
+
+// 音源を初期状態に戻す。リズム音の読み込みなどをやり直さずに、
+// 作成した直後と同じ波形が得られる
+void VskSoundPlayer::reset()
+{
+    m_ym0.restore(m_initial[0]);
+    m_ym1.restore(m_initial[1]);
+    for (auto& ym : m_ym_pool)
+        ym->restore(m_initial[1]);
+    m_fresh = true;
 }
 
 bool VskSoundPlayer::wait_for_stop(uint32_t milliseconds) {
@@ -581,109 +938,677 @@ bool VskSoundPlayer::play_and_wait(VskScoreBlock& block, uint32_t milliseconds,
     return wait_for_stop(milliseconds);
 }
 
-// PCM波形を生成する
-bool VskSoundPlayer::generate_pcm_raw(VskScoreBlock& block, std::vector<VSK_PCM16_VALUE>& values, bool stereo) {
-    std::vector<std::unique_ptr<VSK_PCM16_VALUE[]>> raw_data;
-    std::vector<size_t> data_sizes;
+// 二つの音符が同じか？
+static bool vsk_same_note(const VskNote& a, const VskNote& b) {
+    return a.m_tempo == b.m_tempo && a.m_octave == b.m_octave && a.m_LR == b.m_LR &&
+           a.m_key == b.m_key && a.m_dot == b.m_dot && a.m_length == b.m_length &&
+           a.m_sign == b.m_sign && a.m_sec == b.m_sec && a.m_gate == b.m_gate &&
+           a.m_volume == b.m_volume && a.m_quantity == b.m_quantity && a.m_and == b.m_and &&
+           a.m_reg == b.m_reg && a.m_data == b.m_data;
+}
 
-    // ステレオ音声として波形を実現する
-    int ich = 0;
-    const int source_num_channels = 2;
+// 二つの音色が同じか？（構造体の詰め物は比べない）
+static bool vsk_same_timbre(const YM2203_Timbre& a, const YM2203_Timbre& b) {
+    return std::memcmp(&a, &b, offsetof(YM2203_Timbre, sync) + 1) == 0 &&
+           a.speed == b.speed && a.pmd == b.pmd && a.amd == b.amd && a.pms == b.pms;
+}
+
+// 前の描画のフレーズと比べて、最初に変わった音符のインデックスを返す。
+// 何も変わっていなければSIZE_MAXを返す
+static size_t vsk_first_changed_note(const VskPhraseHistory& old, const VskPhrase& phrase) {
+    if (old.m_fm != phrase.m_setting.m_fm)
+        return 0;
+    if (phrase.m_setting.m_fm && !vsk_same_timbre(old.m_start_timbre, phrase.m_setting.m_timbre))
+        return 0;
+
+    auto& old_notes = old.m_phrase->m_notes;
+    size_t count = std::min(old_notes.size(), phrase.m_notes.size());
+    for (size_t inote = 0; inote < count; ++inote) {
+        if (!vsk_same_note(old_notes[inote], phrase.m_notes[inote]))
+            return inote;
+    }
+    if (old_notes.size() == phrase.m_notes.size() && old.m_phrase->m_goal == phrase.m_goal)
+        return SIZE_MAX;
+    return count;
+}
+
+// PCM波形を生成する。
+// mixでなければ混合せずに、実現したフレーズの波形をmix_framesのために残しておく。
+// mix_valuesがあれば、16ビットに収める前の混合した値もそこに格納する
+bool VskSoundPlayer::generate_pcm_raw(VskScoreBlock& block, std::vector<VSK_PCM16_VALUE>& values, bool stereo,
+                                      bool mix, std::vector<int32_t> *mix_values) {
+    // 前の演奏の配列を使い回す
+    auto& raw_data = m_phrase_buffers;
+    raw_data.clear();
+
+    // 音源の状態が変わる
+    const bool fresh = m_fresh;
+    m_fresh = false;
+
+    // 記録するなら、実現する間の書き込みを記録する
+    if (m_recorder)
+        m_recorder->attach(m_ym0, m_ym1);
+
+    // 出力と同じチャンネル数で波形を実現する
+    set_stereo(stereo);
+    VskStats *stats = get_stats();
+    const int num_channels = (stereo ? 2 : 1);
+
+    // 3チャンネルごとに音源を一つ使う。足りない音源は先に作っておく
+    const size_t num_groups = (block.size() + 2) / 3;
+    for (size_t k = 0; k < num_groups; ++k)
+        get_chip(k);
+
+    // 取り消されたら描画を始める前の状態に戻せるように、音源の状態を覚えておく
+    auto& saved_states = m_saved_states;
+    saved_states.resize(m_cancel ? num_groups : 0);
+    for (size_t k = 0; k < saved_states.size(); ++k)
+        get_chip(k).snapshot(saved_states[k]);
+
+    bool writes_all = false;
     for (auto& phrase : block) {
         if (phrase) {
-            phrase->calc_gate_and_goal();
-            phrase->rescan_notes();
+            phrase->finalize();
             phrase->set_player(this);
+            writes_all = writes_all || phrase->m_writes_all;
+            // realizeと同じ長さを、進み具合の分母に足しておく
+            if (m_cancel)
+                m_cancel->m_samples_total += uint32_t(phrase->m_goal * SAMPLERATE + 1);
+        }
+    }
+    raw_data.resize(block.size());
+
+    // 差分描画のために今回の描画を記録するか？ 前の描画の記録を使えるか？
+    if (!m_incremental)
+        m_history.clear();
+    const bool record = m_incremental && mix && fresh && !writes_all && !m_recorder;
+    const bool reuse = record && !m_history.empty() && m_history_channels == num_channels;
+    std::vector<VskPhraseHistory> history(record ? block.size() : 0);
+    std::vector<size_t> reused(block.size(), 0);        // 前の描画と同じになる先頭の値の個数
+    std::vector<char> unchanged(num_groups, reuse);     // 音源のそれまでのフレーズが前と同じか？
+
+    // フレーズを一つ実現する。前の描画と同じ部分は描画し直さない
+    auto realize_phrase = [&](size_t ich, size_t iworker, size_t num_threads) {
+        auto& phrase = block[ich];
+        const size_t ichip = ich / 3;
+        if (record) {
+            history[ich].m_phrase = phrase;
+            history[ich].m_fm = phrase->m_setting.m_fm;
+            history[ich].m_start_timbre = phrase->m_setting.m_timbre;
+        }
 
-            size_t data_size;
-            auto data = phrase->realize(ich, &data_size);
-            assert(data != nullptr);
+        VskPhraseHistory *old = nullptr;
+        size_t inote = 0;
+        if (unchanged[ichip] && ich < m_history.size() && m_history[ich].m_phrase) {
+            old = &m_history[ich];
+            inote = vsk_first_changed_note(*old, *phrase);
+        }
 
-            raw_data.push_back(std::move(data));
-            data_sizes.push_back(data_size);
+        if (old && inote == SIZE_MAX) {
+            // 変わっていないので、波形と音源の状態をそのまま使う
+            if (old->m_phrase != phrase) {
+                phrase->m_keyframes = std::move(old->m_phrase->m_keyframes);
+                phrase->m_num_samples = old->m_phrase->m_num_samples;
+                phrase->m_isample_end = old->m_phrase->m_isample_end;
+            }
+            phrase->m_setting.m_timbre = old->m_end_timbre;
+            get_chip(ichip).restore(old->m_end_state);
+            raw_data[ich] = std::move(old->m_data);
+            reused[ich] = raw_data[ich].size();
+        } else {
+            // 同じ音源の後のフレーズは、最初から描画し直す
+            unchanged[ichip] = false;
+
+            // 変わった音符より前の最後のキーフレームから描画し直す
+            size_t ikeyframe = 0;
+            if (old) {
+                auto& keyframes = old->m_phrase->m_keyframes;
+                auto it = std::upper_bound(keyframes.begin(), keyframes.end(), inote,
+                    [](size_t inote, const VskPhraseKeyframe& keyframe) {
+                        return inote < keyframe.m_inote;
+                    }
+                );
+                if (it != keyframes.begin())
+                    ikeyframe = (it - keyframes.begin()) - 1;
+            }
+            if (ikeyframe > 0) {
+                reused[ich] = size_t(old->m_phrase->m_keyframes[ikeyframe].m_isample) * num_channels;
+                raw_data[ich] = phrase->realize_from(int(ich), *old->m_phrase, ikeyframe, old->m_data,
+                                                     iworker, num_threads);
+            } else {
+                raw_data[ich] = phrase->realize(int(ich), iworker, num_threads);
+            }
         }
-        ++ich;
+        assert(raw_data[ich].data() != nullptr);
+
+        if (record) {
+            get_chip(ichip).snapshot(history[ich].m_end_state);
+            history[ich].m_end_timbre = phrase->m_setting.m_timbre;
+        }
+    };
+
+    // 音源ごとの組は互いに影響しないので、並列に実現できる。
+    // すべての音源に書き込む音符があるか、書き込みを記録するなら順番に実現する
+    size_t num_threads = m_num_threads;
+    if (num_threads == 0)
+        num_threads = unboost::thread::hardware_concurrency();
+    if (num_threads > num_groups)
+        num_threads = num_groups;
+    if (num_threads > 1 && !writes_all && !m_recorder) {
+        VskStageTimer timer(stats, VSK_STAGE_REALIZE);
+
+        // 組ごとに並列描画用の音源を一つずつ使う
+        for (size_t k = 0; k < num_groups; ++k)
+            get_worker_chip(k);
+
+        // 空いたスレッドが次の組を取っていく
+        unboost::mutex lock;
+        size_t next = 0;
+        std::vector<std::unique_ptr<unboost::thread>> threads;
+        for (size_t t = 0; t < num_threads; ++t) {
+            threads.emplace_back(new unboost::thread([&](int dummy) {
+                for (;;) {
+                    lock.lock();
+                    size_t k = next++;
+                    lock.unlock();
+                    if (k >= num_groups || is_cancelled())
+                        break;
+                    for (size_t ich = k * 3; ich < k * 3 + 3 && ich < block.size(); ++ich) {
+                        if (block[ich])
+                            realize_phrase(ich, k, 1);
+                    }
+                }
+            }, 0));
+        }
+        for (auto& thread : threads)
+            thread->join();
+    } else {
+        for (size_t ich = 0; ich < block.size() && !is_cancelled(); ++ich) {
+            if (block[ich]) {
+                VskStageTimer timer(stats, VSK_STAGE_REALIZE);
+                realize_phrase(ich, 0, 0);
+            }
+        }
+    }
+
+    if (m_recorder)
+        m_recorder->detach(m_ym0, m_ym1);
+
+    // 取り消されたら、途中までの波形は捨てる。前の描画の記録も使い切っているかもしれない。
+    // 音源は途中まで進んでいるので、描画を始める前の状態に戻す
+    if (is_cancelled()) {
+        raw_data.clear();
+        if (reuse)
+            m_history.clear();
+        for (size_t k = 0; k < saved_states.size(); ++k)
+            get_chip(k).restore(saved_states[k]);
+        m_fresh = fresh;
+        return false;
+    }
+
+    if (!mix) {
+        values.clear();
+        return true;
     }
 
-    // 最大のデータサイズを計算
-    size_t data_size = 0;
+    size_t total_size = 0;
+    for (auto& data : raw_data)
+        total_size += data.size() * sizeof(VSK_SAMPLE_VALUE);
+
+    // 最大の値の個数を計算
+    size_t data_count = 0;
     for (size_t i = 0; i < raw_data.size(); ++i) {
-        if (data_size < data_sizes[i])
-            data_size = data_sizes[i];
+        if (data_count < raw_data[i].size())
+            data_count = raw_data[i].size();
     }
 
     // 転送元のデータを計算
-    const size_t source_num_samples = data_size / sizeof(VSK_PCM16_VALUE) / source_num_channels;
-    const size_t source_num_values = source_num_samples * source_num_channels;
+    const size_t source_num_samples = data_count / num_channels;
+    const size_t source_num_values = source_num_samples * num_channels;
+    if (m_recorder)
+        m_recorder->end_block(uint32_t(source_num_samples));
 
     // 転送先の波形データを確保
+    values.resize(source_num_values);
+    if (stats)
+        stats->note_buffer(total_size + values.size() * sizeof(VSK_PCM16_VALUE));
+
+    // どのフレーズも前の描画と同じ部分は、前に混合した波形を写す。
+    // 前の波形は16ビットに収めてあるので、mix_valuesがあれば全体を混合し直す
+    VskStageTimer timer(stats, VSK_STAGE_MIX);
+    size_t mix_start = 0;
+    if (reuse && m_history.size() == block.size() && !mix_values) {
+        mix_start = std::min(source_num_values, m_history_values.size());
+        for (size_t ich = 0; ich < block.size(); ++ich) {
+            if (block[ich] || m_history[ich].m_phrase)
+                mix_start = std::min(mix_start, reused[ich]);
+        }
+        std::memcpy(values.data(), m_history_values.data(), mix_start * sizeof(VSK_PCM16_VALUE));
+    }
+
+    // 波形データを構築。チャンネルが多くても連続して読めるように、フレーズごとに足し込む
+    const size_t mix_count = source_num_values - mix_start;
+    VskArenaBuffer<int32_t> mixed(m_arena, mix_count);
+    mixed.zero();
+    int32_t *sum = mixed.data();
+    for (auto& data : raw_data) {
+        size_t count = std::min(data.size(), source_num_values);
+        const VSK_SAMPLE_VALUE *src = data.data();
+        for (size_t ivalue = mix_start; ivalue < count; ++ivalue)
+            sum[ivalue - mix_start] += src[ivalue];
+    }
+
+    // Clipping value
+    vsk_convert_pcm32(sum, mix_count, VSK_SAMPLE_FORMAT_S16, &values[mix_start]);
+    if (mix_values)
+        mix_values->assign(sum, sum + mix_count);
+
+    // 差分描画のために記録する。しなければバッファを置き場に返す
+    if (record) {
+        for (size_t ich = 0; ich < block.size(); ++ich)
+            history[ich].m_data = std::move(raw_data[ich]);
+        m_history = std::move(history);
+        m_history_channels = num_channels;
+        m_history_values.assign(values.begin(), values.end());
+    }
+    raw_data.clear();
+    return true;
+}
+
+// サンプル位置[start, end)の波形だけを生成する。
+// 各フレーズの直前のキーフレームから描画するので、先頭から描画するより速い。
+// 先にgenerate_pcm_rawでブロックを実現して、キーフレームを記録しておくこと
+bool VskSoundPlayer::render_range(VskScoreBlock& block, size_t start, size_t end,
+                                  std::vector<VSK_PCM16_VALUE>& values, bool stereo)
+{
+    // 全体のサンプル数を計算
+    size_t num_samples = 0;
+    for (auto& phrase : block) {
+        if (!phrase)
+            continue;
+        if (phrase->m_keyframes.empty())
+            return false;
+        if (num_samples < phrase->m_num_samples)
+            num_samples = phrase->m_num_samples;
+    }
+    if (end > num_samples)
+        end = num_samples;
+    if (start > end)
+        start = end;
+    const size_t count = end - start;
+
+    // 各フレーズの波形を出力と同じチャンネル数で描画して足し合わせる
+    set_stereo(stereo);
     const int num_channels = (stereo ? 2 : 1);
-    values.resize(source_num_samples * num_channels);
+    VskArenaBuffer<int32_t> mixed(m_arena, count * num_channels);
+    mixed.zero();
+    VskSampleBuffer data(m_arena, count * num_channels);
+    int ich = 0;
+    for (auto& phrase : block) {
+        if (phrase) {
+            size_t phrase_end = std::min(end, size_t(phrase->m_num_samples));
+            if (start < phrase_end) {
+                const size_t phrase_count = (phrase_end - start) * num_channels;
+                std::memset(data.data(), 0, phrase_count * sizeof(VSK_SAMPLE_VALUE));
+                if (!phrase->realize_range(m_ym_seek, ich, uint32_t(start), uint32_t(phrase_end), data.data()))
+                    return false;
+                for (size_t i = 0; i < phrase_count; ++i)
+                    mixed[i] += data[i];
+            }
+        }
+        ++ich;
+    }
 
     // 波形データを構築
-    VSK_PCM16_VALUE prev_value = 0;
-    for (size_t ivalue = 0; ivalue < source_num_values; ++ivalue) {
-        // Mixing
-        int32_t value = 0;
-        for (size_t i = 0; i < raw_data.size(); ++i) {
-            if (ivalue < data_sizes[i] / sizeof(VSK_PCM16_VALUE))
-                value += raw_data[i][ivalue];
+    values.resize(count * num_channels);
+    vsk_convert_pcm32(mixed.data(), values.size(), VSK_SAMPLE_FORMAT_S16, values.data());
+
+    return true;
+}
+
+// ブロックを描画して、最後の音符を実現し終えた位置までの波形をsinkに書き込む。
+// 音源は初期状態に戻さないので、次のブロックは書き込んだ波形のすぐ後から、
+// 音源の状態（鳴り残っている音も）を引き継いで続く。キャッシュは使わない。
+// フレーズの長さが違えば、短いフレーズの音源は次のブロックまで進まない
+bool VskSoundPlayer::render_stream(VskScoreBlock& block, VskPcmSink& sink, bool stereo)
+{
+    // s16でなければ、16ビットに収める前の値を渡す
+    std::vector<VSK_PCM16_VALUE>& values = m_stream_values;
+    const bool wide = (sink.get_format() != VSK_SAMPLE_FORMAT_S16);
+    if (!generate_pcm_raw(block, values, stereo, true, wide ? &m_mix_values : nullptr))
+        return false;
+
+    // 最後の音符の後の端数は、次のブロックの先頭として描画される
+    size_t num_samples = 0;
+    for (auto& phrase : block) {
+        if (phrase && num_samples < phrase->m_isample_end)
+            num_samples = phrase->m_isample_end;
+    }
+    const int num_channels = (stereo ? 2 : 1);
+    const size_t count = std::min(values.size(), num_samples * num_channels);
+    m_num_samples_generated += count / num_channels;
+
+    if (wide)
+        return sink.write_mix(m_mix_values.data(), count);
+    return sink.write(values.data(), count);
+}
+
+// 混合せずに残したフレーズの波形のフレーム数（ステレオなら左右で1フレーム）
+size_t VskSoundPlayer::get_phrase_frames() const
+{
+    size_t count = 0;
+    for (auto& data : m_phrase_buffers) {
+        if (count < data.size())
+            count = data.size();
+    }
+    return count / m_num_channels;
+}
+
+// 混合せずに残したフレーズの波形から、フレーム位置[iframe, iframe + frames)を
+// outに直接混合する。確保もロックもしないので、オーディオのコールバックから呼べる。
+// 書き込んだフレーム数を返す
+size_t VskSoundPlayer::mix_frames(size_t iframe, VSK_PCM16_VALUE *out, size_t frames) const
+{
+    size_t total = get_phrase_frames();
+    if (iframe >= total)
+        return 0;
+    if (frames > total - iframe)
+        frames = total - iframe;
+
+    const size_t begin = iframe * m_num_channels;
+    const size_t end = (iframe + frames) * m_num_channels;
+    for (size_t ivalue = begin; ivalue < end; ++ivalue) {
+        int32_t sum = 0;
+        for (auto& data : m_phrase_buffers) {
+            if (ivalue < data.size())
+                sum += data[ivalue];
         }
+        *out++ = vsk_clip_pcm16(sum);
+    }
+    return frames;
+}
 
-        // Clipping value
-        if (value < std::numeric_limits<VSK_PCM16_VALUE>::min())
-            value = std::numeric_limits<VSK_PCM16_VALUE>::min();
-        else if (value > std::numeric_limits<VSK_PCM16_VALUE>::max())
-            value = std::numeric_limits<VSK_PCM16_VALUE>::max();
+// 音色をキャッシュのキーに含める
+static void vsk_hash_timbre(VskSha256& hash, const YM2203_Timbre& timbre) {
+    hash.update_value(timbre.algorithm);
+    hash.update_value(timbre.feedback);
+    hash.update_value(timbre.opMask);
+    hash.update_value(timbre.ar);
+    hash.update_value(timbre.dr);
+    hash.update_value(timbre.sr);
+    hash.update_value(timbre.rr);
+    hash.update_value(timbre.sl);
+    hash.update_value(timbre.tl);
+    hash.update_value(timbre.keyScale);
+    hash.update_value(timbre.multiple);
+    hash.update_value(timbre.detune);
+    hash.update_value(timbre.ams);
+    hash.update_value(timbre.waveForm);
+    hash.update_value(timbre.sync);
+    hash.update_value(timbre.speed);
+    hash.update_value(timbre.pmd);
+    hash.update_value(timbre.amd);
+    hash.update_value(timbre.pms);
+}
+
+// キャッシュのキーを計算する。
+// 変数は字句解析のときに評価されるので、展開済みの文字列ではなく音符そのものをキーに含める
+std::string VskSoundPlayer::get_render_key(VskScoreBlock& block, bool stereo) {
+    VskSha256 hash;
+    hash.update_string("cmd_sing render cache 4");
+    hash.update_value(uint32_t(CLOCK));
+    hash.update_value(uint32_t(SAMPLERATE));
+    hash.update_value(uint8_t(sizeof(VSK_PCM16_VALUE)));
+    hash.update_value(uint8_t(sizeof(VSK_SAMPLE_VALUE)));
+    hash.update_value(uint8_t(stereo));
+
+    hash.update_value(uint32_t(block.size()));
+    for (auto& phrase : block) {
+        hash.update_value(uint8_t(phrase != nullptr));
+        if (!phrase)
+            continue;
 
-        // 転送先に格納
-        int32_t sample_value = ((ivalue < data_size) ? value : 0);
-        if (stereo) { // ステレオの場合
-            values[ivalue] = (VSK_PCM16_VALUE)sample_value;
-        } else { // モノラルの場合
-            if (ivalue & 1) // 奇数の場合
-                values[ivalue >> 1] = (VSK_PCM16_VALUE)((prev_value + sample_value) >> 1);
-            else // 偶数の場合
-                prev_value = sample_value;
+        auto& setting = phrase->m_setting;
+        hash.update_value(uint8_t(setting.m_fm));
+        hash.update_value(int32_t(setting.m_tempo));
+        hash.update_value(int32_t(setting.m_octave));
+        hash.update_value(setting.m_length);
+        hash.update_value(setting.m_volume);
+        hash.update_value(int32_t(setting.m_quantity));
+        hash.update_value(int32_t(setting.m_tone));
+        hash.update_value(setting.m_LR);
+        vsk_hash_timbre(hash, setting.m_timbre);
+
+        hash.update_value(uint32_t(phrase->m_notes.size()));
+        for (auto& note : phrase->m_notes) {
+            hash.update_value(int32_t(note.m_tempo));
+            hash.update_value(int32_t(note.m_octave));
+            hash.update_value(note.m_LR);
+            hash.update_value(int32_t(note.m_key));
+            hash.update_value(uint8_t(note.m_dot));
+            hash.update_value(note.m_length);
+            hash.update_value(note.m_sign);
+            hash.update_value(note.m_sec);
+            hash.update_value(note.m_volume);
+            hash.update_value(int32_t(note.m_quantity));
+            hash.update_value(uint8_t(note.m_and));
+            hash.update_value(int32_t(note.m_reg));
+            hash.update_value(int32_t(note.m_data));
         }
     }
 
+    return hash.finish();
+}
+
+// PCM波形を生成する。可能ならキャッシュを使う。
+// キャッシュが見つかればviewに、見つからなければvaluesに波形が格納される。
+// mix_valuesがあれば16ビットに収める前の値も要るので、キャッシュは使わない
+bool VskSoundPlayer::generate_pcm(VskScoreBlock& block, std::vector<VSK_PCM16_VALUE>& values,
+                                  std::shared_ptr<VskRenderCacheView>& view, bool stereo,
+                                  std::vector<int32_t> *mix_values)
+{
+    view = nullptr;
+
+    // 差分描画するなら、前の描画と同じく音源の初期状態から描画する
+    if (m_incremental)
+        reset();
+
+    // 音源が初期状態のときだけ、波形は楽譜だけで決まる。
+    // レジスタ書き込みを記録するときはキャッシュを使わない
+    std::string key;
+    if (m_fresh && vsk_render_cache_is_enabled() && !m_recorder && !mix_values) {
+        key = get_render_key(block, stereo);
+        view = vsk_render_cache_lookup(key);
+        if (view) {
+            m_fresh = false;
+            m_num_samples_generated += view->count() / (stereo ? 2 : 1);
+            if (m_cancel) {
+                m_cancel->m_samples_total += view->count() / (stereo ? 2 : 1);
+                m_cancel->m_samples_done += view->count() / (stereo ? 2 : 1);
+            }
+
+            VskStageTimer timer(get_stats(), VSK_STAGE_REALIZE);
+            int ich = 0;
+            for (auto& phrase : block) {
+                if (phrase) {
+                    phrase->finalize();
+                    phrase->set_player(this);
+                    phrase->skip_realize(ich);
+                }
+                ++ich;
+            }
+            return true;
+        }
+    }
+
+    if (!generate_pcm_raw(block, values, stereo, true, mix_values))
+        return false;
+    m_num_samples_generated += values.size() / (stereo ? 2 : 1);
+
+    if (key.size())
+        vsk_render_cache_store(key, values.data(), values.size());
+
     return true;
 }
 
 // 音声をWAVファイルとして保存
 bool VskSoundPlayer::save_as_wav(VskScoreBlock& block, const wchar_t *filename, bool stereo) {
-    // 波形を生成する
-    std::vector<VSK_PCM16_VALUE> values;
-    generate_pcm_raw(block, values, stereo);
-    size_t data_size = values.size() * sizeof(VSK_PCM16_VALUE);
+    // 波形を生成する。配列は前の保存のものを使い回す。
+    // s16でなければ、16ビットに収める前の値から変換する
+    std::vector<VSK_PCM16_VALUE>& values = m_save_values;
+    std::shared_ptr<VskRenderCacheView> view;
+    const bool wide = (m_sample_format != VSK_SAMPLE_FORMAT_S16);
+    if (!generate_pcm(block, values, view, stereo, wide ? &m_mix_values : nullptr))
+        return false;
+    const VSK_PCM16_VALUE *data = (view ? view->data() : values.data());
+    size_t count = (view ? view->count() : values.size());
+    uint32_t data_size = uint32_t(count * vsk_sample_format_size(m_sample_format));
 
     // WAVファイルを書き込み用として開く
+    VskStageTimer timer(get_stats(), VSK_STAGE_WRITE_WAV);
     FILE *fout = _wfopen(filename, L"wb");
     if (!fout)
         return false;
 
     // WAVファイルに書き込み、閉じる
-    auto wav_header = get_wav_header(data_size, SAMPLERATE, 16, stereo);
-    std::fwrite(wav_header, WAV_HEADER_SIZE, 1, fout);
-    std::fwrite(values.data(), data_size, 1, fout);
+    uint8_t wav_header[WAV_HEADER_MAX_SIZE];
+    size_t header_size = get_wav_header(wav_header, data_size, SAMPLERATE, m_sample_format, stereo);
+    std::fwrite(wav_header, header_size, 1, fout);
+    if (wide)
+        vsk_write_samples(fout, m_mix_values.data(), count, m_sample_format);
+    else
+        vsk_write_samples(fout, data, count, m_sample_format);
+    if (data_size & 1)
+        std::fputc(0, fout);
     std::fclose(fout);
 
     return true;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// VskPcmWavSink - WAVファイルに書き込む出力先
+
+bool VskPcmWavSink::open(const wchar_t *filename, bool stereo, VskSampleFormat format)
+{
+    close();
+
+    m_fout = _wfopen(filename, L"wb");
+    if (!m_fout)
+        return false;
+
+    // サイズは閉じるときに書き直す
+    m_stereo = stereo;
+    m_format = format;
+    m_data_size = 0;
+    m_failed = false;
+    uint8_t wav_header[WAV_HEADER_MAX_SIZE];
+    size_t header_size = get_wav_header(wav_header, 0, SAMPLERATE, m_format, stereo);
+    if (std::fwrite(wav_header, header_size, 1, m_fout) != 1)
+        m_failed = true;
+    return !m_failed;
+}
+
+bool VskPcmWavSink::write(const VSK_PCM16_VALUE *data, size_t count)
+{
+    if (!m_fout || m_failed)
+        return false;
+    int64_t size = vsk_write_samples(m_fout, data, count, m_format);
+    if (size < 0) {
+        m_failed = true;
+        return false;
+    }
+    m_data_size += uint32_t(size);
+    return true;
+}
+
+bool VskPcmWavSink::write_mix(const int32_t *data, size_t count)
+{
+    if (!m_fout || m_failed)
+        return false;
+    int64_t size = vsk_write_samples(m_fout, data, count, m_format);
+    if (size < 0) {
+        m_failed = true;
+        return false;
+    }
+    m_data_size += uint32_t(size);
+    return true;
+}
+
+bool VskPcmWavSink::close()
+{
+    if (!m_fout)
+        return false;
+
+    uint8_t wav_header[WAV_HEADER_MAX_SIZE];
+    size_t header_size = get_wav_header(wav_header, m_data_size, SAMPLERATE, m_format, m_stereo);
+    if ((m_data_size & 1) && std::fputc(0, m_fout) == EOF)
+        m_failed = true;
+    if (std::fseek(m_fout, 0, SEEK_SET) != 0 ||
+        std::fwrite(wav_header, header_size, 1, m_fout) != 1)
+    {
+        m_failed = true;
+    }
+    if (std::fclose(m_fout) != 0)
+        m_failed = true;
+    m_fout = nullptr;
+    return !m_failed;
+}
+
+// レジスタ書き込みのログをVGMかS98として保存
+bool VskSoundPlayer::save_as_reglog(VskScoreBlock& block, const wchar_t *filename, bool vgm) {
+    // VGMとS98には音源を二つまでしか書けない
+    if (block.size() > 6)
+        return false;
+
+    // 記録しながら波形を生成する
+    auto recorder = std::make_shared<VskRegLog>();
+    auto old_recorder = m_recorder;
+    m_recorder = recorder;
+    std::vector<VSK_PCM16_VALUE> values;
+    std::shared_ptr<VskRenderCacheView> view;
+    bool ok = generate_pcm(block, values, view, true);
+    m_recorder = old_recorder;
+    if (!ok)
+        return false;
+
+    // SSGの共有レジスタの書き込みが食い違ったり、音色のLFOを使ったりすると、
+    // WAVと同じ音にならないので書き出さない
+    if (recorder->m_conflict || recorder->m_lfo)
+        return false;
+
+    // YM2203はOPNAの半分のクロックで同じ音程になる
+    if (vgm)
+        return recorder->save_as_vgm(filename, CLOCK / 2);
+    return recorder->save_as_s98(filename, CLOCK / 2);
+}
+
+// 音声をファイルとして保存。拡張子が .vgm か .s98 ならレジスタ書き込みのログとして保存する
+bool VskSoundPlayer::save_as_file(VskScoreBlock& block, const wchar_t *filename, bool stereo) {
+    const wchar_t *dotext = std::wcsrchr(filename, L'.');
+    if (dotext && _wcsicmp(dotext, L".vgm") == 0)
+        return save_as_reglog(block, filename, true);
+    if (dotext && _wcsicmp(dotext, L".s98") == 0)
+        return save_as_reglog(block, filename, false);
+    return save_as_wav(block, filename, stereo);
+}
+
 // 演奏を開始する
 void VskSoundPlayer::play(VskScoreBlock& block, bool stereo) {
-    // 波形を生成
-    generate_pcm_raw(block, m_pcm_values, stereo);
+    // 波形を生成。取り消されたら演奏しない
+    if (!generate_pcm(block, m_pcm_values, m_pcm_view, stereo))
+        return;
 
     // スペシャルアクションを実行
     for (auto& phrase : block) {
         phrase->execute_special_actions();
     }
 
-    // 波形に基づいて演奏
-    vsk_sound_play(m_pcm_values.data(), m_pcm_values.size() * sizeof(VSK_PCM16_VALUE), stereo);
+    // 波形に基づいて、所属するエンジンの出力先で演奏
+    VskEngine& engine = (m_engine ? *m_engine : vsk_default_engine());
+    if (m_pcm_view)
+        vsk_sound_play(engine, m_pcm_view->data(), m_pcm_view->count() * sizeof(VSK_PCM16_VALUE), stereo);
+    else
+        vsk_sound_play(engine, m_pcm_values.data(), m_pcm_values.size() * sizeof(VSK_PCM16_VALUE), stereo);
 }
 
 // 演奏を停止
@@ -699,6 +1624,59 @@ void VskSoundPlayer::stop()
     m_play_lock.unlock();
 }
 
+// 音源 #index を取得する。#2以降はなければ作る。
+// 新しい音源は音源 #1 の状態を写すので、それまでのすべての音源への書き込みを引き継ぐ
+YM2203& VskSoundPlayer::get_chip(size_t index)
+{
+    if (index == 0)
+        return m_ym0;
+    if (index == 1)
+        return m_ym1;
+
+    while (m_ym_pool.size() <= index - 2) {
+        std::unique_ptr<YM2203> ym(new YM2203());
+        ym->init(CLOCK, SAMPLERATE, m_rhythm_path.size() ? m_rhythm_path.c_str() : NULL);
+        YM2203_Snapshot snap;
+        m_ym1.snapshot(snap);
+        ym->restore(snap);
+        ym->set_mono(m_num_channels == 1);
+        m_ym_pool.push_back(std::move(ym));
+    }
+    return *m_ym_pool[index - 2];
+}
+
+// 並列に描画するための音源を取得する。なければ作る
+YM2203& VskSoundPlayer::get_worker_chip(size_t index)
+{
+    while (m_ym_workers.size() <= index) {
+        std::unique_ptr<YM2203> ym(new YM2203());
+        ym->init(CLOCK, SAMPLERATE, m_rhythm_path.size() ? m_rhythm_path.c_str() : NULL);
+        ym->set_mono(m_num_channels == 1);
+        m_ym_workers.push_back(std::move(ym));
+    }
+    return *m_ym_workers[index];
+}
+
+// フレーズをステレオで描画するか、モノラルで描画するかを決める。
+// モノラルなら音源が直接1チャンネルで描画するので、左右をまとめ直す手間が要らない
+void VskSoundPlayer::set_stereo(bool stereo)
+{
+    m_num_channels = (stereo ? 2 : 1);
+    m_ym0.set_mono(!stereo);
+    m_ym1.set_mono(!stereo);
+    for (auto& ym : m_ym_pool)
+        ym->set_mono(!stereo);
+    m_ym_seek.set_mono(!stereo);
+    for (auto& ym : m_ym_workers)
+        ym->set_mono(!stereo);
+}
+
+// 所属するエンジンの統計を取得する。集計しないならnull
+VskStats* VskSoundPlayer::get_stats()
+{
+    return m_engine ? m_engine->m_stats : nullptr;
+}
+
 // スペシャルアクションを登録
 void VskSoundPlayer::register_special_action(int action_no, VskSpecialActionFn fn)
 {
@@ -8,7 +8,11 @@
 #include <deque>
 #include <vector>
 #include <memory>
+#include <atomic>
 #include <unordered_map>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
 
 #ifdef _WIN32
     #define UNBOOST_USE_WIN32_THREAD
@@ -24,6 +28,33 @@
 
 #define VSK_PCM16_VALUE int16_t
 
+// 出力ファイルのサンプルの形式
+enum VskSampleFormat {
+    VSK_SAMPLE_FORMAT_S16 = 0,  // 16ビット整数 (WAVE_FORMAT_PCM)
+    VSK_SAMPLE_FORMAT_S24,      // 24ビット整数 (WAVE_FORMAT_EXTENSIBLE)
+    VSK_SAMPLE_FORMAT_F32       // 32ビット浮動小数点数 (WAVE_FORMAT_IEEE_FLOAT)
+};
+
+// サンプル一個のバイト数
+inline size_t vsk_sample_format_size(VskSampleFormat format) {
+    switch (format) {
+    case VSK_SAMPLE_FORMAT_S24: return 3;
+    case VSK_SAMPLE_FORMAT_F32: return 4;
+    default:                    return 2;
+    }
+}
+
+// "s16", "s24", "f32" を形式に変換する。知らない名前なら失敗する
+bool vsk_sample_format_from_name(const char *name, VskSampleFormat& format);
+
+// 16ビットの波形をcount個ぶん指定の形式に変換する。destには
+// count * vsk_sample_format_size(format) バイトが必要
+void vsk_convert_pcm16(const VSK_PCM16_VALUE *src, size_t count, VskSampleFormat format, void *dest);
+
+// フレーズを足し合わせた32ビットの値をcount個ぶん指定の形式に変換する。
+// s16とs24では16ビットに収め、f32では16ビットを越えた値も飽和させずに残す
+void vsk_convert_pcm32(const int32_t *src, size_t count, VskSampleFormat format, void *dest);
+
 //////////////////////////////////////////////////////////////////////////////
 // pevent --- portable event objects
 
@@ -34,6 +65,28 @@
 
 #include "fmgon/YM2203.h"
 
+// フレーズの波形の値。音源が描画する値と同じ型で、FMGON_INT32_SAMPLEなら32ビットになる。
+// 32ビットなら音源の中では飽和させず、フレーズを足し合わせた後に一度だけ16ビットに収める
+#define VSK_SAMPLE_VALUE FM_SAMPLETYPE
+
+//////////////////////////////////////////////////////////////////////////////
+// rendercache --- 描画済みPCMのキャッシュ
+
+#include "rendercache.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// reglog --- レジスタ書き込みの記録
+
+#include "reglog.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// arena --- 使い回すバッファ
+
+#include "arena.h"
+
+// フレーズの波形のバッファ
+typedef VskArenaBuffer<VSK_SAMPLE_VALUE> VskSampleBuffer;
+
 //////////////////////////////////////////////////////////////////////////////
 // VskNote - 音符、休符、その他の何か
 
@@ -129,6 +182,22 @@ struct VskSoundSetting {
     }
 };
 
+//////////////////////////////////////////////////////////////////////////////
+// VskPhraseKeyframe - シークのためのキーフレーム
+
+// キーフレームを記録する間隔（サンプル数）
+#ifndef VSK_KEYFRAME_INTERVAL
+    #define VSK_KEYFRAME_INTERVAL 44100
+#endif
+
+struct VskPhraseKeyframe {
+    size_t              m_inote;    // 次に実現する音符のインデックス
+    uint32_t            m_isample;  // 次に実現するサンプルの位置
+    YM2203_Snapshot     m_snapshot; // 音源の状態
+    YM2203_Timbre       m_timbre;   // 音色
+    bool                m_skipped = false; // この区間に合成を省いた部分があるか？
+};
+
 //////////////////////////////////////////////////////////////////////////////
 // VskPhrase - フレーズ
 
@@ -145,6 +214,12 @@ struct VskPhrase {
     std::vector<std::pair<float, int>>  m_gate_to_special_action_no;
 
     size_t                              m_remaining_actions;    // 残りのスペシャルアクションの個数
+    bool                                m_finalized = false;    // 仕上げたか？
+    bool                                m_writes_all = false;   // すべての音源に書き込む音符があるか？
+
+    std::vector<VskPhraseKeyframe>      m_keyframes;    // シークのためのキーフレーム
+    uint32_t                            m_num_samples = 0; // 実現したサンプル数
+    uint32_t                            m_isample_end = 0; // 最後の音符を実現し終えたサンプル位置
 
     VskPhrase(VskSoundSetting& setting) : m_setting(setting) { }
 
@@ -241,9 +316,20 @@ struct VskPhrase {
 
     void schedule_special_action(float gate, int action_no);
     void execute_special_actions();
-    std::unique_ptr<VSK_PCM16_VALUE[]> realize(int ich, size_t *pdata_size);
-    void rescan_notes();
-    void calc_gate_and_goal();
+    VskSampleBuffer realize(int ich, size_t iworker = 0, size_t num_threads = 0);
+    VskSampleBuffer realize_from(int ich, VskPhrase& old, size_t ikeyframe, const VskSampleBuffer& old_data,
+                                 size_t iworker = 0, size_t num_threads = 0);
+    bool realize_range(YM2203& ym, int ich, uint32_t isample_begin, uint32_t isample_end,
+                       VSK_SAMPLE_VALUE *data);
+    void skip_realize(int ich);
+    void finalize();
+
+protected:
+    uint32_t realize_notes(YM2203& ym, int ich, bool seeking, bool skipping, size_t inote, uint32_t isample,
+                       YM2203_Timbre& timbre, VSK_SAMPLE_VALUE *data,
+                       uint32_t isample_base, uint32_t isample_limit);
+    void realize_skipped(int ich, VSK_SAMPLE_VALUE *data, size_t iworker, size_t num_threads,
+                         size_t ifirst = 0);
 }; // struct VskPhrase
 
 //////////////////////////////////////////////////////////////////////////////
@@ -254,10 +340,113 @@ typedef std::vector<std::shared_ptr<VskPhrase>>  VskScoreBlock;
 // スペシャルアクションの関数
 typedef void (*VskSpecialActionFn)(int action_number);
 
+//////////////////////////////////////////////////////////////////////////////
+// VskPcmSink - 波形の出力先
+//
+// 波形を少しずつ受け取る。countは値の個数（ステレオなら左右で2個）。
+// get_format()がs16でなければ、16ビットに収める前の混合した値をwrite_mixで受け取る。
+
+struct VskPcmSink {
+    virtual ~VskPcmSink() { }
+    virtual bool write(const VSK_PCM16_VALUE *data, size_t count) = 0;
+    // 既定では16ビットに収めてwriteに渡す
+    virtual bool write_mix(const int32_t *data, size_t count);
+    virtual VskSampleFormat get_format() const { return VSK_SAMPLE_FORMAT_S16; }
+};
+
+// メモリーに溜める
+struct VskPcmMemorySink : VskPcmSink {
+    std::vector<VSK_PCM16_VALUE> m_values;
+
+    bool write(const VSK_PCM16_VALUE *data, size_t count) override {
+        m_values.insert(m_values.end(), data, data + count);
+        return true;
+    }
+};
+
+// 数えるだけで捨てる
+struct VskPcmNullSink : VskPcmSink {
+    uint64_t m_count = 0;
+
+    bool write(const VSK_PCM16_VALUE *data, size_t count) override {
+        m_count += count;
+        return true;
+    }
+};
+
+// WAVファイルに書き込む。閉じるときにヘッダーのサイズを書き直す
+struct VskPcmWavSink : VskPcmSink {
+    VskPcmWavSink() { }
+    ~VskPcmWavSink() { close(); }
+
+    bool open(const wchar_t *filename, bool stereo, VskSampleFormat format = VSK_SAMPLE_FORMAT_S16);
+    bool write(const VSK_PCM16_VALUE *data, size_t count) override;
+    bool write_mix(const int32_t *data, size_t count) override;
+    VskSampleFormat get_format() const override { return m_format; }
+    bool close();
+
+protected:
+    FILE               *m_fout = nullptr;
+    bool                m_stereo = true;
+    VskSampleFormat     m_format = VSK_SAMPLE_FORMAT_S16;
+    uint32_t            m_data_size = 0;
+    bool                m_failed = false;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// VskPhraseHistory - 差分描画のための、前の描画のフレーズの記録
+//
+// フレーズの設定は演奏エンジンの設定を指しているので、描画したときの値を写しておく。
+
+struct VskPhraseHistory {
+    std::shared_ptr<VskPhrase>  m_phrase;           // フレーズ（音符とキーフレーム）
+    bool                        m_fm = false;       // FMか？
+    YM2203_Timbre               m_start_timbre;     // 実現を始めたときの音色
+    YM2203_Timbre               m_end_timbre;       // 実現し終えたときの音色
+    YM2203_Snapshot             m_end_state;        // 実現し終えたときの音源の状態
+    VskSampleBuffer             m_data;             // 実現した波形
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// VskCancelToken - 描画の取り消しと進み具合
+//
+// サウンドプレーヤーの m_cancel に設定すると、描画のループが VSK_RENDER_BLOCK
+// サンプルごとに取り消されたかを調べる。取り消されたら描画をやめ、波形の生成は失敗する。
+// 音源は描画を始める前の状態に戻るので、次の描画は取り消した描画がなかったように続く。
+// 別のスレッドから取り消してよい。
+
+// 取り消しを調べる間隔（サンプル数）
+#define VSK_RENDER_BLOCK 4096
+
+struct VskCancelToken {
+    std::atomic<bool>       m_cancelled;        // 取り消されたか？
+    std::atomic<uint64_t>   m_samples_done;     // 描画したサンプル数（フレーズの合計）
+    std::atomic<uint64_t>   m_samples_total;    // 描画するサンプル数（フレーズの合計）
+
+    VskCancelToken() : m_cancelled(false), m_samples_done(0), m_samples_total(0) { }
+
+    void cancel() { m_cancelled = true; }
+    bool is_cancelled() const { return m_cancelled; }
+};
+
 //////////////////////////////////////////////////////////////////////////////
 // VskSoundPlayer - サウンドプレーヤー
+//
+// ブロックのフレーズは3つずつ音源に割り当てる（フレーズ ich は音源 #(ich / 3) の
+// チャンネル ich % 3）。音源 #0, #1 の他に、必要なだけ音源を増やす。
+//
+// m_incremental なら前の描画のフレーズと波形を覚えておき、次の描画では
+// チャンネルごとに最初に変わった音符の前のキーフレームから描画し直す。
+// 使えるのは、前の描画も今の描画も音源の初期状態から始めたときだけ（generate_pcm は
+// 描画の前に reset() を呼ぶ。generate_pcm_raw を直接呼ぶなら呼び出し元が呼ぶ）で、
+// すべての音源に書き込む音符があるか、書き込みを記録するなら全体を描画する。
+// 同じ音源のそれより前のフレーズが変わったときも、そのフレーズは全体を描画する。
+
+struct VskEngine;
+struct VskStats;
 
 struct VskSoundPlayer {
+    VskEngine*                                  m_engine;           // 所属する演奏エンジン
     bool                                        m_playing_music;    // 演奏中か？
     PE_event                                    m_stopping_event;   // 演奏停止用のイベント
     std::deque<VskScoreBlock>                   m_melody_line;      // メロディーライン
@@ -265,7 +454,30 @@ struct VskSoundPlayer {
     std::vector<std::shared_ptr<VskNote>>       m_notes;            // 音符、休符、その他の何かの配列
     YM2203                                      m_ym0;              // 音源エミュレータ #0
     YM2203                                      m_ym1;              // 音源エミュレータ #1
+    std::vector<std::unique_ptr<YM2203>>        m_ym_pool;          // 音源エミュレータ #2以降（必要になったら作る）
+    YM2203                                      m_ym_seek;          // シーク用の音源エミュレータ
+    std::vector<std::unique_ptr<YM2203>>        m_ym_workers;       // 並列に描画するための音源エミュレータ
+    std::string                                 m_rhythm_path;      // リズム音のパス
     std::vector<VSK_PCM16_VALUE>                m_pcm_values;       // 実際の波形
+    std::shared_ptr<VskRenderCacheView>         m_pcm_view;         // キャッシュされた波形
+    bool                                        m_fresh;            // 音源がまだ初期状態か？
+    YM2203_Snapshot                             m_initial[2];       // 初期状態の音源 #0, #1
+    size_t                                      m_num_threads;      // 並列に描画するスレッド数（0なら自動）
+    uint64_t                                    m_num_samples_generated; // 生成したサンプル数の累計
+    std::shared_ptr<VskRegLog>                  m_recorder;         // レジスタ書き込みの記録（nullなら記録しない）
+    int                                         m_num_channels;     // フレーズを描画するチャンネル数（1か2）
+    VskBufferArena                              m_arena;            // 演奏をまたいで使い回すバッファ
+    std::vector<VskSampleBuffer>                m_phrase_buffers;   // 実現したフレーズの波形（混合するまで）
+    std::vector<VSK_PCM16_VALUE>                m_save_values;      // WAVファイルに保存する波形
+    VskSampleFormat                             m_sample_format;    // WAVファイルに保存するサンプルの形式
+    std::shared_ptr<VskCancelToken>             m_cancel;           // 描画の取り消し（nullなら取り消さない）
+    bool                                        m_incremental;      // 前の描画との差分だけを描画し直すか？
+    std::vector<VskPhraseHistory>               m_history;          // 前の描画のフレーズ（空なら使えない）
+    int                                         m_history_channels; // 前の描画のチャンネル数
+    std::vector<VSK_PCM16_VALUE>                m_history_values;   // 前の描画の混合した波形
+    std::vector<VSK_PCM16_VALUE>                m_stream_values;    // 流し出す波形
+    std::vector<int32_t>                        m_mix_values;       // 16ビットに収める前の混合した波形（s16以外で書くとき）
+    std::vector<YM2203_Snapshot>                m_saved_states;     // 取り消したときに戻す音源の状態
 
     // アクション番号からスペシャルアクションへの写像
     std::unordered_map<int, VskSpecialActionFn> m_action_no_to_special_action;
@@ -277,15 +489,47 @@ struct VskSoundPlayer {
     bool wait_for_stop(uint32_t milliseconds);
     bool play_and_wait(VskScoreBlock& block, uint32_t milliseconds, bool stereo);
     void stop();
+    void reset();
     bool save_as_wav(VskScoreBlock& block, const wchar_t *filename, bool stereo);
-    bool generate_pcm_raw(VskScoreBlock& block, std::vector<VSK_PCM16_VALUE>& values, bool stereo);
+    bool save_as_reglog(VskScoreBlock& block, const wchar_t *filename, bool vgm);
+    bool save_as_file(VskScoreBlock& block, const wchar_t *filename, bool stereo);
+    bool generate_pcm_raw(VskScoreBlock& block, std::vector<VSK_PCM16_VALUE>& values, bool stereo,
+                          bool mix = true, std::vector<int32_t> *mix_values = nullptr);
+    bool generate_pcm(VskScoreBlock& block, std::vector<VSK_PCM16_VALUE>& values,
+                      std::shared_ptr<VskRenderCacheView>& view, bool stereo,
+                      std::vector<int32_t> *mix_values = nullptr);
+    std::string get_render_key(VskScoreBlock& block, bool stereo);
+    bool render_range(VskScoreBlock& block, size_t start, size_t end,
+                      std::vector<VSK_PCM16_VALUE>& values, bool stereo);
+    bool render_stream(VskScoreBlock& block, VskPcmSink& sink, bool stereo);
+    size_t get_phrase_frames() const;
+    size_t mix_frames(size_t iframe, VSK_PCM16_VALUE *out, size_t frames) const;
+
+    YM2203& get_chip(size_t index);
+    size_t get_num_chips() const { return 2 + m_ym_pool.size(); }
+    YM2203& get_worker_chip(size_t index);
+    void set_stereo(bool stereo);
+    VskStats* get_stats();
+    bool is_cancelled() const { return m_cancel && m_cancel->is_cancelled(); }
 
     void register_special_action(int action_no, VskSpecialActionFn fn = nullptr);
     void do_special_action(int action_no);
 
     void write_reg(uint32_t addr, uint32_t data) {
-        m_ym0.write_reg(addr, data);
-        m_ym1.write_reg(addr, data);
+        m_fresh = false;
+        if (m_recorder) {
+            // 両方の音源への書き込みはチャンネルに属さない
+            int ssg_channel = m_recorder->m_ssg_channel;
+            m_recorder->m_ssg_channel = -1;
+            m_ym0.write_reg(addr, data);
+            m_ym1.write_reg(addr, data);
+            m_recorder->m_ssg_channel = ssg_channel;
+        } else {
+            m_ym0.write_reg(addr, data);
+            m_ym1.write_reg(addr, data);
+        }
+        for (auto& ym : m_ym_pool)
+            ym->write_reg(addr, data);
     }
 }; // struct VskSoundPlayer
 
@@ -0,0 +1,130 @@
+﻿//////////////////////////////////////////////////////////////////////////////
+// stats --- per-stage timings and counters of CMD SING / CMD PLAY
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "stats.h"
+#include "engine.h"
+#include <chrono>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+// 段階の名前 (JSONのキー)
+static const char * const s_stage_names[VSK_STAGE_NUM] = {
+    "expand",
+    "parse",
+    "repeat",
+    "realize",
+    "mix",
+    "write_wav",
+    "registry",
+    "device",
+};
+
+// 経過時間（秒）を取得する
+double vsk_stats_wall_time(void)
+{
+    typedef std::chrono::steady_clock clock_type;
+    return std::chrono::duration<double>(clock_type::now().time_since_epoch()).count();
+}
+
+// プロセスのCPU時間（秒）を取得する。並列に描画するスレッドの分も含む
+double vsk_stats_cpu_time(void)
+{
+#ifdef _WIN32
+    FILETIME ftCreate, ftExit, ftKernel, ftUser;
+    if (!GetProcessTimes(GetCurrentProcess(), &ftCreate, &ftExit, &ftKernel, &ftUser))
+        return 0;
+    ULARGE_INTEGER kernel, user;
+    kernel.LowPart = ftKernel.dwLowDateTime;
+    kernel.HighPart = ftKernel.dwHighDateTime;
+    user.LowPart = ftUser.dwLowDateTime;
+    user.HighPart = ftUser.dwHighDateTime;
+    return (kernel.QuadPart + user.QuadPart) * 1e-7; // 100ナノ秒単位
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+VskStats::VskStats()
+{
+    m_start_wall = vsk_stats_wall_time();
+    m_start_cpu = vsk_stats_cpu_time();
+}
+
+// サウンドプレーヤーの音源の数を足し込む。プレーヤーを解放する前に呼ぶ
+void VskStats::collect(VskSoundPlayer& player)
+{
+    m_num_samples += player.m_num_samples_generated;
+    m_reg_writes[0] += player.m_ym0.get_num_reg_writes();
+    m_reg_writes[1] += player.m_ym1.get_num_reg_writes();
+    m_reg_skips[0] += player.m_ym0.get_num_reg_skips();
+    m_reg_skips[1] += player.m_ym1.get_num_reg_skips();
+    m_prepares[0] += player.m_ym0.get_num_prepares();
+    m_prepares[1] += player.m_ym1.get_num_prepares();
+    for (auto& ym : player.m_ym_workers) {
+        m_reg_writes[2] += ym->get_num_reg_writes();
+        m_reg_skips[2] += ym->get_num_reg_skips();
+        m_prepares[2] += ym->get_num_prepares();
+    }
+    for (auto& ym : player.m_ym_pool) {
+        m_reg_writes[3] += ym->get_num_reg_writes();
+        m_reg_skips[3] += ym->get_num_reg_skips();
+        m_prepares[3] += ym->get_num_prepares();
+    }
+    VskArenaStats arena = player.m_arena.get_stats();
+    m_arena_acquires += arena.m_acquires;
+    m_arena_allocs += arena.m_allocs;
+    m_arena_huge_allocs += arena.m_huge_allocs;
+    if (m_arena_peak_bytes < arena.m_peak_reserved_bytes)
+        m_arena_peak_bytes = arena.m_peak_reserved_bytes;
+}
+
+// エンジンの統計をJSONとして出力する
+void VskStats::dump(VskEngine& engine, FILE *fout)
+{
+    double wall = vsk_stats_wall_time() - m_start_wall;
+    double cpu = vsk_stats_cpu_time() - m_start_cpu;
+
+    // まだ解放されていないプレーヤーの分も数える
+    VskStats total = *this;
+    if (engine.m_player)
+        total.collect(*engine.m_player);
+
+    std::fprintf(fout, "{\n");
+    std::fprintf(fout, "  \"wall_ms\": %.3f,\n", wall * 1000);
+    std::fprintf(fout, "  \"cpu_ms\": %.3f,\n", cpu * 1000);
+
+    std::fprintf(fout, "  \"stages\": {\n");
+    for (int i = 0; i < VSK_STAGE_NUM; ++i) {
+        const VskStageTime& time = m_stages[i];
+        std::fprintf(fout, "    \"%s\": { \"count\": %u, \"wall_ms\": %.3f, \"cpu_ms\": %.3f }%s\n",
+                     s_stage_names[i], time.m_count, time.m_wall * 1000, time.m_cpu * 1000,
+                     (i + 1 < VSK_STAGE_NUM) ? "," : "");
+    }
+    std::fprintf(fout, "  },\n");
+
+    std::fprintf(fout, "  \"samples\": %llu,\n", (unsigned long long)total.m_num_samples);
+    std::fprintf(fout, "  \"reg_writes\": { \"ym0\": %llu, \"ym1\": %llu, \"workers\": %llu, \"pool\": %llu },\n",
+                 (unsigned long long)total.m_reg_writes[0], (unsigned long long)total.m_reg_writes[1],
+                 (unsigned long long)total.m_reg_writes[2], (unsigned long long)total.m_reg_writes[3]);
+    std::fprintf(fout, "  \"reg_skips\": { \"ym0\": %llu, \"ym1\": %llu, \"workers\": %llu, \"pool\": %llu },\n",
+                 (unsigned long long)total.m_reg_skips[0], (unsigned long long)total.m_reg_skips[1],
+                 (unsigned long long)total.m_reg_skips[2], (unsigned long long)total.m_reg_skips[3]);
+    std::fprintf(fout, "  \"prepares\": { \"ym0\": %llu, \"ym1\": %llu, \"workers\": %llu, \"pool\": %llu },\n",
+                 (unsigned long long)total.m_prepares[0], (unsigned long long)total.m_prepares[1],
+                 (unsigned long long)total.m_prepares[2], (unsigned long long)total.m_prepares[3]);
+    std::fprintf(fout, "  \"arena\": { \"acquires\": %llu, \"allocs\": %llu, \"huge_allocs\": %llu, \"peak_bytes\": %llu },\n",
+                 (unsigned long long)total.m_arena_acquires, (unsigned long long)total.m_arena_allocs,
+                 (unsigned long long)total.m_arena_huge_allocs, (unsigned long long)total.m_arena_peak_bytes);
+    std::fprintf(fout, "  \"peak_buffer_bytes\": %llu\n", (unsigned long long)m_peak_buffer_bytes);
+    std::fprintf(fout, "}\n");
+    std::fflush(fout);
+}
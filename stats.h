@@ -0,0 +1,117 @@
+//////////////////////////////////////////////////////////////////////////////
+// stats --- per-stage timings and counters of CMD SING / CMD PLAY
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+
+struct VskEngine;
+struct VskSoundPlayer;
+
+//////////////////////////////////////////////////////////////////////////////
+// 処理の段階
+
+enum VskStage {
+    VSK_STAGE_EXPAND = 0,   // {変数名}の展開
+    VSK_STAGE_PARSE,        // 文字列の解析
+    VSK_STAGE_REPEAT,       // 繰り返しの展開
+    VSK_STAGE_REALIZE,      // 波形の実現
+    VSK_STAGE_MIX,          // 波形の混合
+    VSK_STAGE_WRITE_WAV,    // WAVファイルの書き込み
+    VSK_STAGE_REGISTRY,     // レジストリの読み書き
+    VSK_STAGE_DEVICE,       // 出力デバイスへの受け渡し
+    VSK_STAGE_NUM
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// VskStats - 統計
+//
+// エンジンの m_stats に設定したときだけ集計される。nullなら何もしない。
+// 段階の時間は入れ子になった段階の時間を含まない。
+
+struct VskStageTime {
+    uint32_t    m_count = 0;        // 回数
+    double      m_wall = 0;         // 経過時間（秒）
+    double      m_cpu = 0;          // CPU時間（秒）
+};
+
+struct VskStats {
+    VskStageTime    m_stages[VSK_STAGE_NUM];    // 段階ごとの時間
+    int             m_current = -1;             // 計測中の段階
+    size_t          m_peak_buffer_bytes = 0;    // 波形バッファの最大バイト数
+    uint64_t        m_num_samples = 0;          // 生成したサンプル数
+    uint64_t        m_reg_writes[4] = { 0 };    // レジスタ書き込み回数 (#0, #1, 並列描画用, #2以降)
+    uint64_t        m_reg_skips[4] = { 0 };     // 値が変わらず省いた書き込み回数 (#0, #1, 並列描画用, #2以降)
+    uint64_t        m_prepares[4] = { 0 };      // パラメータの再計算回数 (#0, #1, 並列描画用, #2以降)
+    uint64_t        m_arena_acquires = 0;       // バッファの置き場から借りた回数
+    uint64_t        m_arena_allocs = 0;         // 置き場がシステムから確保した回数
+    uint64_t        m_arena_huge_allocs = 0;    // そのうちラージページで確保した回数
+    size_t          m_arena_peak_bytes = 0;     // 置き場が確保したバイト数の最大値
+    double          m_start_wall;               // 集計を開始した時刻
+    double          m_start_cpu;                // 集計を開始したCPU時間
+
+    VskStats();
+
+    void note_buffer(size_t bytes) {
+        if (m_peak_buffer_bytes < bytes)
+            m_peak_buffer_bytes = bytes;
+    }
+
+    // サウンドプレーヤーの音源の数を足し込む。プレーヤーを解放する前に呼ぶ
+    void collect(VskSoundPlayer& player);
+
+    // エンジンの統計をJSONとして出力する
+    void dump(VskEngine& engine, FILE *fout);
+}; // struct VskStats
+
+double vsk_stats_wall_time(void);
+double vsk_stats_cpu_time(void);
+
+//////////////////////////////////////////////////////////////////////////////
+// VskStageTimer - 段階の時間を計測する
+
+class VskStageTimer {
+public:
+    VskStageTimer(VskStats *stats, VskStage stage) : m_stats(stats) {
+        if (!m_stats)
+            return;
+        m_stage = stage;
+        m_parent = m_stats->m_current;
+        m_stats->m_current = stage;
+        m_wall = vsk_stats_wall_time();
+        m_cpu = vsk_stats_cpu_time();
+    }
+
+    ~VskStageTimer() {
+        if (!m_stats)
+            return;
+        double wall = vsk_stats_wall_time() - m_wall;
+        double cpu = vsk_stats_cpu_time() - m_cpu;
+        VskStageTime& time = m_stats->m_stages[m_stage];
+        ++time.m_count;
+        time.m_wall += wall;
+        time.m_cpu += cpu;
+        // 親の段階から差し引く
+        if (m_parent >= 0) {
+            m_stats->m_stages[m_parent].m_wall -= wall;
+            m_stats->m_stages[m_parent].m_cpu -= cpu;
+        }
+        m_stats->m_current = m_parent;
+    }
+
+protected:
+    VskStats   *m_stats;
+    VskStage    m_stage;
+    int         m_parent;
+    double      m_wall;
+    double      m_cpu;
+
+    VskStageTimer(const VskStageTimer&) = delete;
+    VskStageTimer& operator=(const VskStageTimer&) = delete;
+}; // class VskStageTimer
+
+//////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,99 @@
+﻿//////////////////////////////////////////////////////////////////////////////
+// task --- asynchronous rendering and playing of CMD SING / CMD PLAY
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "task.h"
+#include "engine.h"
+
+VskTask::VskTask(VskEngine& engine, VskTaskFn fn, VskTaskCallback callback, void *user)
+    : m_engine(engine)
+    , m_fn(fn)
+    , m_callback(callback)
+    , m_user(user)
+    , m_token(std::make_shared<VskCancelToken>())
+    , m_done(false)
+    , m_result(VSK_SOUND_ERR_SUCCESS)
+    , m_done_event(true, false)
+{
+}
+
+VskTask::~VskTask()
+{
+    if (m_thread)
+        m_thread->join();
+}
+
+// タスクのスレッドで実行する
+void VskTask::run()
+{
+    VSK_SOUND_ERR result = VSK_SOUND_ERR_CANCELLED;
+    if (!m_token->is_cancelled()) {
+        VskSoundPlayer& player = *m_engine.m_player;
+        player.m_cancel = m_token;
+        result = m_fn(m_engine);
+        player.m_cancel = nullptr;
+
+        // 取り消されて失敗したのなら、失敗の理由は取り消し
+        if (m_token->is_cancelled())
+            result = VSK_SOUND_ERR_CANCELLED;
+    }
+
+    m_result = result;
+    m_done = true;
+    if (m_callback)
+        m_callback(*this, m_user);
+    m_done_event.set();
+}
+
+bool VskTask::wait(uint32_t milliseconds)
+{
+    // NOTE: wait_for_event() returns true if timeout.
+    return !m_done_event.wait_for_event(milliseconds);
+}
+
+VSK_SOUND_ERR VskTask::get_result()
+{
+    wait();
+    return m_result;
+}
+
+// fnを別のスレッドで実行するタスクを始める。
+// 前のタスクを待つ間は同じエンジンのロックだけを持つので、他のエンジンは待たない。
+// コールバックの中でタスクを始めたり待ったりしないこと
+std::shared_ptr<VskTask>
+vsk_task_start(VskEngine& engine, VskTaskFn fn, VskTaskCallback callback, void *user)
+{
+    engine.m_task_lock.lock();
+
+    // 前のタスクを取り消して、描画中のブロックが終わるのを待つ
+    if (engine.m_task) {
+        engine.m_task->cancel();
+        engine.m_task->wait();
+    }
+
+    std::shared_ptr<VskTask> task(new VskTask(engine, fn, callback, user));
+    engine.m_task = task;
+
+    // スレッドはタスクを所有しない。タスクを破棄するときにスレッドを待つ
+    VskTask *ptask = task.get();
+    task->m_thread.reset(new unboost::thread([ptask](int dummy) {
+        ptask->run();
+    }, 0));
+
+    engine.m_task_lock.unlock();
+    return task;
+}
+
+// エンジンのタスクを取り消して、終わるまで待つ
+void vsk_task_cancel(VskEngine& engine)
+{
+    engine.m_task_lock.lock();
+    if (engine.m_task) {
+        engine.m_task->cancel();
+        engine.m_task->wait();
+    }
+    engine.m_task_lock.unlock();
+}
+
+//////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,100 @@
+//////////////////////////////////////////////////////////////////////////////
+// task --- asynchronous rendering and playing of CMD SING / CMD PLAY
+// Copyright (C) 2015-2025 Katayama Hirofumi MZ. All Rights Reserved.
+//////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "types.h"
+#include "sound.h"
+#include "soundplayer.h"
+#include <functional>
+
+struct VskEngine;
+class VskTask;
+
+// タスクが終わったときに呼ばれる関数。タスクのスレッドで呼ばれる
+typedef void (*VskTaskCallback)(VskTask& task, void *user);
+
+// タスクの本体。タスクのスレッドでエンジンを使う
+typedef std::function<VSK_SOUND_ERR(VskEngine& engine)> VskTaskFn;
+
+//////////////////////////////////////////////////////////////////////////////
+// VskTask - 非同期の描画・演奏
+//
+// vsk_task_start などはすぐに戻り、解析と描画は別のスレッドで行う。
+// 一つのエンジンで同時に動くタスクは一つだけで、新しいタスクを始めると
+// 前のタスクを取り消して、描画中のブロックが終わるのを待ってから始める。
+// タスクが動いている間は、同じエンジンで同期版の関数を呼ばないこと。
+// 取り消しは描画だけを止める。鳴り始めた音は vsk_sound_stop で止める。
+
+class VskTask {
+public:
+    ~VskTask();
+
+    // 終わったか？
+    bool is_done() const { return m_done; }
+    // 終わるまで待つ。時間切れならfalseを返す
+    bool wait(uint32_t milliseconds = uint32_t(-1));
+    // 結果を取得する。終わるまで待つ。取り消されたら VSK_SOUND_ERR_CANCELLED
+    VSK_SOUND_ERR get_result();
+
+    // 描画したサンプル数と、描画するサンプル数（描画を始めたブロックの分）
+    uint64_t get_samples_done() const { return m_token->m_samples_done; }
+    uint64_t get_samples_total() const { return m_token->m_samples_total; }
+
+    // 取り消す。描画は次のブロックで止まる
+    void cancel() { m_token->cancel(); }
+    bool is_cancelled() const { return m_token->is_cancelled(); }
+    std::shared_ptr<VskCancelToken> get_token() const { return m_token; }
+
+protected:
+    VskEngine&                          m_engine;       // 使うエンジン
+    VskTaskFn                           m_fn;           // タスクの本体
+    VskTaskCallback                     m_callback;     // 終わったときに呼ぶ関数
+    void                               *m_user;         // コールバックに渡す値
+    std::shared_ptr<VskCancelToken>     m_token;        // 取り消しと進み具合
+    std::atomic<bool>                   m_done;         // 終わったか？
+    VSK_SOUND_ERR                       m_result;       // 結果
+    PE_event                            m_done_event;   // 終わったときにセットされる
+    std::unique_ptr<unboost::thread>    m_thread;       // タスクのスレッド
+
+    VskTask(VskEngine& engine, VskTaskFn fn, VskTaskCallback callback, void *user);
+    void run();
+
+    friend std::shared_ptr<VskTask>
+    vsk_task_start(VskEngine& engine, VskTaskFn fn, VskTaskCallback callback, void *user);
+
+    VskTask(const VskTask&) = delete;
+    VskTask& operator=(const VskTask&) = delete;
+}; // class VskTask
+
+// fnを別のスレッドで実行するタスクを始める
+std::shared_ptr<VskTask>
+vsk_task_start(VskEngine& engine, VskTaskFn fn, VskTaskCallback callback = nullptr, void *user = nullptr);
+
+// エンジンのタスクを取り消して、終わるまで待つ
+void vsk_task_cancel(VskEngine& engine);
+
+//////////////////////////////////////////////////////////////////////////////
+// 非同期版のCMD SING / CMD PLAY (cmd_sing.cpp, cmd_play.cpp)
+//
+// 文字列は複製するので、呼び出し元はすぐに解放してよい。
+
+std::shared_ptr<VskTask>
+vsk_sound_cmd_sing_async(VskEngine& engine, const char *str, bool stereo, bool no_sound,
+                         VskTaskCallback callback = nullptr, void *user = nullptr);
+std::shared_ptr<VskTask>
+vsk_sound_cmd_sing_save_async(VskEngine& engine, const char *str, const wchar_t *filename, bool stereo,
+                              VskTaskCallback callback = nullptr, void *user = nullptr);
+std::shared_ptr<VskTask>
+vsk_sound_cmd_play_ssg_async(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound,
+                             VskTaskCallback callback = nullptr, void *user = nullptr);
+std::shared_ptr<VskTask>
+vsk_sound_cmd_play_fm_and_ssg_async(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound,
+                                    VskTaskCallback callback = nullptr, void *user = nullptr);
+std::shared_ptr<VskTask>
+vsk_sound_cmd_play_fm_async(VskEngine& engine, const std::vector<VskString>& strs, bool stereo, bool no_sound,
+                            VskTaskCallback callback = nullptr, void *user = nullptr);
+
+//////////////////////////////////////////////////////////////////////////////